@@ -0,0 +1,331 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "arena.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define ARENA_HUGE (2 * 1024 * 1024)
+#define ARENA_ORDERS 32
+#define ARENA_FREE 0x80
+
+struct arena_t
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t freed_cond;
+#endif
+    unsigned char *base;
+    size_t size;
+    size_t map_size;
+    size_t blocks;
+    int32_t *next;
+    int32_t *prev;
+    unsigned char *order;
+    int32_t heads[ARENA_ORDERS];
+    unsigned long freed;
+    int top;
+};
+
+static void arena_lock(arena_t *arena)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&arena->lock);
+#else
+    (void)arena;
+#endif
+}
+
+static void arena_unlock(arena_t *arena)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&arena->lock);
+#else
+    (void)arena;
+#endif
+}
+
+/*
+ * Add the free run of blocks starting at the given block to the free
+ * list of its order.
+ */
+static void arena_push(arena_t *arena, int32_t block, int order)
+{
+    arena->order[block] = order | ARENA_FREE;
+    arena->prev[block] = -1;
+    arena->next[block] = arena->heads[order];
+    if (arena->heads[order] >= 0) {
+        arena->prev[arena->heads[order]] = block;
+    }
+    arena->heads[order] = block;
+}
+
+/*
+ * Remove the given free run of blocks from the free list of its order.
+ */
+static void arena_remove(arena_t *arena, int32_t block, int order)
+{
+    if (arena->prev[block] >= 0) {
+        arena->next[arena->prev[block]] = arena->next[block];
+    }
+    else {
+        arena->heads[order] = arena->next[block];
+    }
+    if (arena->next[block] >= 0) {
+        arena->prev[arena->next[block]] = arena->prev[block];
+    }
+    arena->order[block] = order;
+}
+
+arena_t *arena_create(size_t budget, size_t largest, int huge)
+{
+    arena_t *arena;
+    size_t block;
+    int order;
+
+    arena = calloc(1, sizeof(arena_t));
+    if (!arena) {
+        return NULL;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&arena->lock, NULL);
+    pthread_cond_init(&arena->freed_cond, NULL);
+#endif
+
+    while ((size_t)ARENA_BLOCK << arena->top < largest
+            && arena->top < ARENA_ORDERS - 1) {
+        arena->top++;
+    }
+
+    arena->size = (budget + ARENA_BLOCK - 1) / ARENA_BLOCK * ARENA_BLOCK;
+    if (arena->size < (size_t)ARENA_BLOCK << arena->top) {
+        arena->size = (size_t)ARENA_BLOCK << arena->top;
+    }
+    arena->blocks = arena->size / ARENA_BLOCK;
+    if (arena->blocks > INT32_MAX) {
+        arena_destroy(arena);
+        return NULL;
+    }
+
+    arena->base = MAP_FAILED;
+    arena->map_size = arena->size;
+
+#ifdef MAP_HUGETLB
+    if (huge) {
+        arena->map_size = (arena->size + ARENA_HUGE - 1) / ARENA_HUGE
+                * ARENA_HUGE;
+        arena->base = mmap(NULL, arena->map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (arena->base == MAP_FAILED) {
+        arena->base = mmap(NULL, arena->map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (huge && arena->base != MAP_FAILED) {
+            madvise(arena->base, arena->map_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (arena->base == MAP_FAILED) {
+        arena->base = NULL;
+        arena_destroy(arena);
+        return NULL;
+    }
+
+    arena->next = malloc(arena->blocks * sizeof(int32_t));
+    arena->prev = malloc(arena->blocks * sizeof(int32_t));
+    arena->order = malloc(arena->blocks);
+    if (!arena->next || !arena->prev || !arena->order) {
+        arena_destroy(arena);
+        return NULL;
+    }
+
+    for (order = 0; order < ARENA_ORDERS; order++) {
+        arena->heads[order] = -1;
+    }
+
+    /* carve the arena into the largest aligned runs that fit */
+    for (block = 0; block < arena->blocks; block += (size_t)1 << order) {
+        order = arena->top;
+        while (order && ((block & (((size_t)1 << order) - 1))
+                || block + ((size_t)1 << order) > arena->blocks)) {
+            order--;
+        }
+        arena_push(arena, block, order);
+    }
+
+    return arena;
+}
+
+/*
+ * Take the smallest free run of at least the wanted order, splitting
+ * it down to size, or failing that the largest smaller run.
+ */
+static void *arena_take(arena_t *arena, size_t want, size_t *got)
+{
+    int32_t block;
+    int order = 0, found;
+
+    while (order < arena->top && (size_t)ARENA_BLOCK << order < want) {
+        order++;
+    }
+
+    for (found = order; found <= arena->top && arena->heads[found] < 0;
+            found++);
+    if (found > arena->top) {
+        for (found = order - 1; found >= 0 && arena->heads[found] < 0;
+                found--);
+        if (found < 0) {
+            return NULL;
+        }
+        order = found;
+    }
+
+    block = arena->heads[found];
+    arena_remove(arena, block, found);
+
+    /* hand back the halves we do not need */
+    while (found > order) {
+        found--;
+        arena_push(arena, block + ((int32_t)1 << found), found);
+    }
+    arena->order[block] = order;
+
+    *got = (size_t)ARENA_BLOCK << order;
+
+    return arena->base + (size_t)block * ARENA_BLOCK;
+}
+
+void *arena_alloc(arena_t *arena, size_t want, size_t *got)
+{
+    void *buffer;
+
+    arena_lock(arena);
+    buffer = arena_take(arena, want, got);
+    arena_unlock(arena);
+
+    return buffer;
+}
+
+void *arena_wait(arena_t *arena, size_t want, size_t *got)
+{
+    void *buffer;
+
+    arena_lock(arena);
+    while (!(buffer = arena_take(arena, want, got))) {
+#ifdef HAVE_PTHREAD_H
+        pthread_cond_wait(&arena->freed_cond, &arena->lock);
+#else
+        break;
+#endif
+    }
+    arena_unlock(arena);
+
+    return buffer;
+}
+
+size_t arena_free(arena_t *arena, void *buffer)
+{
+    int32_t block;
+    size_t size;
+    int order;
+
+    if (!buffer) {
+        return 0;
+    }
+
+    arena_lock(arena);
+
+    block = ((unsigned char *)buffer - arena->base) / ARENA_BLOCK;
+    order = arena->order[block];
+    size = (size_t)ARENA_BLOCK << order;
+
+    /* merge with the buddy for as long as the buddy is free */
+    while (order < arena->top) {
+        int32_t buddy = block ^ ((int32_t)1 << order);
+
+        if ((size_t)buddy + ((size_t)1 << order) > arena->blocks
+                || arena->order[buddy] != (order | ARENA_FREE)) {
+            break;
+        }
+        arena_remove(arena, buddy, order);
+        block &= ~((int32_t)1 << order);
+        order++;
+    }
+    arena_push(arena, block, order);
+
+    arena->freed++;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_broadcast(&arena->freed_cond);
+#endif
+
+    arena_unlock(arena);
+
+    return size;
+}
+
+unsigned long arena_freed(arena_t *arena)
+{
+    unsigned long freed;
+
+    arena_lock(arena);
+    freed = arena->freed;
+    arena_unlock(arena);
+
+    return freed;
+}
+
+void *arena_base(arena_t *arena, size_t *len)
+{
+    *len = arena->size;
+
+    return arena->base;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&arena->freed_cond);
+    pthread_mutex_destroy(&arena->lock);
+#endif
+
+    if (arena->base) {
+        munmap(arena->base, arena->map_size);
+    }
+    free(arena->next);
+    free(arena->prev);
+    free(arena->order);
+    free(arena);
+}
@@ -0,0 +1,94 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * A shared arena of fragment buffers, within a fixed memory budget.
+ *
+ * The arena is a single mapping of the size of the budget, handed out
+ * in power of two blocks by a buddy allocator, so that one source may
+ * take a large buffer while few sources are busy, and many sources may
+ * share the same memory in smaller buffers when many are. Pages are
+ * only touched as they are used. Where asked, the mapping is backed by
+ * huge pages, falling back to transparent huge pages, and then to
+ * normal pages.
+ *
+ * The bookkeeping is kept apart from the buffers themselves, so that
+ * freed memory is not touched again until it is next handed out.
+ *
+ * The arena may be shared between threads.
+ */
+
+#include <stddef.h>
+
+/* the smallest block handed out, every block being a power of two of these */
+#define ARENA_BLOCK 4096
+
+typedef struct arena_t arena_t;
+
+/*
+ * Create an arena of the given budget in bytes, handing out buffers of
+ * up to largest bytes. The budget is rounded up to at least one buffer
+ * of the largest size.
+ *
+ * Returns NULL if the memory could not be mapped.
+ */
+arena_t *arena_create(size_t budget, size_t largest, int huge);
+
+/*
+ * Take a buffer of the wanted size, or the largest smaller buffer
+ * available should the budget not allow it, setting got to the size
+ * of the buffer, which may be larger than wanted.
+ *
+ * Returns NULL if the budget is exhausted.
+ */
+void *arena_alloc(arena_t *arena, size_t want, size_t *got);
+
+/*
+ * Take a buffer as arena_alloc() does, waiting for another thread to
+ * free some memory if the budget is exhausted.
+ */
+void *arena_wait(arena_t *arena, size_t want, size_t *got);
+
+/*
+ * Return a buffer to the arena.
+ *
+ * Returns the size of the buffer, as given by got when it was taken.
+ */
+size_t arena_free(arena_t *arena, void *buffer);
+
+/*
+ * Returns a count that changes each time memory is freed, so that a
+ * caller holding back sources for want of memory knows when to try
+ * again.
+ */
+unsigned long arena_freed(arena_t *arena);
+
+/*
+ * Returns the start of the arena, and sets len to its size, such as
+ * for registering the memory with io_uring.
+ */
+void *arena_base(arena_t *arena, size_t *len);
+
+/*
+ * Unmap the arena and free its bookkeeping.
+ */
+void arena_destroy(arena_t *arena);
+
+#endif
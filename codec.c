@@ -0,0 +1,128 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "codec.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+int codec_parse(const char *name, int *level)
+{
+    const char *colon = strchr(name, ':');
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+    size_t len = colon ? (size_t)(colon - name) : strlen(name);
+#endif
+
+    if (level) {
+        *level = colon ? atoi(colon + 1) : 0;
+    }
+
+#ifdef HAVE_ZSTD
+    if (len == 4 && !strncmp(name, "zstd", len)) {
+        return CODEC_ZSTD;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (len == 3 && !strncmp(name, "lz4", len)) {
+        return CODEC_LZ4;
+    }
+#endif
+
+    return -1;
+}
+
+const char *codec_name(codec_e codec)
+{
+    switch (codec) {
+    case CODEC_ZSTD:
+        return "zstd";
+    case CODEC_LZ4:
+        return "lz4";
+    default:
+        return "none";
+    }
+}
+
+size_t codec_bound(codec_e codec, size_t len)
+{
+    switch (codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return LZ4_compressBound(len);
+#endif
+    default:
+        return len;
+    }
+}
+
+ssize_t codec_compress(codec_e codec, int level, const void *src, size_t len,
+        void *dst, size_t cap)
+{
+    switch (codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t size = ZSTD_compress(dst, cap, src, len,
+                level ? level : ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(size) ? -1 : (ssize_t)size;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int size = level > 1 ?
+                LZ4_compress_HC(src, dst, len, cap, level) :
+                LZ4_compress_default(src, dst, len, cap);
+        return size > 0 ? size : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+ssize_t codec_decompress(codec_e codec, const void *src, size_t len,
+        void *dst, size_t size)
+{
+    switch (codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t got = ZSTD_decompress(dst, size, src, len);
+        return ZSTD_isError(got) || got != size ? -1 : (ssize_t)got;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int got = LZ4_decompress_safe(src, dst, len, size);
+        return got < 0 || (size_t)got != size ? -1 : got;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
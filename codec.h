@@ -0,0 +1,73 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Compression of individual fragments.
+ *
+ * Each fragment is compressed on its own, so that fragments can be
+ * compressed and decompressed in parallel, and a fragment that does not
+ * compress can be stored as is.
+ */
+
+#define CODEC_ATTR_NAME "tarmux.compression"
+#define CODEC_ATTR_SIZE "tarmux.size"
+
+typedef enum codec_e
+{
+    CODEC_NONE = 0,
+    CODEC_ZSTD,
+    CODEC_LZ4
+} codec_e;
+
+/*
+ * Parse a codec name, with an optional level following a colon, such
+ * as "zstd:19". Returns -1 if the codec is unknown or not supported by
+ * this build. The level may be NULL if not wanted.
+ */
+int codec_parse(const char *name, int *level);
+
+/*
+ * Returns the name of the codec, as recorded against each fragment.
+ */
+const char *codec_name(codec_e codec);
+
+/*
+ * Returns the largest size a fragment of len bytes may compress to.
+ */
+size_t codec_bound(codec_e codec, size_t len);
+
+/*
+ * Compress len bytes into dst, returning the compressed length, or -1
+ * on error.
+ */
+ssize_t codec_compress(codec_e codec, int level, const void *src, size_t len,
+        void *dst, size_t cap);
+
+/*
+ * Decompress len bytes into dst, which must hold exactly size bytes.
+ * Returns the decompressed length, or -1 on error.
+ */
+ssize_t codec_decompress(codec_e codec, const void *src, size_t len,
+        void *dst, size_t size);
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "control.h"
+
+/* descriptors accepted with one datagram, the rest are closed */
+#define CONTROL_FDS 4
+
+struct control_t
+{
+    char *path;
+    char buf[CONTROL_MAX + 1];
+    size_t fill;
+    size_t next;
+    int fd;
+    int socket;
+};
+
+control_t *control_create(const char *path)
+{
+    control_t *control;
+    struct stat st;
+    int flags;
+
+    control = calloc(1, sizeof(control_t));
+    if (!control || !(control->path = strdup(path))) {
+        free(control);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!stat(path, &st) && S_ISFIFO(st.st_mode)) {
+
+        /* held open for writing too, so writers may come and go */
+        control->fd = open(path, O_RDWR | O_NONBLOCK);
+
+    }
+    else {
+        struct sockaddr_un addr = { 0 };
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        control->socket = 1;
+        control->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+        if (control->fd >= 0) {
+            if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+                unlink(path);
+            }
+            if (bind(control->fd, (struct sockaddr *)&addr,
+                    sizeof(addr)) < 0) {
+                close(control->fd);
+                control->socket = 0;
+                goto fail;
+            }
+        }
+
+    }
+
+    if (control->fd < 0) {
+        goto fail;
+    }
+
+    flags = fcntl(control->fd, F_GETFL);
+    if (flags < 0 || fcntl(control->fd, F_SETFL, flags | O_NONBLOCK) < 0
+            || fcntl(control->fd, F_SETFD, FD_CLOEXEC) < 0) {
+        control_destroy(control);
+        return NULL;
+    }
+
+    return control;
+
+fail:
+    free(control->path);
+    free(control);
+    return NULL;
+}
+
+int control_fd(control_t *control)
+{
+    return control->fd;
+}
+
+/*
+ * Receive the next datagram, keeping the first descriptor passed with
+ * it. Returns the line, or NULL with errno set.
+ */
+static char *control_recv(control_t *control, int *fd)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(CONTROL_FDS * sizeof(int))];
+    } cmsg;
+    struct cmsghdr *c;
+    struct msghdr msg = { 0 };
+    struct iovec iov;
+    ssize_t len;
+
+    iov.iov_base = control->buf;
+    iov.iov_len = CONTROL_MAX;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    do {
+        len = recvmsg(control->fd, &msg, 0);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0) {
+        return NULL;
+    }
+
+    for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int *fds = (int *)CMSG_DATA(c);
+            int i, count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (i = 0; i < count; i++) {
+                if (*fd < 0) {
+                    *fd = fds[i];
+                }
+                else {
+                    close(fds[i]);
+                }
+            }
+        }
+    }
+
+    /* an overlong command is not to be half obeyed */
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        len = 0;
+    }
+
+    control->buf[len] = 0;
+
+    return control->buf;
+}
+
+/*
+ * Take the next whole line from the FIFO. Returns the line, or NULL
+ * with errno set.
+ */
+static char *control_read(control_t *control)
+{
+    for (;;) {
+        char *line = control->buf + control->next;
+        char *eol = memchr(line, '\n', control->fill - control->next);
+        ssize_t len;
+
+        if (eol) {
+            *eol = 0;
+            control->next = eol + 1 - control->buf;
+            return line;
+        }
+
+        /* make room, dropping a line too long to ever fit */
+        memmove(control->buf, line, control->fill - control->next);
+        control->fill -= control->next;
+        control->next = 0;
+        if (control->fill == CONTROL_MAX) {
+            control->fill = 0;
+        }
+
+        do {
+            len = read(control->fd, control->buf + control->fill,
+                    CONTROL_MAX - control->fill);
+        } while (len < 0 && errno == EINTR);
+
+        if (len < 0) {
+            return NULL;
+        }
+        else if (len == 0) {
+            errno = EAGAIN;
+            return NULL;
+        }
+
+        control->fill += len;
+    }
+}
+
+int control_next(control_t *control, const char **name, int *fd)
+{
+    char *line;
+    size_t len;
+    int command = CONTROL_INVALID;
+
+    *name = NULL;
+    *fd = -1;
+
+    line = control->socket ? control_recv(control, fd) :
+            control_read(control);
+    if (!line) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? CONTROL_NONE : -1;
+    }
+
+    len = strlen(line);
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        line[--len] = 0;
+    }
+
+    if (!strncmp(line, "add ", 4) && line[4]) {
+        *name = line + 4;
+        command = CONTROL_ADD;
+    }
+    else if (!strncmp(line, "remove ", 7) && line[7]) {
+        *name = line + 7;
+        command = CONTROL_REMOVE;
+    }
+    else if (!strcmp(line, "finish")) {
+        command = CONTROL_FINISH;
+    }
+
+    /* only an add has any use for a descriptor */
+    if (command != CONTROL_ADD && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return command;
+}
+
+void control_destroy(control_t *control)
+{
+    if (control) {
+        close(control->fd);
+        if (control->socket) {
+            unlink(control->path);
+        }
+        free(control->path);
+        free(control);
+    }
+}
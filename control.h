@@ -0,0 +1,76 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/*
+ * The control channel of a long running tarmux.
+ *
+ * Commands are single lines of text. Sent as datagrams to a UNIX
+ * socket, each datagram is one command, and an add may carry the
+ * descriptor to read from as SCM_RIGHTS. Written to a FIFO, commands
+ * are separated by newlines, and sources are named by path alone.
+ *
+ *   add <pathname>     add a source, embedded under the pathname
+ *   remove <pathname>  close the sources with the pathname
+ *   finish             stop listening, ending once the sources end
+ */
+
+#define CONTROL_MAX 4096
+
+typedef enum control_e
+{
+    CONTROL_NONE = 0,
+    CONTROL_ADD,
+    CONTROL_REMOVE,
+    CONTROL_FINISH,
+    CONTROL_INVALID
+} control_e;
+
+typedef struct control_t control_t;
+
+/*
+ * Listen on the given path. An existing FIFO is read as is, otherwise
+ * a UNIX datagram socket is created in its place, replacing any socket
+ * left behind by an earlier run.
+ *
+ * Returns NULL with errno set on error.
+ */
+control_t *control_create(const char *path);
+
+/*
+ * Returns the descriptor to wait on for commands.
+ */
+int control_fd(control_t *control);
+
+/*
+ * Read the next command without blocking, setting name to the pathname
+ * given, and fd to the descriptor passed with an add, or -1.
+ *
+ * Returns the command, CONTROL_NONE once nothing more is waiting, or -1
+ * with errno set on error.
+ */
+int control_next(control_t *control, const char **name, int *fd);
+
+/*
+ * Stop listening, removing the socket if we created it.
+ */
+void control_destroy(control_t *control);
+
+#endif
@@ -0,0 +1,224 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string.h>
+
+#include "config.h"
+#include "crc32c.h"
+
+#if defined(HAVE_NMMINTRIN_H) && defined(__GNUC__) \
+        && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+/* the Castagnoli polynomial, bit reflected */
+#define CRC32C_POLY 0x82f63b78
+
+/* the length of each of the three lanes run side by side */
+#define CRC32C_LANE 4096
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *buf,
+        size_t len);
+
+/*
+ * Update the CRC register with the given buffer, eight bytes at a time,
+ * using a table per byte position.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf,
+        size_t len)
+{
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff]
+                ^ crc32c_table[6][(word >> 8) & 0xff]
+                ^ crc32c_table[5][(word >> 16) & 0xff]
+                ^ crc32c_table[4][(word >> 24) & 0xff]
+                ^ crc32c_table[3][(word >> 32) & 0xff]
+                ^ crc32c_table[2][(word >> 40) & 0xff]
+                ^ crc32c_table[1][(word >> 48) & 0xff]
+                ^ crc32c_table[0][word >> 56];
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+/*
+ * Multiply two polynomials modulo the CRC polynomial, bit reflected.
+ */
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if (!(a & (m - 1))) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/* x^(8 * CRC32C_LANE) and x^(16 * CRC32C_LANE) modulo the polynomial */
+static uint32_t crc32c_shift1;
+static uint32_t crc32c_shift2;
+
+/*
+ * Update the CRC register with the given buffer using the SSE4.2 crc32
+ * instruction.
+ *
+ * The instruction takes three cycles but can start every cycle, so
+ * large buffers are run as three independent lanes side by side, and
+ * the lanes are then combined by shifting the earlier ones past the
+ * data that followed them.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf,
+        size_t len)
+{
+#ifdef __x86_64__
+    uint64_t crc0 = crc;
+
+    while (len && ((uintptr_t)buf & 7)) {
+        crc0 = _mm_crc32_u8(crc0, *buf++);
+        len--;
+    }
+
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char *end = buf + CRC32C_LANE;
+
+        do {
+            uint64_t w0, w1, w2;
+
+            memcpy(&w0, buf, 8);
+            memcpy(&w1, buf + CRC32C_LANE, 8);
+            memcpy(&w2, buf + 2 * CRC32C_LANE, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            buf += 8;
+        } while (buf < end);
+
+        crc0 = crc32c_multiply(crc32c_shift2, crc0)
+                ^ crc32c_multiply(crc32c_shift1, crc1) ^ crc2;
+
+        buf += 2 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = crc0;
+#else
+    while (len >= 4) {
+        uint32_t word;
+
+        memcpy(&word, buf, 4);
+        crc = _mm_crc32_u32(crc, word);
+        buf += 4;
+        len -= 4;
+    }
+#endif
+
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+
+    return crc;
+}
+#endif
+
+void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    if (crc32c_update) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+
+    crc32c_update = crc32c_sw;
+
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        uint32_t x = (uint32_t)1 << 31;
+
+        /* x^8 is a byte of zeros, square up to the length of a lane */
+        crc32c_shift1 = x >> 8;
+        for (i = 1; i < CRC32C_LANE; i <<= 1) {
+            crc32c_shift1 = crc32c_multiply(crc32c_shift1, crc32c_shift1);
+        }
+        crc32c_shift2 = crc32c_multiply(crc32c_shift1, crc32c_shift1);
+
+        crc32c_update = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~crc32c_update(~crc, buf, len);
+}
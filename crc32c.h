@@ -0,0 +1,42 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The extended attribute holding the CRC32C of a fragment's payload,
+ * as eight hex digits.
+ */
+#define CRC32C_ATTR_NAME "tarmux.crc32c"
+
+/*
+ * Choose the fastest implementation for this CPU. Must be called before
+ * any threads that use crc32c() are started.
+ */
+void crc32c_init(void);
+
+/*
+ * Extend the CRC32C (Castagnoli) of some data with the given buffer.
+ * Start with a crc of zero.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
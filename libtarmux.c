@@ -0,0 +1,758 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "codec.h"
+#include "crc32c.h"
+#include "libtarmux.h"
+#include "ustar.h"
+
+/* largest pax or long name entry we are prepared to hold */
+#define META_MAX (64 * 1024 * 1024)
+
+static const unsigned char zeros[TAR_RECORD_SIZE];
+
+struct tarmux_source_t
+{
+    tarmux_source_t *next;
+    tarmux_source_t **prev;
+    /* the pathname, followed by room for the fragment index */
+    char *name;
+    size_t len;
+    int64_t index;
+    /* room for the largest header the source can need */
+    unsigned char *header;
+};
+
+struct tarmux_t
+{
+    tarmux_writer_fn writer;
+    void *ctx;
+    tarmux_source_t *sources;
+    int64_t offset;
+    int64_t uid;
+    int64_t gid;
+    int64_t mtime;
+    int flags;
+};
+
+typedef enum demux_state_e
+{
+    DEMUX_HEADER = 0,
+    DEMUX_META,
+    DEMUX_DATA,
+    DEMUX_PACKED,
+    DEMUX_PAD,
+    DEMUX_END,
+    DEMUX_DONE,
+    DEMUX_ERROR
+} demux_state_e;
+
+struct tardemux_t
+{
+    tardemux_sink_fn sink;
+    void *ctx;
+    demux_state_e state;
+    const char *error;
+
+    /* the header block, or pax entry, being gathered */
+    unsigned char block[TAR_BLOCK_SIZE];
+    char *meta;
+    size_t meta_size;
+    size_t have;
+    int64_t remaining;
+    int64_t pad;
+    int64_t offset;
+    char type;
+
+    /* the fragment as far as we know it */
+    tardemux_fragment_t fragment;
+    char *pathname;
+    size_t pathname_size;
+    int has_pathname;
+    ustar_pax_t pax;
+    uint32_t sum;
+
+    /* compressed fragments are gathered whole */
+    unsigned char *packed;
+    size_t packed_size;
+    unsigned char *unpacked;
+    size_t unpacked_size;
+};
+
+tarmux_t *tarmux_create(tarmux_writer_fn writer, void *ctx, int flags)
+{
+    tarmux_t *mux = calloc(1, sizeof(tarmux_t));
+
+    if (!mux) {
+        return NULL;
+    }
+
+    crc32c_init();
+
+    mux->writer = writer;
+    mux->ctx = ctx;
+    mux->flags = flags;
+    mux->uid = getuid();
+    mux->gid = getgid();
+    mux->mtime = time(NULL);
+
+    return mux;
+}
+
+tarmux_source_t *tarmux_add(tarmux_t *mux, const char *pathname)
+{
+    tarmux_source_t *source;
+    ustar_header_t h = { 0 };
+    size_t len = strlen(pathname);
+    char *longest, records[64];
+
+    source = calloc(1, sizeof(tarmux_source_t));
+    if (!source) {
+        return NULL;
+    }
+
+    source->name = malloc(len + 22);
+    longest = malloc(len + 22);
+    if (!source->name || !longest) {
+        goto fail;
+    }
+    memcpy(source->name, pathname, len);
+    source->name[len] = 0;
+    source->len = len;
+
+    /* the header at its largest, with every record in it */
+    snprintf(longest, len + 22, "%s.%" PRId64, pathname, INT64_MAX);
+    h.pathname = longest;
+    h.len = strlen(longest);
+    h.uid = mux->uid;
+    h.gid = mux->gid;
+    h.size = INT64_MAX;
+    h.mtime = mux->mtime;
+    h.records_len = ustar_pax_record(records,
+            "SCHILY.xattr." CRC32C_ATTR_NAME, "00000000");
+    h.records = records;
+
+    source->header = calloc(1, ustar_header(NULL, &h));
+    free(longest);
+    if (!source->header) {
+        goto fail;
+    }
+
+    source->next = mux->sources;
+    source->prev = &mux->sources;
+    if (mux->sources) {
+        mux->sources->prev = &source->next;
+    }
+    mux->sources = source;
+
+    return source;
+
+fail:
+    free(longest);
+    free(source->name);
+    free(source);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/*
+ * Build the header of the next fragment of the given source into its
+ * header buffer, returning its length.
+ */
+static size_t mux_header(tarmux_t *mux, tarmux_source_t *source,
+        const void *buf, size_t len)
+{
+    ustar_header_t h = { 0 };
+    char crc[16], records[64];
+    size_t header_len;
+
+    h.pathname = source->name;
+    h.len = source->len + snprintf(source->name + source->len, 22,
+            ".%" PRId64, source->index++);
+    h.uid = mux->uid;
+    h.gid = mux->gid;
+    h.size = len;
+    h.mtime = mux->mtime;
+    h.mode = 0666;
+
+    if ((mux->flags & TARMUX_CHECKSUM) && len) {
+        snprintf(crc, sizeof(crc), "%08" PRIx32, crc32c(0, buf, len));
+        h.records_len = ustar_pax_record(records,
+                "SCHILY.xattr." CRC32C_ATTR_NAME, crc);
+        h.records = records;
+    }
+
+    header_len = ustar_header(source->header, &h);
+
+    source->name[source->len] = 0;
+
+    return header_len;
+}
+
+/*
+ * Hand the given buffers to the writer, keeping count of the offset.
+ */
+static int mux_writev(tarmux_t *mux, struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    if (mux->writer(mux->ctx, iov, iovcnt)) {
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        mux->offset += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+int tarmux_write(tarmux_t *mux, tarmux_source_t *source, const void *buf,
+        size_t len)
+{
+    struct iovec iov[3];
+
+    if (!len) {
+        return 0;
+    }
+
+    /* header, payload and padding in one go */
+    iov[0].iov_base = source->header;
+    iov[0].iov_len = mux_header(mux, source, buf, len);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)zeros;
+    iov[2].iov_len = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE))
+            % TAR_BLOCK_SIZE;
+
+    return mux_writev(mux, iov, iov[2].iov_len ? 3 : 2);
+}
+
+ssize_t tarmux_pull(tarmux_t *mux, tarmux_source_t *source,
+        tarmux_reader_fn reader, void *ctx, void *buffer, size_t size)
+{
+    ssize_t got = reader(ctx, buffer, size);
+
+    if (got < 0) {
+        return -1;
+    }
+    else if (!got) {
+        return tarmux_remove(mux, source);
+    }
+
+    if (tarmux_write(mux, source, buffer, got)) {
+        return -1;
+    }
+
+    return got;
+}
+
+static void mux_release(tarmux_source_t *source)
+{
+    *source->prev = source->next;
+    if (source->next) {
+        source->next->prev = source->prev;
+    }
+
+    free(source->header);
+    free(source->name);
+    free(source);
+}
+
+int tarmux_remove(tarmux_t *mux, tarmux_source_t *source)
+{
+    struct iovec iov;
+    int rv;
+
+    iov.iov_base = source->header;
+    iov.iov_len = mux_header(mux, source, NULL, 0);
+
+    rv = mux_writev(mux, &iov, 1);
+
+    mux_release(source);
+
+    return rv;
+}
+
+int tarmux_finish(tarmux_t *mux)
+{
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void *)zeros;
+    iov[0].iov_len = 2 * TAR_BLOCK_SIZE;
+    iov[1].iov_base = (void *)zeros;
+    iov[1].iov_len = (TAR_RECORD_SIZE - ((mux->offset + iov[0].iov_len)
+            % TAR_RECORD_SIZE)) % TAR_RECORD_SIZE;
+
+    return mux_writev(mux, iov, iov[1].iov_len ? 2 : 1);
+}
+
+void tarmux_destroy(tarmux_t *mux)
+{
+    if (mux) {
+        while (mux->sources) {
+            mux_release(mux->sources);
+        }
+        free(mux);
+    }
+}
+
+tardemux_t *tardemux_create(tardemux_sink_fn sink, void *ctx)
+{
+    tardemux_t *demux = calloc(1, sizeof(tardemux_t));
+
+    if (!demux) {
+        return NULL;
+    }
+
+    crc32c_init();
+
+    demux->sink = sink;
+    demux->ctx = ctx;
+
+    /* room for any ustar name, so that only long names allocate */
+    demux->pathname_size = USTAR_NAME_MAX;
+    demux->pathname = malloc(demux->pathname_size);
+    if (!demux->pathname) {
+        free(demux);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ustar_pax_reset(&demux->pax);
+
+    return demux;
+}
+
+/*
+ * Stop the demuxer with the given error.
+ */
+static int demux_fail(tardemux_t *demux, const char *error)
+{
+    demux->state = DEMUX_ERROR;
+    demux->error = error;
+
+    return -1;
+}
+
+/*
+ * Make sure the given buffer holds at least size bytes.
+ */
+static int demux_grow(void **buf, size_t *cap, size_t size)
+{
+    void *grown;
+
+    if (*cap >= size) {
+        return 0;
+    }
+
+    grown = realloc(*buf, size);
+    if (!grown) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = size;
+
+    return 0;
+}
+
+/*
+ * Keep the given pathname for the entry that follows.
+ */
+static int demux_pathname(tardemux_t *demux, const char *pathname,
+        size_t len)
+{
+    if (demux_grow((void **)&demux->pathname, &demux->pathname_size,
+            len + 1)) {
+        return demux_fail(demux, "Could not allocate pathname");
+    }
+    memcpy(demux->pathname, pathname, len);
+    demux->pathname[len] = 0;
+    demux->has_pathname = 1;
+
+    return 0;
+}
+
+/*
+ * Parse the records of a pax extended header, picking out the
+ * attributes we care about.
+ */
+static int demux_pax(tardemux_t *demux, char *pax, size_t len)
+{
+    if (ustar_pax(&demux->pax, pax, len)) {
+        return demux_fail(demux, "Corrupt pax extended header");
+    }
+    if (demux->pax.codec < 0) {
+        return demux_fail(demux, "Unsupported fragment codec");
+    }
+    if (demux->pax.path) {
+        if (demux_pathname(demux, demux->pax.path,
+                strlen(demux->pax.path))) {
+            return -1;
+        }
+        demux->pax.path = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * Forget the attributes of the entry just done.
+ */
+static void demux_reset(tardemux_t *demux)
+{
+    demux->has_pathname = 0;
+    ustar_pax_reset(&demux->pax);
+    demux->sum = 0;
+}
+
+/*
+ * Move on past the padding of the entry just read.
+ */
+static void demux_pad(tardemux_t *demux)
+{
+    demux->have = 0;
+    demux->remaining = demux->pad;
+    demux->state = demux->pad ? DEMUX_PAD : DEMUX_HEADER;
+}
+
+/*
+ * Check the payload of the fragment just read against its checksum.
+ */
+static int demux_verify(tardemux_t *demux)
+{
+    if (demux->pax.crc >= 0 && demux->sum != (uint32_t)demux->pax.crc) {
+        return demux_fail(demux, "Fragment checksum mismatch");
+    }
+
+    demux_reset(demux);
+    demux_pad(demux);
+
+    return 0;
+}
+
+/*
+ * Act on a complete pax or long name entry.
+ */
+static int demux_meta(tardemux_t *demux)
+{
+    size_t len = demux->have;
+
+    demux->meta[len] = 0;
+
+    switch (demux->type) {
+    case 'x':
+        if (demux_pax(demux, demux->meta, len)) {
+            return -1;
+        }
+        break;
+    case 'L':
+        if (demux_pathname(demux, demux->meta, strnlen(demux->meta, len))) {
+            return -1;
+        }
+        break;
+    }
+
+    demux_pad(demux);
+
+    return 0;
+}
+
+/*
+ * Act on a complete header block.
+ */
+static int demux_header(tardemux_t *demux)
+{
+    unsigned char *block = demux->block;
+    intmax_t index;
+    int64_t size;
+    int i;
+
+    /* end of archive, skip the second block and the rest of the record */
+    for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++);
+    if (i == TAR_BLOCK_SIZE) {
+        demux->remaining = TAR_BLOCK_SIZE + (TAR_RECORD_SIZE
+                - ((demux->offset + TAR_BLOCK_SIZE) % TAR_RECORD_SIZE))
+                % TAR_RECORD_SIZE;
+        demux->state = DEMUX_END;
+        return 0;
+    }
+
+    if (!ustar_checksum(block)) {
+        return demux_fail(demux, "Corrupt tar header checksum");
+    }
+
+    demux->type = block[156];
+    size = ustar_number(block + 124, 12);
+    if (size < 0) {
+        return demux_fail(demux, "Corrupt tar header size");
+    }
+
+    switch (demux->type) {
+    case 'x':
+    case 'L':
+    case 'g':
+        if (size > META_MAX) {
+            return demux_fail(demux, "Oversized tar metadata entry");
+        }
+        demux->remaining = (size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+        if (demux_grow((void **)&demux->meta, &demux->meta_size,
+                demux->remaining + 1)) {
+            return demux_fail(demux, "Could not allocate tar metadata");
+        }
+        demux->have = 0;
+        demux->pad = demux->remaining - size;
+        demux->remaining = size;
+        demux->state = DEMUX_META;
+        return demux->remaining ? 0 : demux_meta(demux);
+    case '0':
+    case '\0':
+    case '7':
+        break;
+    default:
+        return demux_fail(demux, "Unsupported tar entry type");
+    }
+
+    if (!demux->has_pathname) {
+        ustar_pathname(demux->pathname, block);
+    }
+    if (demux->pax.size < 0) {
+        demux->pax.size = size;
+    }
+
+    demux->pathname[ustar_pathlen(demux->pathname, &index)] = 0;
+    demux->fragment.pathname = demux->pathname;
+    demux->fragment.index = index;
+    demux->fragment.size = demux->pax.codec ?
+            demux->pax.original : demux->pax.size;
+    demux->fragment.offset = demux->pax.sparse;
+
+    demux->pad = (TAR_BLOCK_SIZE - (demux->pax.size % TAR_BLOCK_SIZE))
+            % TAR_BLOCK_SIZE;
+    demux->remaining = demux->pax.size;
+
+    /* the closing fragment */
+    if (!demux->pax.size) {
+        if (demux->sink(demux->ctx, &demux->fragment, NULL, 0)) {
+            return demux_fail(demux, "Stopped by the sink");
+        }
+        return demux_verify(demux);
+    }
+
+    if (demux->pax.codec) {
+        if (demux->pax.size > SSIZE_MAX || demux->pax.original <= 0
+                || demux_grow((void **)&demux->packed, &demux->packed_size,
+                        demux->pax.size)
+                || demux_grow((void **)&demux->unpacked, &demux->unpacked_size,
+                        demux->pax.original)) {
+            return demux_fail(demux, "Could not allocate fragment buffer");
+        }
+        demux->have = 0;
+        demux->state = DEMUX_PACKED;
+    }
+    else {
+        demux->state = DEMUX_DATA;
+    }
+
+    return 0;
+}
+
+/*
+ * Decompress a complete compressed fragment, and pass it on.
+ */
+static int demux_unpack(tardemux_t *demux)
+{
+    ssize_t len;
+
+    if (demux->pax.crc >= 0) {
+        demux->sum = crc32c(0, demux->packed, demux->have);
+    }
+
+    len = codec_decompress(demux->pax.codec, demux->packed, demux->have,
+            demux->unpacked, demux->pax.original);
+    if (len != demux->pax.original) {
+        return demux_fail(demux, "Could not decompress fragment");
+    }
+
+    if (demux->sink(demux->ctx, &demux->fragment, demux->unpacked, len)) {
+        return demux_fail(demux, "Stopped by the sink");
+    }
+
+    return demux_verify(demux);
+}
+
+ssize_t tardemux_push(tardemux_t *demux, const void *buf, size_t len)
+{
+    const unsigned char *data = buf;
+    size_t pos = 0, n;
+
+    while (pos < len) {
+
+        switch (demux->state) {
+        case DEMUX_HEADER:
+            n = TAR_BLOCK_SIZE - demux->have;
+            n = n < len - pos ? n : len - pos;
+            memcpy(demux->block + demux->have, data + pos, n);
+            demux->have += n;
+            break;
+        case DEMUX_META:
+        case DEMUX_PACKED:
+            n = demux->remaining < (int64_t)(len - pos) ?
+                    (size_t)demux->remaining : len - pos;
+            memcpy((demux->state == DEMUX_META ?
+                    (unsigned char *)demux->meta : demux->packed)
+                    + demux->have, data + pos, n);
+            demux->have += n;
+            demux->remaining -= n;
+            break;
+        case DEMUX_DATA:
+            n = demux->remaining < (int64_t)(len - pos) ?
+                    (size_t)demux->remaining : len - pos;
+            if (demux->pax.crc >= 0) {
+                demux->sum = crc32c(demux->sum, data + pos, n);
+            }
+            if (demux->sink(demux->ctx, &demux->fragment, data + pos, n)) {
+                return demux_fail(demux, "Stopped by the sink");
+            }
+            demux->remaining -= n;
+            break;
+        case DEMUX_PAD:
+        case DEMUX_END:
+            n = demux->remaining < (int64_t)(len - pos) ?
+                    (size_t)demux->remaining : len - pos;
+            demux->remaining -= n;
+            break;
+        case DEMUX_DONE:
+            return pos;
+        default:
+            return -1;
+        }
+
+        pos += n;
+        demux->offset += n;
+
+        switch (demux->state) {
+        case DEMUX_HEADER:
+            if (demux->have == TAR_BLOCK_SIZE) {
+                demux->have = 0;
+                if (demux_header(demux)) {
+                    return -1;
+                }
+            }
+            break;
+        case DEMUX_META:
+            if (!demux->remaining && demux_meta(demux)) {
+                return -1;
+            }
+            break;
+        case DEMUX_PACKED:
+            if (!demux->remaining && demux_unpack(demux)) {
+                return -1;
+            }
+            break;
+        case DEMUX_DATA:
+            if (!demux->remaining && demux_verify(demux)) {
+                return -1;
+            }
+            break;
+        case DEMUX_PAD:
+            if (!demux->remaining) {
+                demux->state = DEMUX_HEADER;
+            }
+            break;
+        case DEMUX_END:
+            if (!demux->remaining) {
+                demux->state = DEMUX_DONE;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return demux->state == DEMUX_ERROR ? -1 : (ssize_t)pos;
+}
+
+size_t tardemux_want(tardemux_t *demux)
+{
+    switch (demux->state) {
+    case DEMUX_HEADER:
+        return TAR_BLOCK_SIZE - demux->have;
+    case DEMUX_DONE:
+    case DEMUX_ERROR:
+        return 0;
+    default:
+        return demux->remaining;
+    }
+}
+
+ssize_t tardemux_pull(tardemux_t *demux, tarmux_reader_fn reader, void *ctx,
+        void *buffer, size_t size)
+{
+    size_t want = tardemux_want(demux);
+    ssize_t got;
+
+    if (!want) {
+        return demux->state == DEMUX_DONE ? 0 : -1;
+    }
+
+    got = reader(ctx, buffer, want < size ? want : size);
+    if (got < 0) {
+        return demux_fail(demux, "Could not read tar stream");
+    }
+    else if (!got) {
+        return demux_fail(demux, "Truncated tar stream");
+    }
+
+    return tardemux_push(demux, buffer, got);
+}
+
+int tardemux_done(tardemux_t *demux)
+{
+    return demux->state == DEMUX_DONE;
+}
+
+const char *tardemux_error(tardemux_t *demux)
+{
+    return demux->error;
+}
+
+void tardemux_destroy(tardemux_t *demux)
+{
+    if (demux) {
+        free(demux->meta);
+        free(demux->pathname);
+        free(demux->packed);
+        free(demux->unpacked);
+        free(demux);
+    }
+}
@@ -0,0 +1,204 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef LIBTARMUX_H
+#define LIBTARMUX_H
+
+/*
+ * Multiplex and demultiplex streams using tar file fragments, in
+ * process.
+ *
+ * The muxer turns each buffer handed to it into one fragment, written
+ * to the caller's writer as a header, the caller's buffer as is, and
+ * the padding, so that no data is copied. The demuxer is pushed the
+ * tar stream in buffers of any size, and passes the payload of each
+ * fragment to the caller's sink straight out of those buffers.
+ *
+ * Once a source has been added, nothing is allocated on the way
+ * through, except by the demuxer when a fragment is compressed, or
+ * when a header grows beyond any seen before.
+ *
+ * The fragments are those of tarmux and tardemux, and the two mix
+ * freely with the library.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Write the whole of the given buffers, returning 0 on success, or -1
+ * on error with errno set.
+ */
+typedef int (*tarmux_writer_fn)(void *ctx, const struct iovec *iov,
+        int iovcnt);
+
+/*
+ * Read up to len bytes into buf, returning the length read, 0 at the
+ * end of the stream, or -1 on error with errno set.
+ */
+typedef ssize_t (*tarmux_reader_fn)(void *ctx, void *buf, size_t len);
+
+/* add the CRC32C of each payload to its fragment */
+#define TARMUX_CHECKSUM 1
+
+typedef struct tarmux_t tarmux_t;
+typedef struct tarmux_source_t tarmux_source_t;
+
+/*
+ * Create a muxer writing the tar stream to the given writer.
+ *
+ * Returns NULL with errno set on error.
+ */
+tarmux_t *tarmux_create(tarmux_writer_fn writer, void *ctx, int flags);
+
+/*
+ * Add a source with the given pathname, which need not be unique.
+ *
+ * Returns NULL with errno set on error.
+ */
+tarmux_source_t *tarmux_add(tarmux_t *mux, const char *pathname);
+
+/*
+ * Write len bytes as the next fragment of the given source. Writing
+ * nothing does nothing, as the empty fragment marks the end of the
+ * source.
+ *
+ * Returns 0 on success, or -1 with errno set if the writer failed.
+ */
+int tarmux_write(tarmux_t *mux, tarmux_source_t *source, const void *buf,
+        size_t len);
+
+/*
+ * Read up to size bytes from the given reader into the caller's
+ * buffer, and write them as the next fragment of the given source.
+ * At the end of the stream the source is removed as tarmux_remove()
+ * does, and must not be used again.
+ *
+ * Returns the length read, 0 at the end of the stream, or -1 with
+ * errno set on error.
+ */
+ssize_t tarmux_pull(tarmux_t *mux, tarmux_source_t *source,
+        tarmux_reader_fn reader, void *ctx, void *buffer, size_t size);
+
+/*
+ * Write the closing fragment of the given source, and release it.
+ *
+ * Returns 0 on success, or -1 with errno set if the writer failed, in
+ * which case the source is released all the same.
+ */
+int tarmux_remove(tarmux_t *mux, tarmux_source_t *source);
+
+/*
+ * Write the end of archive marker, padded out to a whole record. Any
+ * sources still open are left unclosed.
+ *
+ * Returns 0 on success, or -1 with errno set if the writer failed.
+ */
+int tarmux_finish(tarmux_t *mux);
+
+/*
+ * Release the muxer, and any sources still open, without writing
+ * anything further.
+ */
+void tarmux_destroy(tarmux_t *mux);
+
+typedef struct tardemux_fragment_t
+{
+    /* the name of the source, without the fragment index */
+    const char *pathname;
+    /* the fragment index, or -1 if the name carries none */
+    int64_t index;
+    /* where the payload starts in the source after a hole, or -1 */
+    int64_t offset;
+    /* the full length of the payload, once decompressed */
+    int64_t size;
+} tardemux_fragment_t;
+
+/*
+ * Take the next len bytes of the payload of the given fragment. The
+ * payload of a fragment may arrive over several calls. A call with a
+ * len of zero is the closing fragment, marking the end of the source.
+ *
+ * Returns 0 to carry on, or non-zero to stop the demuxer.
+ */
+typedef int (*tardemux_sink_fn)(void *ctx,
+        const tardemux_fragment_t *fragment, const void *buf, size_t len);
+
+typedef struct tardemux_t tardemux_t;
+
+/*
+ * Create a demuxer passing the payload of each fragment to the given
+ * sink.
+ *
+ * Returns NULL with errno set on error.
+ */
+tardemux_t *tardemux_create(tardemux_sink_fn sink, void *ctx);
+
+/*
+ * Push the next len bytes of the tar stream through the demuxer.
+ *
+ * Returns the length consumed, which falls short of len only once the
+ * end of the archive has been reached, leaving whatever follows the
+ * archive to the caller. Returns -1 on error.
+ */
+ssize_t tardemux_push(tardemux_t *demux, const void *buf, size_t len);
+
+/*
+ * Returns the length the demuxer can take before it next changes
+ * state, or 0 once done, so that a caller reading the stream can stop
+ * exactly at the end of the archive.
+ */
+size_t tardemux_want(tardemux_t *demux);
+
+/*
+ * Read no more than the demuxer wants from the given reader into the
+ * caller's buffer, and push it through the demuxer.
+ *
+ * Returns the length read, 0 once the end of the archive has been
+ * reached, or -1 on error, including a stream that ends early.
+ */
+ssize_t tardemux_pull(tardemux_t *demux, tarmux_reader_fn reader, void *ctx,
+        void *buffer, size_t size);
+
+/*
+ * Returns non-zero once the end of the archive has been reached.
+ */
+int tardemux_done(tardemux_t *demux);
+
+/*
+ * Returns a description of the error that stopped the demuxer, or
+ * NULL if there was none.
+ */
+const char *tardemux_error(tardemux_t *demux);
+
+/*
+ * Release the demuxer.
+ */
+void tardemux_destroy(tardemux_t *demux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,240 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "pool.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+typedef struct pool_item_t
+{
+    struct pool_item_t *next;
+    void *job;
+    int finished;
+} pool_item_t;
+
+struct pool_t
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_t *threads;
+#endif
+    pool_item_t *head;
+    pool_item_t *tail;
+    pool_item_t *next;
+    void (*work)(void *job);
+    void (*done)(void *job, void *ctx);
+    void *ctx;
+    int thread_count;
+    int window;
+    int count;
+    int stopping;
+};
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Take the oldest job not yet started, and run it.
+ */
+static void *pool_worker(void *arg)
+{
+    pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        pool_item_t *item;
+
+        while (!pool->next && !pool->stopping) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (!(item = pool->next)) {
+            break;
+        }
+        pool->next = item->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work(item->job);
+
+        pthread_mutex_lock(&pool->lock);
+        item->finished = 1;
+        if (item == pool->head) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * Complete the oldest job, waiting for it to finish if need be. Called
+ * with the lock held, which is released while the job is completed.
+ */
+static void pool_complete(pool_t *pool)
+{
+    pool_item_t *item = pool->head;
+
+    while (!item->finished) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+
+    pool->head = item->next;
+    if (!pool->head) {
+        pool->tail = NULL;
+    }
+    pool->count--;
+
+    pthread_mutex_unlock(&pool->lock);
+    pool->done(item->job, pool->ctx);
+    free(item);
+    pthread_mutex_lock(&pool->lock);
+}
+#endif
+
+pool_t *pool_create(int threads, int window, void (*work)(void *job),
+        void (*done)(void *job, void *ctx), void *ctx)
+{
+    pool_t *pool;
+
+    pool = calloc(1, sizeof(pool_t));
+    if (!pool) {
+        fprintf(stderr, "Could not allocate pool.\n");
+        exit(3);
+    }
+
+    pool->work = work;
+    pool->done = done;
+    pool->ctx = ctx;
+    pool->window = window > threads ? window : threads;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    if (threads > 0) {
+        pool->threads = calloc(threads, sizeof(pthread_t));
+        if (!pool->threads) {
+            fprintf(stderr, "Could not allocate pool.\n");
+            exit(3);
+        }
+    }
+
+    for (pool->thread_count = 0; pool->thread_count < threads;
+            pool->thread_count++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL,
+                pool_worker, pool)) {
+            fprintf(stderr, "Could not create worker thread.\n");
+            exit(3);
+        }
+    }
+#endif
+
+    return pool;
+}
+
+void pool_submit(pool_t *pool, void *job)
+{
+#ifdef HAVE_PTHREAD_H
+    pool_item_t *item;
+
+    if (pool->thread_count) {
+
+        item = malloc(sizeof(pool_item_t));
+        if (!item) {
+            fprintf(stderr, "Could not allocate pool.\n");
+            exit(3);
+        }
+        item->next = NULL;
+        item->job = job;
+        item->finished = 0;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->tail) {
+            pool->tail->next = item;
+        }
+        else {
+            pool->head = item;
+        }
+        pool->tail = item;
+        if (!pool->next) {
+            pool->next = item;
+        }
+        pool->count++;
+        pthread_cond_signal(&pool->work_cond);
+
+        /* complete what we can, and make room for the next job */
+        while (pool->head && (pool->head->finished
+                || pool->count >= pool->window)) {
+            pool_complete(pool);
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        return;
+    }
+#endif
+
+    pool->work(job);
+    pool->done(job, pool->ctx);
+}
+
+void pool_drain(pool_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head) {
+        pool_complete(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+int pool_pending(pool_t *pool)
+{
+    return pool->count;
+}
+
+void pool_destroy(pool_t *pool)
+{
+    pool_drain(pool);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (pool->thread_count--) {
+        pthread_join(pool->threads[pool->thread_count], NULL);
+    }
+    free(pool->threads);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+
+    free(pool);
+}
@@ -0,0 +1,64 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * An ordered pool of worker threads.
+ *
+ * Jobs are run in parallel by the workers, and are then completed one
+ * at a time in the order they were submitted, from the thread that
+ * submitted them. This lets the expensive part of a job run on many
+ * cores, while the result is written out in sequence.
+ *
+ * Without thread support, or with no threads, each job is run and
+ * completed as it is submitted.
+ */
+
+typedef struct pool_t pool_t;
+
+/*
+ * Create a pool of the given number of threads, allowing up to window
+ * jobs to be in progress at once. The work callback is run on a worker,
+ * the done callback is run in order from pool_submit() or pool_drain().
+ */
+pool_t *pool_create(int threads, int window, void (*work)(void *job),
+        void (*done)(void *job, void *ctx), void *ctx);
+
+/*
+ * Submit a job, completing earlier jobs that have finished, and waiting
+ * for the oldest job if the window is full.
+ */
+void pool_submit(pool_t *pool, void *job);
+
+/*
+ * Wait for and complete all jobs in progress.
+ */
+void pool_drain(pool_t *pool);
+
+/*
+ * Returns the number of jobs in progress.
+ */
+int pool_pending(pool_t *pool);
+
+/*
+ * Complete all jobs, and stop the workers.
+ */
+void pool_destroy(pool_t *pool);
+
+#endif
@@ -0,0 +1,134 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "sparse.h"
+
+/* zeros written in place of a hole that cannot be seeked over */
+static const char zeros[64 * 1024];
+
+int sparse_data(int fd, off_t offset, off_t size, off_t *start, off_t *end)
+{
+    *start = offset;
+    *end = size;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if ((*start = lseek(fd, offset, SEEK_DATA)) < 0) {
+        if (errno == ENXIO) {
+            /* nothing but a hole to the end */
+            return 0;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+        *start = offset;
+    }
+    else if ((*end = lseek(fd, *start, SEEK_HOLE)) < 0) {
+        return -1;
+    }
+    if (*end > size) {
+        *end = size;
+    }
+#endif
+
+    if (*start >= size) {
+        return 0;
+    }
+
+    return lseek(fd, *start, SEEK_SET) < 0 ? -1 : 1;
+}
+
+/*
+ * Write len zeros to the given file, waiting if it would block.
+ */
+static int sparse_zeros(int fd, off_t len)
+{
+    while (len) {
+        ssize_t size = write(fd, zeros,
+                len < (off_t)sizeof(zeros) ? (size_t)len : sizeof(zeros));
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                struct pollfd pfd;
+
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        len -= size;
+    }
+
+    return 0;
+}
+
+int sparse_skip(int fd, off_t len)
+{
+    struct stat st;
+    off_t pos;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+            || (pos = lseek(fd, 0, SEEK_CUR)) < 0) {
+        return sparse_zeros(fd, len);
+    }
+
+    /* written over an existing file, the hole may hold old data */
+    if (pos < st.st_size) {
+        off_t old = st.st_size - pos < len ? st.st_size - pos : len;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos,
+                old))
+#endif
+        {
+            if (sparse_zeros(fd, old)) {
+                return -1;
+            }
+            pos += old;
+            len -= old;
+        }
+    }
+
+    if (lseek(fd, pos + len, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    /* a hole at the end is made by growing the file */
+    if (pos + len > st.st_size && ftruncate(fd, pos + len)) {
+        return -1;
+    }
+
+    return 0;
+}
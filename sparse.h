@@ -0,0 +1,52 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+
+/*
+ * Holes in regular files.
+ *
+ * A fragment that follows a hole in its source carries the offset of
+ * its payload within the source, as decimal digits. The closing
+ * fragment of a source that ends in a hole carries the full size.
+ */
+#define SPARSE_ATTR_OFFSET "tarmux.offset"
+
+/*
+ * Find the next run of data in the given file, at or after offset,
+ * leaving the file positioned at its start.
+ *
+ * Returns 1 with start and end set to the run of data, 0 if the rest
+ * of the file is a hole, or -1 on error. A file system that cannot
+ * tell holes apart gives the rest of the file as data.
+ */
+int sparse_data(int fd, off_t offset, off_t size, off_t *start, off_t *end);
+
+/*
+ * Leave a hole of len bytes at the current position of the given file,
+ * seeking past it, punching it out where the file already holds data,
+ * and growing the file should the hole reach past its end. Zeros are
+ * written where the file cannot seek.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int sparse_skip(int fd, off_t len);
+
+#endif
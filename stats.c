@@ -0,0 +1,466 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "stats.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+int64_t stats_clock(const void *stats)
+{
+    if (!stats) {
+        return 0;
+    }
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    {
+        struct timespec tp;
+
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+
+        return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+    }
+#else
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+
+        return (int64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    }
+#endif
+}
+
+int64_t stats_realtime(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_REALTIME)
+    struct timespec tp;
+
+    clock_gettime(CLOCK_REALTIME, &tp);
+
+    return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/*
+ * Return the bucket of the histogram holding the given time.
+ */
+static int stats_bucket(uint64_t ns)
+{
+    int power;
+
+    if (ns < STATS_SUB) {
+        return ns;
+    }
+
+    power = 63 - __builtin_clzll(ns);
+    if (power >= 44) {
+        return STATS_BUCKETS - 1;
+    }
+
+    return (power - STATS_SUB_BITS + 1) * STATS_SUB
+            + ((ns >> (power - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/*
+ * Return the largest time held by the given bucket.
+ */
+static uint64_t stats_bucket_max(int bucket)
+{
+    int shift;
+
+    if (bucket < STATS_SUB) {
+        return bucket;
+    }
+
+    shift = bucket / STATS_SUB - 1;
+
+    return (((uint64_t)STATS_SUB + bucket % STATS_SUB + 1) << shift) - 1;
+}
+
+/*
+ * Add a time to a histogram, allocating the histogram if need be. Only
+ * the thread writing the source does so, while the statistics thread
+ * reads along.
+ */
+static void stats_record(stats_histogram_t **histogram, uint64_t ns)
+{
+    stats_histogram_t *h = *histogram;
+    uint64_t max;
+
+    if (!h) {
+        h = calloc(1, sizeof(stats_histogram_t));
+        if (!h) {
+            fprintf(stderr, "Could not allocate statistics.\n");
+            exit(3);
+        }
+        __atomic_store_n(histogram, h, __ATOMIC_RELEASE);
+    }
+
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, ns);
+    stats_add(&h->buckets[stats_bucket(ns)], 1);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (ns > max) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+int64_t stats_stamp(const char *text)
+{
+    int64_t sec, nsec = 0, scale = 100000000;
+    char *end;
+
+    sec = strtoll(text, &end, 10);
+    if (end == text || sec < 0) {
+        return -1;
+    }
+
+    if (*end == '.') {
+        for (end++; *end >= '0' && *end <= '9'; end++) {
+            nsec += (*end - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    return sec * 1000000000 + nsec;
+}
+
+void stats_arrival(stats_source_t *source, int64_t stamped)
+{
+    int64_t now, latency;
+
+    if (!source || stamped < 0) {
+        return;
+    }
+
+    /* clocks apart on two systems may have us arrive before we left */
+    latency = stats_realtime() - stamped;
+    stats_record(&source->latency, latency > 0 ? latency : 0);
+
+    now = stats_clock(source);
+    if (source->arrived) {
+        stats_record(&source->interarrival, now - source->arrived);
+    }
+    source->arrived = now;
+}
+
+static uint64_t stats_get(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write a JSON string, escaping as needed.
+ */
+static void stats_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        }
+        else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        }
+        else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/*
+ * Write a histogram of times as a JSON object, the percentiles being
+ * the largest time in the bucket they fall in.
+ */
+static void stats_histogram(FILE *f, const char *name,
+        stats_histogram_t *h)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p90", "p99", "p999" };
+    uint64_t count, max, seen = 0;
+    int i, q = 0;
+
+    if (!h || !(count = stats_get(&h->count))) {
+        return;
+    }
+    max = stats_get(&h->max);
+
+    fprintf(f, ", \"%s\": {\"count\": %" PRIu64 ", \"mean_ms\": %.6f", name,
+            count, stats_get(&h->sum) / 1e6 / count);
+
+    for (i = 0; i < STATS_BUCKETS && q < 4; i++) {
+        seen += stats_get(&h->buckets[i]);
+        while (q < 4 && seen >= quantiles[q] * count) {
+            uint64_t ns = stats_bucket_max(i);
+            fprintf(f, ", \"%s_ms\": %.6f", labels[q],
+                    (ns < max ? ns : max) / 1e6);
+            q++;
+        }
+    }
+
+    fprintf(f, ", \"max_ms\": %.6f}", max / 1e6);
+}
+
+/*
+ * Write the statistics as a single line of JSON.
+ */
+static void stats_json(stats_t *stats, FILE *f)
+{
+    stats_source_t *source;
+    uint64_t bytes = 0, fragments = 0;
+    int first = 1;
+
+    for (source = __atomic_load_n(&stats->sources, __ATOMIC_ACQUIRE); source;
+            source = __atomic_load_n(&source->next, __ATOMIC_ACQUIRE)) {
+        bytes += stats_get(&source->bytes);
+        fragments += stats_get(&source->fragments);
+    }
+
+    fprintf(f, "{\"tool\": ");
+    stats_string(f, stats->tool);
+    fprintf(f, ", \"time\": %ld, \"uptime_s\": %.3f, \"bytes\": %" PRIu64
+            ", \"fragments\": %" PRIu64 ", \"wakeups\": %" PRIu64
+            ", \"read_wait_ms\": %.3f, \"write_wait_ms\": %.3f, "
+            "\"streams\": [", (long)time(NULL),
+            (stats_clock(stats) - stats->start) / 1e9, bytes, fragments,
+            stats_get(&stats->wakeups), stats_get(&stats->read_ns) / 1e6,
+            stats_get(&stats->write_ns) / 1e6);
+
+    for (source = __atomic_load_n(&stats->sources, __ATOMIC_ACQUIRE); source;
+            source = __atomic_load_n(&source->next, __ATOMIC_ACQUIRE)) {
+        int i, sep = 0;
+
+        fprintf(f, "%s{\"name\": ", first ? "" : ", ");
+        stats_string(f, source->name);
+        fprintf(f, ", \"bytes\": %" PRIu64 ", \"fragments\": %" PRIu64
+                ", \"reads\": %" PRIu64 ", \"read_ms\": %.3f"
+                ", \"write_ms\": %.3f, \"sizes\": [",
+                stats_get(&source->bytes), stats_get(&source->fragments),
+                stats_get(&source->reads), stats_get(&source->read_ns) / 1e6,
+                stats_get(&source->write_ns) / 1e6);
+
+        /* bucket n holds fragments of at least 2^(n-1) bytes */
+        for (i = 0; i < STATS_SIZES; i++) {
+            uint64_t count = stats_get(&source->sizes[i]);
+            if (count) {
+                fprintf(f, "%s{\"min\": %" PRIu64 ", \"count\": %" PRIu64 "}",
+                        sep ? ", " : "", i ? (uint64_t)1 << (i - 1) : 0,
+                        count);
+                sep = 1;
+            }
+        }
+
+        fprintf(f, "]");
+        stats_histogram(f, "latency",
+                __atomic_load_n(&source->latency, __ATOMIC_ACQUIRE));
+        stats_histogram(f, "interarrival",
+                __atomic_load_n(&source->interarrival, __ATOMIC_ACQUIRE));
+        fprintf(f, "}");
+        first = 0;
+    }
+
+    fprintf(f, "]}\n");
+}
+
+/*
+ * Write the statistics to stderr, or replace the named file with them,
+ * so that a reader never sees half a dump.
+ */
+static void stats_dump(stats_t *stats)
+{
+    char *tmp;
+    FILE *f;
+
+    if (!strcmp(stats->name, "-")) {
+        stats_json(stats, stderr);
+        return;
+    }
+
+    tmp = malloc(strlen(stats->name) + 5);
+    if (!tmp) {
+        return;
+    }
+    sprintf(tmp, "%s.tmp", stats->name);
+
+    if (!(f = fopen(tmp, "w"))) {
+        fprintf(stderr, "Error: Could not write statistics to %s: %s\n",
+                tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+    stats_json(stats, f);
+    if (fclose(f) || rename(tmp, stats->name)) {
+        fprintf(stderr, "Error: Could not write statistics to %s: %s\n",
+                stats->name, strerror(errno));
+    }
+
+    free(tmp);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Write the statistics whenever SIGUSR1 arrives, and every interval.
+ */
+static void *stats_thread(void *arg)
+{
+    stats_t *stats = arg;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;) {
+        int sig;
+
+        if (stats->interval) {
+            struct timespec tp;
+
+            tp.tv_sec = stats->interval / 1000;
+            tp.tv_nsec = (stats->interval % 1000) * 1000000;
+
+            sig = sigtimedwait(&set, NULL, &tp);
+        }
+        else {
+            sig = sigwaitinfo(&set, NULL);
+        }
+
+        if (stats->stopping) {
+            break;
+        }
+        if (sig < 0 && errno == EINTR) {
+            continue;
+        }
+
+        stats_dump(stats);
+    }
+
+    return NULL;
+}
+#endif
+
+stats_t *stats_create(const char *tool, const char *name, int64_t interval)
+{
+    stats_t *stats;
+
+    if (posix_memalign((void **)&stats, STATS_CACHE_LINE, sizeof(stats_t))) {
+        fprintf(stderr, "Could not allocate statistics.\n");
+        exit(3);
+    }
+    memset(stats, 0, sizeof(stats_t));
+
+    stats->tool = tool;
+    stats->name = name;
+    stats->interval = interval;
+    stats->tail = &stats->sources;
+    stats->start = stats_clock(stats);
+
+#ifdef HAVE_PTHREAD_H
+    {
+        sigset_t set;
+        pthread_t *thread;
+
+        /* every thread started from here on leaves SIGUSR1 to us */
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        thread = malloc(sizeof(pthread_t));
+        if (!thread || pthread_create(thread, NULL, stats_thread, stats)) {
+            fprintf(stderr, "Could not create statistics thread.\n");
+            exit(3);
+        }
+        stats->thread = thread;
+    }
+#else
+    /* without threads, the statistics are only written at exit */
+    signal(SIGUSR1, SIG_IGN);
+#endif
+
+    return stats;
+}
+
+stats_source_t *stats_source(stats_t *stats, const char *name)
+{
+    stats_source_t *source;
+
+    if (!stats) {
+        return NULL;
+    }
+
+    if (posix_memalign((void **)&source, STATS_CACHE_LINE,
+            sizeof(stats_source_t))) {
+        fprintf(stderr, "Could not allocate statistics.\n");
+        exit(3);
+    }
+    memset(source, 0, sizeof(stats_source_t));
+
+    source->owner = stats;
+    source->name = strdup(name);
+
+    /* publish the source only once it is complete */
+    __atomic_store_n(stats->tail, source, __ATOMIC_RELEASE);
+    stats->tail = &source->next;
+
+    return source;
+}
+
+void stats_finish(stats_t *stats)
+{
+    stats_source_t *source, *next;
+
+    if (!stats) {
+        return;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    stats->stopping = 1;
+    pthread_kill(*(pthread_t *)stats->thread, SIGUSR1);
+    pthread_join(*(pthread_t *)stats->thread, NULL);
+    free(stats->thread);
+#endif
+
+    stats_dump(stats);
+
+    for (source = stats->sources; source; source = next) {
+        next = source->next;
+        free(source->latency);
+        free(source->interarrival);
+        free(source->name);
+        free(source);
+    }
+    free(stats);
+}
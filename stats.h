@@ -0,0 +1,206 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Runtime statistics, cheap enough to leave enabled.
+ *
+ * Counters are bumped with relaxed atomic adds, and are read the same
+ * way when dumped, so no locks are taken. Counters written by different
+ * threads live on different cache lines, so that they do not bounce
+ * between cores.
+ *
+ * The statistics are written as JSON on SIGUSR1, every interval if one
+ * is given, and at exit.
+ */
+
+#define STATS_CACHE_LINE 64
+
+/* the wall clock time a fragment was read, as seconds.nanoseconds */
+#define STATS_ATTR_TIME "tarmux.time"
+
+/* fragment sizes by power of two, the last bucket takes the rest */
+#define STATS_SIZES 24
+
+/*
+ * Times in nanoseconds, by power of two split sixteen ways, so that
+ * each bucket is within 6.25% of the values it holds. Times of 2^44ns,
+ * some four and a half hours, and over land in the last bucket.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((44 - STATS_SUB_BITS + 1) * STATS_SUB)
+
+typedef struct stats_histogram_t
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_source_t
+{
+    /* written by whoever reads the source */
+    uint64_t read_ns;
+    uint64_t reads;
+
+    /* written by whoever writes the fragments */
+    uint64_t bytes __attribute__((aligned(STATS_CACHE_LINE)));
+    uint64_t fragments;
+    uint64_t write_ns;
+    uint64_t sizes[STATS_SIZES];
+
+    /* allocated when the first timestamped fragment arrives */
+    stats_histogram_t *latency;
+    stats_histogram_t *interarrival;
+    int64_t arrived;
+
+    /* set before the source is published, then left alone */
+    struct stats_source_t *next __attribute__((aligned(STATS_CACHE_LINE)));
+    struct stats_t *owner;
+    char *name;
+} stats_source_t;
+
+typedef struct stats_t
+{
+    /* the main loop waiting for input, and all sources written */
+    uint64_t wakeups;
+    uint64_t read_ns;
+    uint64_t write_ns;
+
+    stats_source_t *sources __attribute__((aligned(STATS_CACHE_LINE)));
+    stats_source_t **tail;
+    const char *tool;
+    const char *name;
+    int64_t interval;
+    int64_t start;
+    void *thread;
+    volatile int stopping;
+} stats_t;
+
+/*
+ * Start keeping statistics for the given tool, to be written to the
+ * named file, or to stderr if the name is "-", every interval
+ * milliseconds if the interval is not zero.
+ *
+ * Must be called before any other threads are started, so that they
+ * leave SIGUSR1 to us.
+ */
+stats_t *stats_create(const char *tool, const char *name, int64_t interval);
+
+/*
+ * Add a source or destination with the given name. The returned
+ * counters stay put for the life of the statistics.
+ */
+stats_source_t *stats_source(stats_t *stats, const char *name);
+
+/*
+ * Write the statistics, stop the live dumps, and release everything.
+ */
+void stats_finish(stats_t *stats);
+
+/*
+ * Return a timestamp to time something with, if statistics are kept.
+ */
+int64_t stats_clock(const void *stats);
+
+/*
+ * Return the wall clock time in nanoseconds, as stamped on fragments.
+ */
+int64_t stats_realtime(void);
+
+/*
+ * Parse a wall clock time as stamped on fragments, returning the time
+ * in nanoseconds, or -1 if not a time.
+ */
+int64_t stats_stamp(const char *text);
+
+/*
+ * Count the arrival of a fragment stamped with the given wall clock
+ * time, recording the time it took to get here, and the time since
+ * the fragment before it.
+ */
+void stats_arrival(stats_source_t *source, int64_t stamped);
+
+/*
+ * Add to a counter.
+ */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a fragment of the given length.
+ */
+static inline void stats_fragment(stats_source_t *source, uint64_t len)
+{
+    int bucket = len ? 64 - __builtin_clzll(len) : 0;
+
+    if (!source) {
+        return;
+    }
+
+    stats_add(&source->bytes, len);
+    stats_add(&source->fragments, 1);
+    stats_add(&source->sizes[bucket < STATS_SIZES ? bucket : STATS_SIZES - 1],
+            1);
+}
+
+/*
+ * Count the time since start as time spent reading the given source.
+ */
+static inline void stats_read(stats_source_t *source, int64_t start,
+        int reads)
+{
+    if (source) {
+        stats_add(&source->read_ns, stats_clock(source) - start);
+        stats_add(&source->reads, reads);
+    }
+}
+
+/*
+ * Count the time since start as time spent writing the given source.
+ */
+static inline void stats_write(stats_source_t *source, int64_t start)
+{
+    if (source) {
+        int64_t ns = stats_clock(source) - start;
+
+        stats_add(&source->write_ns, ns);
+        stats_add(&source->owner->write_ns, ns);
+    }
+}
+
+/*
+ * Count the time since start as time the main loop spent waiting for
+ * input.
+ */
+static inline void stats_wait(stats_t *stats, int64_t start, int wakeups)
+{
+    if (stats) {
+        stats_add(&stats->read_ns, stats_clock(stats) - start);
+        stats_add(&stats->wakeups, wakeups);
+    }
+}
+
+#endif
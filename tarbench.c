@@ -0,0 +1,869 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "config.h"
+
+#define TAR_BLOCK_SIZE 512
+#define RELAY_BUFFER (1024 * 1024)
+
+typedef struct stream_t
+{
+    char name[32];
+    unsigned char *record;
+    int64_t *samples;
+    size_t fill;
+    size_t count;
+    size_t size;
+    int64_t bytes;
+    int fd;
+    int poll;
+} stream_t;
+
+/*
+ * The tar stream passing from tarmux to tardemux, counted on the way
+ * through.
+ */
+typedef struct relay_t
+{
+    unsigned char header[TAR_BLOCK_SIZE];
+    unsigned char *buffer;
+    size_t hfill;
+    size_t len;
+    size_t offset;
+    int64_t remaining;
+    int64_t pad;
+    int64_t stream_bytes;
+    int64_t header_bytes;
+    int64_t fragments;
+    int payload;
+    int zeros;
+    int ended;
+    int in;
+    int out;
+} relay_t;
+
+typedef struct tool_t
+{
+    const char *name;
+    struct rusage usage;
+    int64_t syscalls;
+    pid_t pid;
+    int status;
+} tool_t;
+
+typedef struct load_t
+{
+    size_t size;
+    int64_t bytes;
+    int64_t duration;
+    double rate;
+    int burst;
+} load_t;
+
+void help(const char *name)
+{
+    printf(
+            "Usage: %s [-n streams] [-s bytes] [-r rate] [-B burst] [-b bytes] [-T seconds]\n"
+                    "       [-t tarmux] [-d tardemux] [-m args] [-M args] [-l label]\n"
+                    "\n"
+                    "This tool measures the throughput and latency of tarmux and tardemux.\n"
+                    "Synthetic producers write to a number of named pipes, which are\n"
+                    "multiplexed by tarmux, passed through this tool, and unpacked again\n"
+                    "by tardemux -a into named pipes read by this tool.\n"
+                    "\n"
+                    "Each write carries the time it was made, and the latency of each write\n"
+                    "is the time until it has passed through to the far side. The results\n"
+                    "are printed as a single line of JSON, so that runs may be compared.\n"
+                    "\n"
+                    "  -n streams\t\tThe number of producers, defaults to 4.\n"
+                    "  -s bytes\t\tThe size of each write, at least 8, defaults to 65536.\n"
+                    "  -r rate\t\tWrites per second from each producer, defaults to\n"
+                    "\t\t\tas fast as possible.\n"
+                    "  -B burst\t\tMake the writes in bursts of this many at a time,\n"
+                    "\t\t\tkeeping to the same average rate.\n"
+                    "  -b bytes\t\tThe bytes written by each producer, defaults to 16MB.\n"
+                    "  -T seconds\t\tStop each producer after this long.\n"
+                    "  -t path\t\tThe tarmux to run, defaults to ./tarmux.\n"
+                    "  -d path\t\tThe tardemux to run, defaults to ./tardemux.\n"
+                    "  -m args\t\tSpace separated options to pass to tarmux.\n"
+                    "  -M args\t\tSpace separated options to pass to tardemux.\n"
+                    "  -l label\t\tA label for the run, included in the output.\n"
+                    "\n"
+                    "Syscalls are the read and write family of system calls made by each\n"
+                    "tool, as counted by the kernel in /proc, or -1 where not available.\n"
+                    "\n"
+                    "This tool is licensed under the Apache License, Version 2.0.\n"
+                    "", name);
+}
+
+void version()
+{
+    printf(PACKAGE_STRING "\n");
+}
+
+/*
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static int64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/*
+ * Write synthetic records to the given pipe, each starting with the
+ * time it was written, at the given rate, until the byte count or
+ * duration is reached.
+ */
+static void produce(int fd, load_t *load, int64_t start)
+{
+    unsigned char *record;
+    int64_t sent = 0, next = start, interval = 0;
+    int n = 0;
+    size_t i;
+
+    record = malloc(load->size);
+    if (!record) {
+        fprintf(stderr, "Could not allocate record.\n");
+        exit(3);
+    }
+    for (i = 0; i < load->size; i++) {
+        record[i] = i;
+    }
+
+    if (load->rate > 0) {
+        interval = 1000000000 / load->rate;
+    }
+
+    while (sent < load->bytes
+            && (!load->duration || now_ns() - start < load->duration)) {
+        int64_t stamp = now_ns();
+        size_t offset = 0;
+
+        memcpy(record, &stamp, sizeof(stamp));
+
+        while (offset < load->size) {
+            ssize_t size = write(fd, record + offset, load->size - offset);
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("producer");
+                exit(4);
+            }
+            offset += size;
+        }
+        sent += load->size;
+
+        /* steady writes are spaced out, bursts are sent back to back */
+        if (interval && ++n >= load->burst) {
+            struct timespec tp;
+
+            next += interval * n;
+            n = 0;
+            tp.tv_sec = next / 1000000000;
+            tp.tv_nsec = next % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, NULL)
+                    == EINTR);
+        }
+    }
+
+    exit(0);
+}
+
+/*
+ * Split a space separated list of options onto the end of argv.
+ */
+static int split_args(const char **argv, int argc, char *args)
+{
+    char *token;
+
+    for (token = strtok(args, " "); token; token = strtok(NULL, " ")) {
+        argv[argc++] = token;
+    }
+
+    return argc;
+}
+
+/*
+ * Start one of the tools in the given directory, with the given stdin
+ * and stdout.
+ */
+static void tool_start(tool_t *tool, const char *dir, const char **argv,
+        int in, int out)
+{
+    tool->pid = fork();
+    if (tool->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    else if (tool->pid == 0) {
+        if (chdir(dir)) {
+            perror(dir);
+            exit(1);
+        }
+        if (in >= 0) {
+            dup2(in, STDIN_FILENO);
+        }
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+        }
+        execv(argv[0], (char * const *)argv);
+        perror(argv[0]);
+        exit(1);
+    }
+}
+
+/*
+ * Wait for one of the tools to exit, picking up the system calls it made
+ * before it is reaped, and then its CPU time.
+ */
+static void tool_wait(tool_t *tool)
+{
+    siginfo_t info;
+    char path[64], line[128];
+    FILE *io;
+
+    tool->syscalls = -1;
+
+    if (!waitid(P_PID, tool->pid, &info, WEXITED | WNOWAIT)) {
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)tool->pid);
+        if ((io = fopen(path, "r"))) {
+            int64_t count;
+
+            tool->syscalls = 0;
+            while (fgets(line, sizeof(line), io)) {
+                if (sscanf(line, "syscr: %" SCNd64, &count) == 1
+                        || sscanf(line, "syscw: %" SCNd64, &count) == 1) {
+                    tool->syscalls += count;
+                }
+            }
+            fclose(io);
+        }
+    }
+
+    if (wait4(tool->pid, &tool->status, 0, &tool->usage) < 0) {
+        perror(tool->name);
+        exit(1);
+    }
+}
+
+/*
+ * Parse the size field of a tar header, in octal or in base-256.
+ */
+static int64_t tar_size(const unsigned char *field)
+{
+    int64_t value = 0;
+    int i;
+
+    if (field[0] & 0x80) {
+        value = field[0] & 0x3f;
+        for (i = 1; i < 12; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    for (i = 0; i < 12 && (field[i] == ' ' || field[i] == '\0'); i++);
+    for (; i < 12 && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) + (field[i] - '0');
+    }
+
+    return value;
+}
+
+/*
+ * Walk the tar stream passing through the relay, counting fragments,
+ * and every byte that is not fragment payload as overhead.
+ */
+static void relay_scan(relay_t *r, const unsigned char *buf, size_t len)
+{
+    r->stream_bytes += len;
+
+    while (len) {
+        size_t n;
+
+        if (r->remaining) {
+            n = r->remaining < (int64_t)len ? r->remaining : len;
+            if (!r->payload) {
+                r->header_bytes += n;
+            }
+            r->remaining -= n;
+        }
+        else if (r->pad) {
+            n = r->pad < (int64_t)len ? r->pad : len;
+            r->header_bytes += n;
+            r->pad -= n;
+        }
+        else {
+            int i;
+
+            n = TAR_BLOCK_SIZE - r->hfill < len ? TAR_BLOCK_SIZE - r->hfill : len;
+            memcpy(r->header + r->hfill, buf, n);
+            r->hfill += n;
+
+            if (r->hfill == TAR_BLOCK_SIZE) {
+                r->hfill = 0;
+                r->header_bytes += TAR_BLOCK_SIZE;
+
+                for (i = 0; i < TAR_BLOCK_SIZE && !r->header[i]; i++);
+
+                /* two zero blocks mark the end of the archive */
+                if (i == TAR_BLOCK_SIZE && ++r->zeros == 2) {
+                    r->ended = 1;
+                }
+                else if (i < TAR_BLOCK_SIZE) {
+                    char type = r->header[156];
+
+                    r->zeros = 0;
+                    r->remaining = tar_size(r->header + 124);
+                    r->pad = (TAR_BLOCK_SIZE - (r->remaining % TAR_BLOCK_SIZE))
+                            % TAR_BLOCK_SIZE;
+                    r->payload = type == '0' || type == '\0' || type == '7';
+                    if (r->payload) {
+                        r->fragments++;
+                    }
+                }
+            }
+        }
+
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Move what we can of the tar stream from tarmux to tardemux.
+ *
+ * Returns 1 once the stream has ended and been passed on in full.
+ */
+static int relay_move(relay_t *r)
+{
+    ssize_t size;
+
+    if (r->offset == r->len && r->in >= 0) {
+        size = read(r->in, r->buffer, RELAY_BUFFER);
+        if (size > 0) {
+            relay_scan(r, r->buffer, size);
+            r->offset = 0;
+            r->len = size;
+        }
+        else if (size == 0) {
+            close(r->in);
+            r->in = -1;
+        }
+        else if (errno != EAGAIN && errno != EINTR) {
+            perror("relay");
+            exit(4);
+        }
+    }
+
+    while (r->offset < r->len) {
+        size = write(r->out, r->buffer + r->offset, r->len - r->offset);
+        if (size < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            /* tardemux may leave once it has seen the end of archive */
+            if (errno == EPIPE && r->ended) {
+                r->offset = r->len;
+                break;
+            }
+            perror("relay");
+            exit(4);
+        }
+        r->offset += size;
+    }
+
+    if (r->in < 0 && r->offset == r->len && r->out >= 0) {
+        close(r->out);
+        r->out = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the records arriving from tardemux on the given stream, noting
+ * the latency of each complete record.
+ *
+ * Returns 1 at the end of the stream.
+ */
+static int stream_read(stream_t *s, size_t size)
+{
+    for (;;) {
+        ssize_t len = read(s->fd, s->record + s->fill, size - s->fill);
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            else if (errno == EINTR) {
+                continue;
+            }
+            perror(s->name);
+            exit(4);
+        }
+        else if (len == 0) {
+            return 1;
+        }
+
+        s->fill += len;
+        s->bytes += len;
+
+        if (s->fill == size) {
+            int64_t stamp;
+
+            memcpy(&stamp, s->record, sizeof(stamp));
+
+            if (s->count == s->size) {
+                s->size = s->size ? s->size * 2 : 1024;
+                s->samples = realloc(s->samples, s->size * sizeof(int64_t));
+                if (!s->samples) {
+                    fprintf(stderr, "Could not allocate samples.\n");
+                    exit(3);
+                }
+            }
+            s->samples[s->count++] = now_ns() - stamp;
+            s->fill = 0;
+        }
+    }
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Return the given percentile of sorted samples, in microseconds.
+ */
+static double percentile(const int64_t *samples, size_t count, int p)
+{
+    if (!count) {
+        return 0;
+    }
+
+    return samples[(count - 1) * p / 100] / 1000.0;
+}
+
+static double seconds(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/*
+ * Print the results for one of the tools.
+ */
+static void tool_print(tool_t *tool, double mb)
+{
+    printf("\"%s\": {\"exit\": %d, \"user_s\": %.3f, \"sys_s\": %.3f, "
+            "\"syscalls\": %" PRId64 ", \"syscalls_per_mb\": %.1f}",
+            tool->name,
+            WIFEXITED(tool->status) ? WEXITSTATUS(tool->status) : -1,
+            seconds(&tool->usage.ru_utime), seconds(&tool->usage.ru_stime),
+            tool->syscalls,
+            tool->syscalls >= 0 && mb > 0 ? tool->syscalls / mb : -1);
+}
+
+int main(int argc, char * const argv[])
+{
+    const char *name = argv[0];
+    const char *tarmux = "./tarmux";
+    const char *tardemux = "./tardemux";
+    const char *label = "";
+    const char *mux_args = NULL;
+    const char *demux_args = NULL;
+    char *mux_split = NULL;
+    char *demux_split = NULL;
+    char dir[] = "/tmp/tarbench.XXXXXX";
+    char path[PATH_MAX];
+    char tarmux_path[PATH_MAX];
+    char tardemux_path[PATH_MAX];
+    const char **mux_argv;
+    const char **demux_argv;
+
+    load_t load = { 0 };
+    relay_t relay = { { 0 } };
+    tool_t mux = { 0 }, demux = { 0 };
+    stream_t *streams;
+    struct pollfd *fds;
+    int *inputs;
+    int64_t *all;
+
+    int64_t start, elapsed, payload = 0;
+    size_t total = 0;
+    double mb;
+    int count = 4;
+    int open_streams;
+    int relay_done = 0;
+    int ending = 0;
+    int opt;
+    int pa[2], pb[2];
+    int i, j;
+
+    load.size = 65536;
+    load.bytes = 16 * 1024 * 1024;
+    load.burst = 1;
+
+    while ((opt = getopt(argc, argv, "hvn:s:r:B:b:T:t:d:m:M:l:")) != -1) {
+        switch (opt) {
+        case 'h':
+            help(name);
+            exit(0);
+        case 'v':
+            version();
+            exit(0);
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            load.size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            load.rate = strtod(optarg, NULL);
+            break;
+        case 'B':
+            load.burst = atoi(optarg);
+            break;
+        case 'b':
+            load.bytes = strtoll(optarg, NULL, 10);
+            break;
+        case 'T':
+            load.duration = strtod(optarg, NULL) * 1000000000;
+            break;
+        case 't':
+            tarmux = optarg;
+            break;
+        case 'd':
+            tardemux = optarg;
+            break;
+        case 'm':
+            mux_args = optarg;
+            break;
+        case 'M':
+            demux_args = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            help(name);
+            exit(1);
+        }
+    }
+
+    if (count < 1 || load.size < sizeof(int64_t) || load.burst < 1
+            || load.bytes <= 0) {
+        fprintf(stderr,
+                "Error: Need at least one stream, writes of at least 8 bytes, and a positive burst and byte count, aborting.\n");
+        exit(1);
+    }
+
+    if (!realpath(tarmux, tarmux_path) || !realpath(tardemux, tardemux_path)) {
+        fprintf(stderr, "Error: Could not find %s, aborting.\n",
+                realpath(tarmux, tarmux_path) ? tardemux : tarmux);
+        exit(1);
+    }
+
+    /* make sure we don't die on sigpipe */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/in", dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/out", dir);
+    mkdir(path, 0700);
+
+    streams = calloc(count, sizeof(stream_t));
+    inputs = calloc(count, sizeof(int));
+    fds = calloc(count + 2, sizeof(struct pollfd));
+    mux_argv = calloc(count + 64, sizeof(char *));
+    demux_argv = calloc(64, sizeof(char *));
+    relay.buffer = malloc(RELAY_BUFFER);
+    if (!streams || !inputs || !fds || !mux_argv || !demux_argv
+            || !relay.buffer) {
+        fprintf(stderr, "Could not allocate streams.\n");
+        exit(3);
+    }
+
+    /*
+     * The producers hold their pipes open from the start, so that tarmux
+     * never sees a pipe without a writer, and we hold the far ends open
+     * so that tardemux can open them without blocking.
+     */
+    for (i = 0; i < count; i++) {
+        stream_t *s = &streams[i];
+
+        snprintf(s->name, sizeof(s->name), "s%d", i);
+
+        snprintf(path, sizeof(path), "%s/in/%s", dir, s->name);
+        if (mkfifo(path, 0600)
+                || (inputs[i] = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+            perror(path);
+            exit(1);
+        }
+
+        snprintf(path, sizeof(path), "%s/out/%s", dir, s->name);
+        if (mkfifo(path, 0600) || (s->fd = open(path,
+                O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+            perror(path);
+            exit(1);
+        }
+
+        s->record = malloc(load.size);
+        if (!s->record) {
+            fprintf(stderr, "Could not allocate record.\n");
+            exit(3);
+        }
+    }
+
+    if (pipe2(pa, O_CLOEXEC) || pipe2(pb, O_CLOEXEC)) {
+        perror("pipe");
+        exit(1);
+    }
+    relay.in = pa[0];
+    relay.out = pb[1];
+    fcntl(relay.in, F_SETFL, O_NONBLOCK);
+    fcntl(relay.out, F_SETFL, O_NONBLOCK);
+
+    /* tarmux [args] s0 s1 ... | relay | tardemux -a [args] */
+    i = 0;
+    mux_argv[i++] = tarmux_path;
+    if (mux_args) {
+        mux_split = strdup(mux_args);
+        i = split_args(mux_argv, i, mux_split);
+    }
+    for (j = 0; j < count; j++) {
+        mux_argv[i++] = streams[j].name;
+    }
+    mux_argv[i] = NULL;
+
+    i = 0;
+    demux_argv[i++] = tardemux_path;
+    demux_argv[i++] = "-a";
+    if (demux_args) {
+        demux_split = strdup(demux_args);
+        i = split_args(demux_argv, i, demux_split);
+    }
+    demux_argv[i] = NULL;
+
+    mux.name = "tarmux";
+    demux.name = "tardemux";
+
+    snprintf(path, sizeof(path), "%s/in", dir);
+    tool_start(&mux, path, mux_argv, -1, pa[1]);
+    snprintf(path, sizeof(path), "%s/out", dir);
+    tool_start(&demux, path, demux_argv, pb[0], -1);
+    close(pa[1]);
+    close(pb[0]);
+
+    start = now_ns();
+
+    for (i = 0; i < count; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        else if (pid == 0) {
+            for (j = 0; j < count; j++) {
+                close(streams[j].fd);
+                if (j != i) {
+                    close(inputs[j]);
+                }
+            }
+            close(relay.in);
+            close(relay.out);
+            produce(inputs[i], &load, start);
+        }
+        close(inputs[i]);
+    }
+
+    /* pass the tar stream along, and collect the records at the far end */
+    open_streams = count;
+    while (open_streams || !relay_done) {
+        siginfo_t info;
+        int n = 0, ready;
+
+        if (!relay_done) {
+            fds[n].fd = relay.offset == relay.len ? relay.in : relay.out;
+            fds[n].events = relay.offset == relay.len ? POLLIN : POLLOUT;
+            n++;
+        }
+        for (i = 0; i < count; i++) {
+            if (streams[i].fd >= 0) {
+                streams[i].poll = n;
+                fds[n].fd = streams[i].fd;
+                fds[n].events = POLLIN;
+                n++;
+            }
+        }
+
+        ready = poll(fds, n, ending ? 0 : 100);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+        else if (!ready && ending) {
+            break;
+        }
+
+        if (!relay_done) {
+            relay_done = relay_move(&relay);
+        }
+
+        /* a pipe tardemux has yet to open reads as empty, so wait for it */
+        for (i = 0; i < count; i++) {
+            stream_t *s = &streams[i];
+
+            if (s->fd >= 0 && fds[s->poll].revents
+                    && stream_read(s, load.size)) {
+                close(s->fd);
+                s->fd = -1;
+                open_streams--;
+            }
+        }
+
+        /* streams tardemux never opened will never close */
+        info.si_pid = 0;
+        if (!ending && !waitid(P_PID, demux.pid, &info,
+                WEXITED | WNOHANG | WNOWAIT) && info.si_pid == demux.pid) {
+            ending = 1;
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    tool_wait(&mux);
+    tool_wait(&demux);
+    while (wait(NULL) > 0);
+
+    /* tidy up the pipes */
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/in/%s", dir, streams[i].name);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/out/%s", dir, streams[i].name);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/in", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/out", dir);
+    rmdir(path);
+    rmdir(dir);
+
+    for (i = 0; i < count; i++) {
+        payload += streams[i].bytes;
+        total += streams[i].count;
+    }
+    all = malloc((total ? total : 1) * sizeof(int64_t));
+    if (!all) {
+        fprintf(stderr, "Could not allocate samples.\n");
+        exit(3);
+    }
+    total = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(all + total, streams[i].samples,
+                streams[i].count * sizeof(int64_t));
+        total += streams[i].count;
+        qsort(streams[i].samples, streams[i].count, sizeof(int64_t),
+                compare_samples);
+    }
+    qsort(all, total, sizeof(int64_t), compare_samples);
+
+    mb = payload / (1024.0 * 1024.0);
+
+    printf("{\"label\": \"%s\", \"streams\": %d, \"write_size\": %zu, "
+            "\"rate\": %.1f, \"burst\": %d, \"tarmux_args\": \"%s\", "
+            "\"tardemux_args\": \"%s\", ",
+            label, count, load.size, load.rate, load.burst,
+            mux_args ? mux_args : "", demux_args ? demux_args : "");
+    printf("\"elapsed_s\": %.3f, \"payload_bytes\": %" PRId64 ", "
+            "\"stream_bytes\": %" PRId64 ", \"mb_per_s\": %.1f, "
+            "\"fragments\": %" PRId64 ", \"fragments_per_s\": %.1f, "
+            "\"header_bytes\": %" PRId64 ", \"header_overhead\": %.4f, ",
+            elapsed / 1e9, payload, relay.stream_bytes, mb / (elapsed / 1e9),
+            relay.fragments, relay.fragments / (elapsed / 1e9),
+            relay.header_bytes,
+            payload ? (double)relay.header_bytes / payload : 0);
+    printf("\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}, ",
+            percentile(all, total, 50), percentile(all, total, 99),
+            percentile(all, total, 100));
+    printf("\"stream_latency_us\": [");
+    for (i = 0; i < count; i++) {
+        printf("%s{\"stream\": \"%s\", \"records\": %zu, \"p50\": %.1f, "
+                "\"p99\": %.1f}", i ? ", " : "", streams[i].name,
+                streams[i].count,
+                percentile(streams[i].samples, streams[i].count, 50),
+                percentile(streams[i].samples, streams[i].count, 99));
+    }
+    printf("], ");
+    tool_print(&mux, mb);
+    printf(", ");
+    tool_print(&demux, mb);
+    printf("}\n");
+
+    for (i = 0; i < count; i++) {
+        free(streams[i].samples);
+        free(streams[i].record);
+    }
+    free(streams);
+    free(inputs);
+    free(fds);
+    free(all);
+    free(mux_argv);
+    free(demux_argv);
+    free(relay.buffer);
+    free(mux_split);
+    free(demux_split);
+
+    exit(mux.status || demux.status ? 4 : 0);
+}
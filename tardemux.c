@@ -15,6 +15,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,22 +28,241 @@
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
 #include "config.h"
+#include "codec.h"
+#include "crc32c.h"
+#include "pool.h"
+#include "sparse.h"
+#include "stats.h"
+#include "uring.h"
+#include "ustar.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define QUEUE_SPILL_BUFFER (64 * 1024)
+
+/* the least libarchive may look ahead on a pipe or socket, exactly */
+#define AHEAD_WINDOW (64 * 1024)
+
+/* the buffers moving the payload through io_uring */
+#define URING_BUFFERS 8
+#define URING_BUFFER (256 * 1024)
+
+/* what a completion on the ring is for, in the low bits of its tag */
+#define URING_READ 0
+#define URING_WRITE 1
+#define URING_POLL 2
+#define URING_KIND 3
+
+typedef enum copy_e
+{
+    COPY_UNKNOWN = 0,
+    COPY_RW,
+    COPY_SPLICE,
+    COPY_FILE_RANGE
+} copy_e;
+
+typedef enum policy_e
+{
+    POLICY_BLOCK = 0,
+    POLICY_SPILL,
+    POLICY_DROP
+} policy_e;
+
+typedef enum ahead_e
+{
+    AHEAD_NONE = 0,
+    AHEAD_SEEK,
+    AHEAD_TEE,
+    AHEAD_PEEK
+} ahead_e;
+
+typedef struct chunk_t
+{
+    struct chunk_t *next;
+    unsigned char *data;
+    off_t spill;
+    size_t len;
+} chunk_t;
+
+#ifdef HAVE_PTHREAD_H
+typedef struct queue_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_t thread;
+    chunk_t *head;
+    chunk_t *tail;
+    char *pathname;
+    FILE *spill;
+    off_t spill_offset;
+    size_t queued;
+    size_t size;
+    int64_t dropped;
+    policy_e policy;
+    int fd;
+    int closing;
+} queue_t;
+#else
+typedef struct queue_t queue_t;
+#endif
+
+typedef struct ubuf_t
+{
+    unsigned char *data;
+    struct ubuf_t *next;
+    size_t len;
+    size_t offset;
+    int64_t start;
+    int slot;
+} ubuf_t;
 
 typedef struct demux_t
 {
     char *pathname;
+    char *target;
+    queue_t *queue;
+    ubuf_t *uring_head;
+    ubuf_t *uring_tail;
+    stats_source_t *stats;
+    size_t len;
+    intmax_t index;
+    int64_t offset;
     int fd;
+    copy_e copy;
 } demux_t;
 
+typedef struct streams_t
+{
+    demux_t *demux;
+    demux_t *sdemux;
+    demux_t **multi;
+    char * const *targets;
+    const char *template;
+    int *table;
+    pool_t *pool;
+    stats_t *stats;
+#ifdef HAVE_URING
+    uring_t *ring;
+    ubuf_t *uring_bufs;
+    ubuf_t *uring_free;
+    int uring_busy;
+#endif
+    size_t table_size;
+    size_t queue_size;
+    policy_e policy;
+    int demux_count;
+    int multi_count;
+    int target_count;
+    int jobs;
+    int all;
+    int multiple;
+    int select;
+} streams_t;
+
+typedef struct job_t
+{
+    unsigned char *packed;
+    unsigned char *buffer;
+    size_t len;
+    size_t size;
+    int64_t crc;
+    uint32_t sum;
+    codec_e codec;
+    int slot;
+    int failed;
+} job_t;
+
+typedef struct reader_t
+{
+    unsigned char block[TAR_BLOCK_SIZE];
+    unsigned char *buffer;
+    size_t buffer_size;
+    char *pathname;
+    int64_t size;
+    int64_t offset;
+    size_t blocksize;
+    size_t prefix;
+    const unsigned char *tail;
+    size_t tail_len;
+    const unsigned char *carry;
+    size_t carry_len;
+    int64_t original;
+    int64_t crc;
+    int64_t sparse;
+    int64_t stamped;
+    int64_t fetched;
+    int64_t consumed;
+    size_t window;
+    ahead_e ahead;
+    int tee[2];
+    int null_fd;
+    int codec;
+    int fd;
+    int type;
+    int keep;
+} reader_t;
+
+#ifdef HAVE_PTHREAD_H
+typedef struct lane_fragment_t
+{
+    struct lane_fragment_t *next;
+    char *pathname;
+    unsigned char *payload;
+    int64_t size;
+    int64_t original;
+    int64_t crc;
+    int64_t sparse;
+    int64_t stamped;
+    int codec;
+} lane_fragment_t;
+
+typedef struct lanes_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    lane_fragment_t *head;
+    lane_fragment_t *tail;
+    lane_fragment_t *held;
+    streams_t *streams;
+    size_t buffered;
+    size_t size;
+    unsigned int starved;
+    int dry;
+    int running;
+} lanes_t;
+
+typedef struct lane_t
+{
+    lanes_t *lanes;
+    reader_t reader;
+    pthread_t thread;
+    const char *name;
+} lane_t;
+#endif
+
 void help(const char *name)
 {
     printf(
-            "Usage: %s [-f streamname] [-a] [-r] [file1] [file2] [...]\n"
+            "Usage: %s [-f streamname] [-a] [-s] [-r] [-z] [-U] [-b bytes] [-q bytes]\n"
+                    "       [-p policy] [-i indexname [-R start-end]] [-j jobs]\n"
+                    "       [-S statsname] [file1] [file2] [...]\n"
+                    "       %s -L -f lane1 -f lane2 [...] [options] [file1] [...]\n"
+                    "       %s -m [options] file1 [file2] [...]\n"
+                    "       %s -t template [options]\n"
                     "\n"
                     "This tool demultiplexes streams that have been multiplexed by the\n"
                     "tarmux tool. It expects a series of tar files containing sparse file\n"
@@ -57,108 +280,2697 @@ void help(const char *name)
                     "  -f name, --file=name\tThe name of the input files from which tar\n"
                     "\t\t\tstreams will be read, defaults to stdin. Can be specified more\n"
                     "\t\t\tthan once.\n"
+                    "  -L, --lanes\t\tRead the files given with -f at the same time, as\n"
+                    "\t\t\tthe lanes of one tar stream striped across them by\n"
+                    "\t\t\ttarmux, putting the fragments of each stream back in\n"
+                    "\t\t\torder.\n"
+                    "  --reorder=bytes\tHold up to this many bytes of fragments that\n"
+                    "\t\t\tarrive ahead of their turn, defaults to 64MB.\n"
                     "  -a\t\t\tUnpack all pathnames in a stream to individual files.\n"
+                    "  -s, --select\t\tUnpack only the files/pipes given, skipping the\n"
+                    "\t\t\tfragments of every other stream unread, by seeking\n"
+                    "\t\t\tpast them where the input is a file.\n"
+                    "  -m, --multiple\tRead every tar stream of the input in turn, as if\n"
+                    "\t\t\ttardemux were run once for each, writing the first\n"
+                    "\t\t\tstream to file1, the second to file2, and so on. The\n"
+                    "\t\t\tinput is read in large blocks throughout, and each file\n"
+                    "\t\t\tis written by its own thread through a queue, the size\n"
+                    "\t\t\tof a block unless -q is given, while the next stream is\n"
+                    "\t\t\tread. With -z or -U, files are queued only if -q is\n"
+                    "\t\t\tgiven.\n"
+                    "  -t name, --template=name\n"
+                    "\t\t\tAs -m, writing each stream to the file named by the\n"
+                    "\t\t\ttemplate with %%d replaced by the number of the stream,\n"
+                    "\t\t\tcounting from zero.\n"
                     "  -r\t\t\tTreat the incoming stream as a raw compressed stream rather\n"
                     "\t\t\tthan a tar stream.\n"
+                    "  -z, --splice\t\tParse uncompressed tar streams directly, and move\n"
+                    "\t\t\tdata to the output using splice() or copy_file_range()\n"
+                    "\t\t\twithout copying it. Other streams are read as normal.\n"
+                    "  -U, --uring\t\tParse uncompressed tar streams directly as with -z,\n"
+                    "\t\t\tand move data through io_uring, reading the next block\n"
+                    "\t\t\tof the stream while the blocks before it are written to\n"
+                    "\t\t\ttheir files/pipes. Falls back to -z if the kernel does\n"
+                    "\t\t\tnot support io_uring.\n"
+                    "  -b bytes, --block=bytes\n"
+                    "\t\t\tRead the tar stream in blocks of this size, defaults\n"
+                    "\t\t\tto 1MB. Data past the end of the stream is left for the\n"
+                    "\t\t\tnext reader: a file is seeked back to the end of the\n"
+                    "\t\t\tstream, a pipe is looked at through tee() and a socket\n"
+                    "\t\t\twith MSG_PEEK, and consumed only up to the end of the\n"
+                    "\t\t\tstream. Other inputs are read a record at a time.\n"
+                    "  -q bytes, --queue=bytes\n"
+                    "\t\t\tQueue up to this many bytes in memory for each file/pipe,\n"
+                    "\t\t\twritten out by a thread per file/pipe, so that a slow\n"
+                    "\t\t\treader holds up no other stream until its queue is full.\n"
+                    "  -p policy, --policy=policy\n"
+                    "\t\t\tWhat to do when a queue is full: 'block' to wait for the\n"
+                    "\t\t\tqueue to drain, 'spill' to queue further data in a\n"
+                    "\t\t\ttemporary file, or 'drop' to discard it. Defaults to\n"
+                    "\t\t\t'block'.\n"
+                    "  -i name, --index=name\n"
+                    "\t\t\tRead the index written by tarmux -i, and seek directly\n"
+                    "\t\t\tto the fragments wanted, without reading the rest of the\n"
+                    "\t\t\tstream. The stream must be a seekable, uncompressed file.\n"
+                    "  -R start-end, --range=start-end\n"
+                    "\t\t\tWith an index, extract only the given range of bytes\n"
+                    "\t\t\tof each stream. The end may be left out to read to the\n"
+                    "\t\t\tend of the stream.\n"
+                    "  -j jobs, --jobs=jobs\n"
+                    "\t\t\tThe number of threads decompressing fragments compressed\n"
+                    "\t\t\tby tarmux -C, defaults to the number of CPUs.\n"
+                    "  -S name, --stats=name\n"
+                    "\t\t\tKeep statistics of the bytes and fragments written to\n"
+                    "\t\t\teach file/pipe, the fragment sizes, and the time spent\n"
+                    "\t\t\treading and writing, written as JSON to the named file,\n"
+                    "\t\t\tor to stderr if '-', on SIGUSR1 and on exit. Fragments\n"
+                    "\t\t\tstamped by tarmux -T add histograms of their latency,\n"
+                    "\t\t\tand of the time between them.\n"
+                    "  --stats-interval=ms\n"
+                    "\t\t\tAlso write the statistics every interval.\n"
                     "  [file1] [...]\t\tOptional files/pipes expected in the tar stream.\n"
                     "\t\t\tData will be demultiplexed and written to each file/pipe. If this\n"
                     "\t\t\tfile/pipe exists, data will be written to the existing file.\n"
                     "\n"
+                    "The exit status is 0 on success, and 4 if the tar stream fails an\n"
+                    "integrity check: a fragment out of sequence, a checksum mismatch, or a\n"
+                    "compressed fragment that cannot be decompressed. Other errors exit\n"
+                    "with 1, 2 or 3.\n"
+                    "\n"
                     "This tool is based on libarchive, and is licensed under the Apache License,\n"
                     "Version 2.0.\n"
-                    "", name);
+                    "", name, name, name, name);
+}
+
+void version()
+{
+    printf(PACKAGE_STRING "\n");
+}
+
+/*
+ * Wait for the given file descriptor to become ready.
+ */
+static void wait_fd(int fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    poll(&pfd, 1, -1);
+}
+
+/*
+ * Write a buffer to the given destination in full, waiting if the
+ * destination would block.
+ */
+static int write_full(demux_t *demux, const unsigned char *buf, size_t len)
+{
+    while (len) {
+        ssize_t size = write(demux->fd, buf, len);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                wait_fd(demux->fd, POLLOUT);
+                continue;
+            }
+            fprintf(stderr, "Error: could not write data block to %s: %s\n",
+                    demux->pathname, strerror(errno));
+            return -1;
+        }
+        len -= size;
+        buf += size;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Write out the queue of the given destination, from its own thread, so
+ * that a slow destination holds up no other.
+ */
+static void *queue_writer(void *arg)
+{
+    queue_t *q = arg;
+    demux_t out = { 0 };
+    demux_t *demux = &out;
+    unsigned char *buffer = NULL;
+
+    /* the destination array may move, keep our own copy */
+    out.pathname = q->pathname;
+    out.fd = q->fd;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        chunk_t *chunk;
+
+        while (!q->head && !q->closing) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        if (!(chunk = q->head)) {
+            break;
+        }
+        q->head = chunk->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (chunk->data) {
+            if (write_full(demux, chunk->data, chunk->len)) {
+                exit(1);
+            }
+        }
+        else if (chunk->spill < 0) {
+            if (sparse_skip(demux->fd, chunk->len)) {
+                fprintf(stderr, "Error: could not leave a hole in %s: %s\n",
+                        demux->pathname, strerror(errno));
+                exit(1);
+            }
+        }
+        else {
+            off_t offset = chunk->spill;
+            size_t remaining = chunk->len;
+
+            if (!buffer && !(buffer = malloc(QUEUE_SPILL_BUFFER))) {
+                fprintf(stderr, "Could not allocate buffer.\n");
+                exit(3);
+            }
+
+            while (remaining) {
+                ssize_t size = pread(fileno(q->spill), buffer,
+                        remaining > QUEUE_SPILL_BUFFER ?
+                                QUEUE_SPILL_BUFFER : remaining, offset);
+                if (size <= 0) {
+                    fprintf(stderr, "Error: could not read spill file for %s: %s\n",
+                            demux->pathname, size ? strerror(errno) : "truncated");
+                    exit(1);
+                }
+                if (write_full(demux, buffer, size)) {
+                    exit(1);
+                }
+                remaining -= size;
+                offset += size;
+            }
+        }
+
+        pthread_mutex_lock(&q->lock);
+        if (chunk->data) {
+            q->queued -= chunk->len;
+            pthread_cond_signal(&q->space);
+        }
+        /* nothing left in the spill file, start it again */
+        if (!q->head) {
+            q->spill_offset = 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        free(chunk);
+
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    free(buffer);
+
+    if (close(demux->fd)) {
+        fprintf(stderr, "Error: Could not close %s: %s\n",
+                demux->pathname, strerror(errno));
+        exit(1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Give the destination a queue of up to size bytes, and a thread to
+ * write it out.
+ */
+static void queue_start(demux_t *demux, size_t size, policy_e policy)
+{
+    queue_t *q;
+
+    q = demux->queue = calloc(1, sizeof(queue_t));
+    if (!q) {
+        fprintf(stderr, "Could not allocate queue.\n");
+        exit(3);
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready, NULL);
+    pthread_cond_init(&q->space, NULL);
+    q->pathname = demux->target ? demux->target : demux->pathname;
+    q->fd = demux->fd;
+    q->size = size;
+    q->policy = policy;
+
+    if (pthread_create(&q->thread, NULL, queue_writer, q)) {
+        fprintf(stderr, "Could not create writer thread.\n");
+        exit(3);
+    }
+}
+
+/*
+ * Add data to the queue of the given destination. Once the queue is
+ * full we wait, spill the data to a temporary file, or drop the data,
+ * according to the policy.
+ */
+static int queue_write(demux_t *demux, const unsigned char *buf, size_t len)
+{
+    queue_t *q = demux->queue;
+    chunk_t *chunk;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->closing) {
+        fprintf(stderr, "Error: Data after the end of the stream for %s, aborting.\n",
+                demux->pathname);
+        exit(4);
+    }
+
+    if (q->policy == POLICY_BLOCK) {
+        while (q->queued && q->queued + len > q->size) {
+            pthread_cond_wait(&q->space, &q->lock);
+        }
+    }
+
+    if (q->queued && q->queued + len > q->size) {
+
+        if (q->policy == POLICY_DROP) {
+            if (!q->dropped) {
+                fprintf(stderr,
+                        "Warning: %s is not keeping up, dropping data.\n",
+                        demux->pathname);
+            }
+            q->dropped += len;
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+
+        /* spill to disk, in order behind what is already queued */
+        if (!q->spill && !(q->spill = tmpfile())) {
+            fprintf(stderr, "Error: could not create spill file for %s: %s\n",
+                    demux->pathname, strerror(errno));
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+
+        chunk = malloc(sizeof(chunk_t));
+        if (!chunk) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+        chunk->data = NULL;
+        chunk->spill = q->spill_offset;
+        chunk->len = len;
+
+        while (len) {
+            ssize_t size = pwrite(fileno(q->spill), buf, len,
+                    q->spill_offset);
+            if (size < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (size < 0) {
+                fprintf(stderr, "Error: could not write spill file for %s: %s\n",
+                        demux->pathname, strerror(errno));
+                pthread_mutex_unlock(&q->lock);
+                free(chunk);
+                return -1;
+            }
+            q->spill_offset += size;
+            buf += size;
+            len -= size;
+        }
+
+    }
+    else {
+
+        chunk = malloc(sizeof(chunk_t) + len);
+        if (!chunk) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+        chunk->data = (unsigned char *)(chunk + 1);
+        chunk->len = len;
+        memcpy(chunk->data, buf, len);
+
+        q->queued += len;
+
+    }
+
+    chunk->next = NULL;
+    if (q->tail) {
+        q->tail->next = chunk;
+    }
+    else {
+        q->head = chunk;
+    }
+    q->tail = chunk;
+
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+/*
+ * Add a hole of len bytes to the queue of the given destination, left
+ * by the writer thread once everything before it has been written.
+ */
+static void queue_hole(demux_t *demux, int64_t len)
+{
+    queue_t *q = demux->queue;
+    chunk_t *chunk;
+
+    chunk = malloc(sizeof(chunk_t));
+    if (!chunk) {
+        fprintf(stderr, "Could not allocate buffer.\n");
+        exit(3);
+    }
+    chunk->data = NULL;
+    chunk->spill = -1;
+    chunk->len = len;
+    chunk->next = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) {
+        q->tail->next = chunk;
+    }
+    else {
+        q->head = chunk;
+    }
+    q->tail = chunk;
+
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Mark the end of the queue, the writer thread closes the destination
+ * once everything queued has been written.
+ */
+static void queue_close(demux_t *demux)
+{
+    queue_t *q = demux->queue;
+
+    pthread_mutex_lock(&q->lock);
+    q->closing = 1;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Wait for the writer thread of the given destination to finish, and
+ * release the queue.
+ */
+static void queue_finish(demux_t *demux)
+{
+    queue_t *q = demux->queue;
+
+    queue_close(demux);
+    pthread_join(q->thread, NULL);
+
+    if (q->dropped) {
+        fprintf(stderr, "Warning: %" PRId64 " bytes dropped from %s.\n",
+                q->dropped, demux->pathname);
+    }
+
+    if (q->spill) {
+        fclose(q->spill);
+    }
+    pthread_cond_destroy(&q->space);
+    pthread_cond_destroy(&q->ready);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+
+    demux->queue = NULL;
+    demux->fd = -1;
+}
+#endif
+
+/*
+ * Write a buffer to the given destination, through the destination's
+ * queue if it has one.
+ */
+static int demux_write(demux_t *demux, const unsigned char *buf, size_t len)
+{
+    int64_t start = stats_clock(demux->stats);
+    int rv;
+
+#ifdef HAVE_PTHREAD_H
+    if (demux->queue) {
+        rv = queue_write(demux, buf, len);
+        stats_write(demux->stats, start);
+        return rv;
+    }
+#endif
+    rv = write_full(demux, buf, len);
+    stats_write(demux->stats, start);
+
+    return rv;
+}
+
+/*
+ * Hash the given pathname, of the given length.
+ */
+static uint32_t path_hash(const char *pathname, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*pathname++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+/*
+ * Add the destination at the given index to the hash table, growing
+ * the table to keep it no more than half full.
+ */
+static void demux_insert(streams_t *streams, int i)
+{
+    demux_t *demux = &streams->demux[i];
+    size_t slot;
+
+    if ((size_t)streams->demux_count * 2 >= streams->table_size) {
+        size_t size = streams->table_size ? streams->table_size * 2 : 64;
+        int j;
+
+        free(streams->table);
+        streams->table = malloc(size * sizeof(int));
+        if (!streams->table) {
+            fprintf(stderr, "Could not allocate hash table.\n");
+            exit(3);
+        }
+        memset(streams->table, 0xff, size * sizeof(int));
+        streams->table_size = size;
+
+        /* the new destination is rehashed along with the rest */
+        for (j = 0; j < streams->demux_count; j++) {
+            if (j != i) {
+                demux_insert(streams, j);
+            }
+        }
+    }
+
+    slot = path_hash(demux->pathname, demux->len) & (streams->table_size - 1);
+    while (streams->table[slot] >= 0) {
+        slot = (slot + 1) & (streams->table_size - 1);
+    }
+    streams->table[slot] = i;
+}
+
+/*
+ * Add a destination with the given pathname, opening the file.
+ */
+static demux_t *demux_add(streams_t *streams, const char *pathname,
+        size_t len)
+{
+    demux_t *demux;
+
+    streams->demux = realloc(streams->demux,
+            (streams->demux_count + 1) * sizeof(demux_t));
+    if (!streams->demux) {
+        fprintf(stderr, "Could not allocate destination.\n");
+        exit(3);
+    }
+
+    demux = &streams->demux[streams->demux_count];
+    memset(demux, 0, sizeof(demux_t));
+
+    demux->pathname = strndup(pathname, len);
+    demux->len = len;
+    demux->stats = stats_source(streams->stats, demux->pathname);
+
+    if ((demux->fd = open(demux->pathname,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666)) < 0) {
+        perror(demux->pathname);
+        exit(2);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (streams->queue_size) {
+        queue_start(demux, streams->queue_size, streams->policy);
+    }
+#endif
+
+    streams->demux_count++;
+
+    demux_insert(streams, streams->demux_count - 1);
+
+    return demux;
+}
+
+/*
+ * Check that the fragment index follows on from the last fragment
+ * written to the destination.
+ */
+static void demux_sequence(demux_t *demux, intmax_t index,
+        const char *pathname)
+{
+    /* not one of ours, nothing to check */
+    if (index < 0) {
+        return;
+    }
+
+    if (index != demux->index) {
+        fprintf(stderr,
+                "Error: Fragment index out of sequence, expected %" PRIdMAX ", aborting: %s\n",
+                demux->index, pathname);
+        exit(4);
+    }
+
+    demux->index++;
+}
+
+/*
+ * Open again a destination closed by the end of its stream, when the
+ * stream carries on, as when a source is added to tarmux again under
+ * the same name. The data follows on from that written before.
+ */
+static void demux_reopen(streams_t *streams, demux_t *demux)
+{
+#ifdef HAVE_PTHREAD_H
+    if (demux->queue) {
+        if (!demux->queue->closing) {
+            return;
+        }
+        queue_finish(demux);
+    }
+#endif
+    if (demux->fd >= 0) {
+        return;
+    }
+
+    if ((demux->fd = open(demux->pathname,
+            O_WRONLY | O_CREAT | O_NONBLOCK, 0666)) < 0) {
+        perror(demux->pathname);
+        exit(2);
+    }
+    lseek(demux->fd, 0, SEEK_END);
+
+#ifdef HAVE_PTHREAD_H
+    if (streams->queue_size) {
+        queue_start(demux, streams->queue_size, streams->policy);
+    }
+#endif
+}
+
+/*
+ * Look up the destination named by the given base pathname, opening a
+ * new destination if all pathnames are being unpacked.
+ *
+ * Returns NULL if the pathname is not wanted.
+ */
+static demux_t *demux_lookup(streams_t *streams, const char *pathname,
+        size_t len)
+{
+    size_t slot;
+
+    if (streams->table_size) {
+        slot = path_hash(pathname, len) & (streams->table_size - 1);
+        while (streams->table[slot] >= 0) {
+            demux_t *candidate = &streams->demux[streams->table[slot]];
+            if (candidate->len == len
+                    && !strncmp(candidate->pathname, pathname, len)) {
+                return candidate;
+            }
+            slot = (slot + 1) & (streams->table_size - 1);
+        }
+    }
+
+    if (streams->all) {
+        return demux_add(streams, pathname, len);
+    }
+
+    return NULL;
+}
+
+/*
+ * Name the file to which the given tar stream of many is written, the
+ * file given on the command line for the stream, or the template with
+ * each %d replaced by the number of the stream, counting from zero.
+ */
+static char *multi_target(streams_t *streams, int k)
+{
+    const char *t = streams->template;
+    char number[32];
+    char *target, *p;
+    size_t len;
+
+    if (!t) {
+        return k < streams->target_count ? strdup(streams->targets[k]) : NULL;
+    }
+
+    len = snprintf(number, sizeof(number), "%d", k);
+
+    p = target = malloc(strlen(t) * (len + 1) + 1);
+    if (!target) {
+        fprintf(stderr, "Could not allocate pathname.\n");
+        exit(3);
+    }
+
+    while (*t) {
+        if (t[0] == '%' && t[1] == 'd') {
+            memcpy(p, number, len);
+            p += len;
+            t += 2;
+        }
+        else if (t[0] == '%' && t[1] == '%') {
+            *p++ = '%';
+            t += 2;
+        }
+        else {
+            *p++ = *t++;
+        }
+    }
+    *p = 0;
+
+    return target;
+}
+
+/*
+ * Open the file for the next of many tar streams, which then takes the
+ * place of stdout until the end of the stream.
+ */
+static void multi_open(streams_t *streams)
+{
+    demux_t *demux;
+
+    streams->multi = realloc(streams->multi,
+            (streams->multi_count + 1) * sizeof(demux_t *));
+    demux = calloc(1, sizeof(demux_t));
+    if (!streams->multi || !demux) {
+        fprintf(stderr, "Could not allocate destination.\n");
+        exit(3);
+    }
+
+    if (!(demux->target = multi_target(streams, streams->multi_count))) {
+        fprintf(stderr,
+                "Error: More tar streams than files to write them to, aborting.\n");
+        exit(1);
+    }
+    demux->stats = stats_source(streams->stats, demux->target);
+
+    if ((demux->fd = open(demux->target,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666)) < 0) {
+        perror(demux->target);
+        exit(2);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (streams->queue_size) {
+        queue_start(demux, streams->queue_size, streams->policy);
+    }
+#endif
+
+    streams->multi[streams->multi_count++] = demux;
+    streams->sdemux = demux;
+}
+
+/*
+ * Find the destination for the given pathname in the stream, opening a
+ * new destination if all pathnames are being unpacked.
+ *
+ * Returns NULL if the pathname is not one of those selected, to be
+ * skipped. Exits if the pathname is not expected otherwise, or the
+ * fragment is out of sequence.
+ */
+static demux_t *demux_find(streams_t *streams, const char *pathname)
+{
+    demux_t *demux;
+    intmax_t index;
+    size_t len;
+
+    len = ustar_pathlen(pathname, &index);
+
+    /* the first entry of each of many streams opens its file */
+    if (streams->multiple && !streams->sdemux) {
+        multi_open(streams);
+    }
+
+    /* handle demux to stdout */
+    if (streams->sdemux) {
+        demux = streams->sdemux;
+        if (!demux->pathname) {
+            demux->pathname = strndup(pathname, len);
+            demux->len = len;
+            if (index > 0) {
+                fprintf(stderr,
+                        "Error: First stream index is non-zero (%" PRIdMAX "), not at the start of the stream, aborting: %s\n",
+                        index, pathname);
+                exit(4);
+            }
+        }
+        else if (demux->len != len || strncmp(demux->pathname, pathname, len)) {
+            fprintf(stderr,
+                    "Error: Unexpected additional path in stream, aborting: %s\n",
+                    pathname);
+            exit(1);
+        }
+        demux_sequence(demux, index, pathname);
+        return demux;
+    }
+
+    /* handle demux to individual files */
+    demux = demux_lookup(streams, pathname, len);
+    if (!demux && streams->select) {
+        return NULL;
+    }
+    else if (!demux) {
+        fprintf(stderr,
+                "Error: Unnamed path in stream, aborting: %s\n",
+                pathname);
+        exit(1);
+    }
+
+    demux_sequence(demux, index, pathname);
+    demux_reopen(streams, demux);
+
+    return demux;
+}
+
+/*
+ * Handle the end of a fragment written to the given destination. An
+ * empty fragment marks the end of the stream, and the file is closed,
+ * or will be closed once its queue has been written.
+ */
+static void demux_end(streams_t *streams, demux_t *demux, ssize_t total)
+{
+    demux->offset += total;
+    stats_fragment(demux->stats, total);
+
+    if (total == 0 && demux != streams->sdemux) {
+#ifdef HAVE_PTHREAD_H
+        if (demux->queue) {
+            queue_close(demux);
+            return;
+        }
+#endif
+        if (close(demux->fd)) {
+            fprintf(stderr, "Error: Could not close %s: %s\n",
+                    demux->pathname, strerror(errno));
+            exit(1);
+        }
+        demux->fd = -1;
+    }
+}
+
+/*
+ * Handle the end of one of many tar streams, closing its file once
+ * everything for it has been written, while the next stream is read.
+ *
+ * Returns 1 if the stream held any entries, or 0 if there are no more
+ * streams.
+ */
+static int multi_close(streams_t *streams)
+{
+    demux_t *demux = streams->sdemux;
+
+    if (!demux) {
+        return 0;
+    }
+    streams->sdemux = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    if (demux->queue) {
+        queue_close(demux);
+        return 1;
+    }
+#endif
+    if (close(demux->fd)) {
+        fprintf(stderr, "Error: Could not close %s: %s\n",
+                demux->target, strerror(errno));
+        exit(1);
+    }
+    demux->fd = -1;
+
+    return 1;
+}
+
+/*
+ * Compare the CRC32C of a fragment's payload with the one recorded by
+ * tarmux, if any, exiting with a corrupt stream if they differ.
+ */
+static void demux_verify(demux_t *demux, int64_t expected, uint32_t crc)
+{
+    if (expected >= 0 && crc != (uint32_t)expected) {
+        fprintf(stderr,
+                "Error: Fragment checksum mismatch, aborting: %s\n",
+                demux->pathname);
+        exit(4);
+    }
+}
+
+/*
+ * Verify and decompress a fragment, run on a worker thread.
+ */
+static void job_work(void *arg)
+{
+    job_t *job = arg;
+
+    if (job->crc >= 0) {
+        job->sum = crc32c(0, job->packed, job->len);
+        if (job->sum != job->crc) {
+            return;
+        }
+    }
+
+    job->buffer = malloc(job->size);
+    if (!job->buffer) {
+        fprintf(stderr, "Could not allocate decompression buffer.\n");
+        exit(3);
+    }
+
+    job->failed = codec_decompress(job->codec, job->packed, job->len,
+            job->buffer, job->size) < 0;
+}
+
+/*
+ * Write a decompressed fragment to its destination, run in the order
+ * the fragments were read.
+ */
+static void job_done(void *arg, void *ctx)
+{
+    streams_t *streams = ctx;
+    job_t *job = arg;
+    demux_t *demux = job->slot < 0 ?
+            streams->sdemux : &streams->demux[job->slot];
+
+    demux_verify(demux, job->crc, job->sum);
+
+    if (job->failed) {
+        fprintf(stderr, "Error: Corrupt compressed fragment, aborting: %s\n",
+                demux->pathname);
+        exit(4);
+    }
+
+    if (demux_write(demux, job->buffer, job->size)) {
+        exit(1);
+    }
+    demux->offset += job->size;
+    stats_fragment(demux->stats, job->size);
+
+    free(job->buffer);
+    free(job->packed);
+    free(job);
+}
+
+/*
+ * Hand a fragment compressed by tarmux to the pool of threads, to be
+ * verified against the given CRC32C if there is one, decompressed, and
+ * then written to the given destination in order. The pool takes
+ * ownership of the compressed data.
+ *
+ * The destination is remembered by its slot, as the array of
+ * destinations may grow before the fragment is written.
+ */
+static void demux_decompress(streams_t *streams, demux_t *demux, int codec,
+        unsigned char *packed, size_t len, int64_t size, int64_t crc)
+{
+    job_t *job;
+
+    if (codec < 0) {
+        fprintf(stderr,
+                "Error: Compression not supported by this build, aborting: %s\n",
+                demux->pathname);
+        exit(2);
+    }
+    if (size <= 0 || size > (1 << 30)) {
+        fprintf(stderr,
+                "Error: Corrupt compressed fragment size, aborting: %s\n",
+                demux->pathname);
+        exit(4);
+    }
+
+    if (!streams->pool) {
+        streams->pool = pool_create(streams->jobs, 2 * streams->jobs,
+                job_work, job_done, streams);
+    }
+
+    job = calloc(1, sizeof(job_t));
+    if (!job) {
+        fprintf(stderr, "Could not allocate decompression buffer.\n");
+        exit(3);
+    }
+    job->packed = packed;
+    job->len = len;
+    job->size = size;
+    job->crc = crc;
+    job->codec = codec;
+    job->slot = demux == streams->sdemux ? -1 : demux - streams->demux;
+
+    pool_submit(streams->pool, job);
+}
+
+/*
+ * Write out any fragments still being decompressed, before data that
+ * must follow them.
+ */
+static void demux_drain(streams_t *streams)
+{
+    if (streams->pool) {
+        pool_drain(streams->pool);
+    }
+}
+
+/*
+ * Find the compression of an entry read by libarchive, from the
+ * extended attributes set by tarmux, setting size to the length of the
+ * original data, crc to the CRC32C of the payload or -1, sparse to the
+ * offset of the payload within the source or -1, and stamped to the
+ * time the fragment was read or -1.
+ */
+static int entry_attrs(struct archive_entry *entry, int64_t *size,
+        int64_t *crc, int64_t *sparse, int64_t *stamped)
+{
+    const char *name;
+    const void *value;
+    size_t len;
+    int codec = CODEC_NONE;
+
+    *size = 0;
+    *crc = -1;
+    *sparse = -1;
+    *stamped = -1;
+
+    archive_entry_xattr_reset(entry);
+    while (archive_entry_xattr_next(entry, &name, &value, &len)
+            == ARCHIVE_OK) {
+        char text[32];
+
+        snprintf(text, sizeof(text), "%.*s", (int)len, (const char *)value);
+        if (!strcmp(name, CODEC_ATTR_NAME)) {
+            codec = codec_parse(text, NULL);
+        }
+        else if (!strcmp(name, CODEC_ATTR_SIZE)) {
+            *size = strtoll(text, NULL, 10);
+        }
+        else if (!strcmp(name, CRC32C_ATTR_NAME)) {
+            *crc = strtoul(text, NULL, 16);
+        }
+        else if (!strcmp(name, SPARSE_ATTR_OFFSET)) {
+            *sparse = strtoll(text, NULL, 10);
+        }
+        else if (!strcmp(name, STATS_ATTR_TIME)) {
+            *stamped = stats_stamp(text);
+        }
+    }
+
+    return codec;
+}
+
+/*
+ * Read the whole of a compressed entry from libarchive into a buffer
+ * of its own, to be handed to the pool.
+ */
+static unsigned char *transfer_packed(struct archive *a,
+        struct archive_entry *entry, size_t *len)
+{
+    int64_t size = archive_entry_size(entry);
+    unsigned char *packed;
+    size_t offset = 0;
+
+    if (size <= 0 || size > (1 << 30)) {
+        fprintf(stderr, "Error: Corrupt compressed fragment size, aborting.\n");
+        return NULL;
+    }
+
+    packed = malloc(size);
+    if (!packed) {
+        fprintf(stderr, "Could not allocate decompression buffer.\n");
+        exit(3);
+    }
+
+    while (offset < (size_t)size) {
+        la_ssize_t got = archive_read_data(a, packed + offset, size - offset);
+        if (got < 0) {
+            fprintf(stderr, "Error: while reading data block: %s\n",
+                    archive_error_string(a));
+            free(packed);
+            return NULL;
+        }
+        else if (got == 0) {
+            break;
+        }
+        offset += got;
+    }
+
+    *len = offset;
+
+    return packed;
+}
+
+/*
+ * Write the data of the current entry to the given destination,
+ * checking it against the given CRC32C on the way through, unless the
+ * crc is -1.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ */
+ssize_t transfer(struct archive *a, demux_t *demux, int64_t crc)
+{
+    const void *buff;
+    size_t len;
+    off_t offset;
+
+    int rv;
+    ssize_t total = 0;
+    uint32_t sum = 0;
+
+    for (;;) {
+        int64_t start = stats_clock(demux->stats);
+
+        rv = archive_read_data_block(a, &buff, &len, &offset);
+        stats_read(demux->stats, start, 1);
+        if (rv == ARCHIVE_FATAL) {
+            fprintf(stderr, "Error: while reading data block: %s\n", archive_error_string(a));
+            break;
+        }
+        if (rv == ARCHIVE_WARN) {
+            fprintf(stderr, "Warning: while reading data block: %s\n", archive_error_string(a));
+        }
+
+        if (crc >= 0) {
+            sum = crc32c(sum, buff, len);
+        }
+
+        if (demux_write(demux, buff, len)) {
+            break;
+        }
+        total += len;
+
+        if (rv == ARCHIVE_RETRY) {
+            fprintf(stderr, "Warning (Retry): while reading data block: %s\n", archive_error_string(a));
+            continue;
+        }
+        if (rv == ARCHIVE_EOF) {
+            demux_verify(demux, crc, sum);
+            return total;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Read up to len bytes from the tar stream, stopping early only at the
+ * end of the input.
+ */
+static ssize_t reader_read(reader_t *r, unsigned char *buf, size_t len)
+{
+    size_t offset = 0;
+
+    while (offset < len) {
+        ssize_t size = read(r->fd, buf + offset, len - offset);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                wait_fd(r->fd, POLLIN);
+                continue;
+            }
+            fprintf(stderr, "Error: while reading archive: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        else if (size == 0) {
+            break;
+        }
+        offset += size;
+        r->offset += size;
+    }
+
+    return offset;
+}
+
+/*
+ * Skip over len bytes of the tar stream, stopping early only at the
+ * end of the input.
+ */
+static ssize_t reader_skip(reader_t *r, size_t len)
+{
+    size_t offset = 0;
+
+    while (offset < len) {
+        size_t size = len - offset;
+        ssize_t got;
+
+        if (size > r->buffer_size) {
+            size = r->buffer_size;
+        }
+
+        got = reader_read(r, r->buffer, size);
+        if (got < 0) {
+            return -1;
+        }
+        offset += got;
+        if ((size_t)got < size) {
+            break;
+        }
+    }
+
+    return offset;
+}
+
+/*
+ * Pass over the payload of an entry that is not wanted, and its
+ * padding, seeking past it where the input can seek, and otherwise
+ * reading and discarding it.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+static int reader_pass(reader_t *r, int64_t size)
+{
+    int64_t padded = (size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+    ssize_t len;
+
+    if (!padded) {
+        return 0;
+    }
+
+    if (lseek(r->fd, padded, SEEK_CUR) >= 0) {
+        r->offset += padded;
+        return 0;
+    }
+
+    len = reader_skip(r, padded);
+    if (len < 0) {
+        return -1;
+    }
+    else if (len < padded) {
+        fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the records of a pax extended header, picking out the
+ * attributes we care about.
+ */
+static int reader_pax(reader_t *r, char *data, size_t len)
+{
+    ustar_pax_t pax;
+
+    /* attributes not given keep the values they have */
+    pax.path = NULL;
+    pax.stamp = NULL;
+    pax.size = r->size;
+    pax.original = r->original;
+    pax.crc = r->crc;
+    pax.sparse = r->sparse;
+    pax.codec = r->codec;
+
+    if (ustar_pax(&pax, data, len)) {
+        fprintf(stderr, "Error: Corrupt pax extended header, aborting.\n");
+        return -1;
+    }
+
+    if (pax.path) {
+        free(r->pathname);
+        r->pathname = strdup(pax.path);
+    }
+    if (pax.stamp) {
+        r->stamped = stats_stamp(pax.stamp);
+    }
+    r->size = pax.size;
+    r->original = pax.original;
+    r->crc = pax.crc;
+    r->sparse = pax.sparse;
+    r->codec = pax.codec;
+
+    return 0;
+}
+
+/*
+ * Read the data of a metadata entry, consuming the padding that
+ * follows it.
+ */
+static char *reader_data(reader_t *r, int64_t size)
+{
+    size_t padded;
+    char *data;
+
+    if (size < 0 || size > 64 * 1024 * 1024) {
+        fprintf(stderr, "Error: Oversized tar metadata entry, aborting.\n");
+        return NULL;
+    }
+
+    padded = (size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+
+    data = malloc(padded + 1);
+    if (!data) {
+        fprintf(stderr, "Error: Could not allocate tar metadata buffer.\n");
+        return NULL;
+    }
+
+    if (reader_read(r, (unsigned char *)data, padded) != (ssize_t)padded) {
+        fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+        free(data);
+        return NULL;
+    }
+    data[size] = 0;
+
+    return data;
+}
+
+/*
+ * Read the next entry header from a tar stream, leaving the pathname
+ * and size of the entry in the reader.
+ *
+ * Returns 1 for an entry, 0 at the end of the archive, -1 on error,
+ * and -2 if the stream does not start with a tar header, in which case
+ * the data read so far remains in the reader for libarchive to use.
+ */
+static int reader_next(reader_t *r)
+{
+    free(r->pathname);
+    r->pathname = NULL;
+    r->size = -1;
+    r->codec = CODEC_NONE;
+    r->original = 0;
+    r->crc = -1;
+    r->sparse = -1;
+    r->stamped = -1;
+
+    for (;;) {
+        unsigned char *block = r->block;
+        int64_t size;
+        ssize_t len;
+        char *data;
+        int i;
+
+        len = reader_read(r, block, TAR_BLOCK_SIZE);
+        if (len < 0) {
+            return -1;
+        }
+        else if (len < TAR_BLOCK_SIZE) {
+            if (r->offset == len) {
+                r->prefix = len;
+                return -2;
+            }
+            fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+            return -1;
+        }
+
+        /* end of archive, consume the rest of the record */
+        for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++);
+        if (i == TAR_BLOCK_SIZE) {
+            if (reader_skip(r, TAR_BLOCK_SIZE) < 0
+                    || reader_skip(r, (TAR_RECORD_SIZE
+                            - (r->offset % TAR_RECORD_SIZE))
+                            % TAR_RECORD_SIZE) < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (!ustar_checksum(block)) {
+            if (r->offset == TAR_BLOCK_SIZE) {
+                r->prefix = TAR_BLOCK_SIZE;
+                return -2;
+            }
+            fprintf(stderr, "Error: Corrupt tar header checksum, aborting.\n");
+            return -1;
+        }
+
+        r->type = block[156];
+        size = ustar_number(block + 124, 12);
+
+        switch (r->type) {
+        case 'x':
+            if (!(data = reader_data(r, size))) {
+                return -1;
+            }
+            if (reader_pax(r, data, size)) {
+                free(data);
+                return -1;
+            }
+            free(data);
+            break;
+        case 'L':
+            if (!(data = reader_data(r, size))) {
+                return -1;
+            }
+            free(r->pathname);
+            r->pathname = data;
+            break;
+        case 'g':
+            if (!(data = reader_data(r, size))) {
+                return -1;
+            }
+            free(data);
+            break;
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+            /* special files carry no data, as libarchive sees them */
+            r->size = 0;
+            /* fall through */
+        case '0':
+        case '\0':
+        case '7':
+            if (!r->pathname) {
+                r->pathname = malloc(USTAR_NAME_MAX);
+                if (!r->pathname) {
+                    fprintf(stderr, "Error: Could not allocate pathname.\n");
+                    return -1;
+                }
+                ustar_pathname(r->pathname, block);
+            }
+            if (r->size < 0) {
+                r->size = size;
+            }
+            return 1;
+        default:
+            fprintf(stderr,
+                    "Error: Unsupported tar entry type '%c' in stream, aborting.\n",
+                    r->type);
+            return -1;
+        }
+    }
+}
+
+/*
+ * Decide how data will be moved from the tar stream to the given
+ * destination, based on the kind of file at each end.
+ */
+static copy_e demux_copy(reader_t *r, demux_t *demux)
+{
+    struct stat in, out;
+
+    /* queued data passes through our hands */
+    if (demux->queue) {
+        return COPY_RW;
+    }
+
+    if (fstat(r->fd, &in) || fstat(demux->fd, &out)) {
+        return COPY_RW;
+    }
+
+#ifdef HAVE_SPLICE
+    if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode)) {
+        return COPY_SPLICE;
+    }
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+    if (S_ISREG(in.st_mode) && S_ISREG(out.st_mode)) {
+        return COPY_FILE_RANGE;
+    }
+#endif
+
+    return COPY_RW;
+}
+
+/*
+ * Move the payload of the current entry to the given destination,
+ * without the data passing through userspace where the kernel allows
+ * it, then consume the padding that follows.
+ *
+ * A payload with a checksum is read through userspace and checked as
+ * it is copied. A fragment that fits the buffer is checked before any
+ * of it is written.
+ *
+ * Returns the number of bytes moved, or -1 on error.
+ */
+static ssize_t splice_transfer(reader_t *r, demux_t *demux)
+{
+    int64_t remaining = r->size;
+    ssize_t total = 0;
+    uint32_t sum = 0;
+    int64_t start;
+    copy_e copy;
+
+    if (!demux->copy) {
+        demux->copy = demux_copy(r, demux);
+    }
+    copy = r->crc >= 0 ? COPY_RW : demux->copy;
+
+    while (remaining) {
+        size_t len = remaining > (1 << 30) ? (1 << 30) : remaining;
+        ssize_t size;
+
+        start = stats_clock(demux->stats);
+
+        switch (copy) {
+#ifdef HAVE_SPLICE
+        case COPY_SPLICE:
+            size = splice(r->fd, NULL, demux->fd, NULL, len,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+        case COPY_FILE_RANGE:
+            size = copy_file_range(r->fd, NULL, demux->fd, NULL, len, 0);
+            break;
+#endif
+        default:
+            if (len > r->buffer_size) {
+                len = r->buffer_size;
+            }
+            size = reader_read(r, r->buffer, len);
+            stats_read(demux->stats, start, 1);
+            if (size < 0) {
+                return -1;
+            }
+            else if ((size_t)size < len) {
+                fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+                return -1;
+            }
+            if (r->crc >= 0) {
+                sum = crc32c(sum, r->buffer, size);
+                if (size == remaining) {
+                    demux_verify(demux, r->crc, sum);
+                }
+            }
+            if (demux_write(demux, r->buffer, size)) {
+                return -1;
+            }
+            remaining -= size;
+            total += size;
+            continue;
+        }
+
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                wait_fd(r->fd, POLLIN);
+                wait_fd(demux->fd, POLLOUT);
+                stats_write(demux->stats, start);
+                continue;
+            }
+            else if (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                    || errno == EOPNOTSUPP
+                    || (errno == EBADF && demux->copy == COPY_FILE_RANGE)) {
+                /* not possible between these files, fall back to copying */
+                copy = demux->copy = COPY_RW;
+                continue;
+            }
+            fprintf(stderr, "Error: could not move data block to %s: %s\n",
+                    demux->pathname, strerror(errno));
+            return -1;
+        }
+        else if (size == 0) {
+            fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+            return -1;
+        }
+        stats_write(demux->stats, start);
+
+        remaining -= size;
+        total += size;
+        r->offset += size;
+    }
+
+    if (reader_skip(r, (TAR_BLOCK_SIZE - (r->size % TAR_BLOCK_SIZE))
+            % TAR_BLOCK_SIZE) < 0) {
+        return -1;
+    }
+
+    return total;
+}
+
+#ifdef HAVE_URING
+/*
+ * Queue the write of what remains of the buffer at the head of the
+ * given destination's list, waiting for the destination to become
+ * writable first if it would block.
+ */
+static void uring_write(streams_t *streams, demux_t *demux, int wait)
+{
+    ubuf_t *buf = demux->uring_head;
+    uint64_t tag = (uintptr_t)buf | URING_WRITE;
+
+    if (wait) {
+        uring_poll(streams->ring, demux->fd, POLLOUT, URING_POLL);
+    }
+
+    uring_queue(streams->ring,
+            uring_fixed(streams->ring) ? IORING_OP_WRITE_FIXED :
+            IORING_OP_WRITE, demux->fd, buf->data + buf->offset,
+            buf->len - buf->offset, tag);
+}
+
+/*
+ * Handle the completion of a write, carrying on after a short write.
+ * Once a buffer is written it is free for the next read, and the next
+ * buffer for the destination is written.
+ */
+static void uring_written(streams_t *streams, ubuf_t *buf, int32_t res)
+{
+    demux_t *demux = buf->slot < 0 ?
+            streams->sdemux : &streams->demux[buf->slot];
+
+    if (res == -EAGAIN || res == -EINTR) {
+        uring_write(streams, demux, res == -EAGAIN);
+        return;
+    }
+    else if (res < 0) {
+        fprintf(stderr, "Error: could not write data block to %s: %s\n",
+                demux->pathname, strerror(-res));
+        exit(1);
+    }
+
+    buf->offset += res;
+    if (buf->offset < buf->len) {
+        uring_write(streams, demux, 0);
+        return;
+    }
+
+    stats_write(demux->stats, buf->start);
+
+    demux->uring_head = buf->next;
+    if (!demux->uring_head) {
+        demux->uring_tail = NULL;
+    }
+    else {
+        uring_write(streams, demux, 0);
+    }
+
+    buf->next = streams->uring_free;
+    streams->uring_free = buf;
+    streams->uring_busy--;
+}
+
+/*
+ * Submit what is queued, wait for at least one completion, and handle
+ * all completions waiting. A completed read of the input is handed
+ * back in res.
+ *
+ * Returns 1 if the read of the input completed.
+ */
+static int uring_wait(streams_t *streams, int32_t *read)
+{
+    uint64_t tag;
+    int32_t res;
+    int done = 0;
+
+    if (uring_submit(streams->ring, 1)) {
+        perror("Error: failure during io_uring");
+        exit(2);
+    }
+
+    while (uring_reap(streams->ring, &tag, &res)) {
+        switch (tag & URING_KIND) {
+        case URING_POLL:
+            /* the linked operation reports any error */
+            break;
+        case URING_WRITE:
+            uring_written(streams, (ubuf_t *)(uintptr_t)(tag & ~(uint64_t)URING_KIND),
+                    res);
+            break;
+        case URING_READ:
+            *read = res;
+            done = 1;
+            break;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Wait for every write in flight to complete, before the destinations
+ * are written by other means, or closed.
+ */
+static void uring_drain(streams_t *streams)
+{
+    int32_t res;
+
+    while (streams->ring && streams->uring_busy) {
+        uring_wait(streams, &res);
+    }
+}
+
+/*
+ * Move the payload of the current entry to the given destination
+ * through io_uring, checking it against the CRC32C recorded by tarmux
+ * on the way through if there is one.
+ *
+ * The input is read into the next free buffer while the buffers
+ * already read are written to their destinations, so that one system
+ * call both submits the writes and waits for the next read. Writes to
+ * each destination are made one at a time in order, while writes to
+ * different destinations overlap.
+ *
+ * Returns the number of bytes moved, or -1 on error.
+ */
+static ssize_t uring_transfer(streams_t *streams, reader_t *r,
+        demux_t *demux)
+{
+    int64_t remaining = r->size;
+    ssize_t total = 0;
+    uint32_t sum = 0;
+    int wait = 0;
+
+    while (remaining) {
+        size_t len = remaining > URING_BUFFER ? URING_BUFFER : remaining;
+        int64_t start;
+        int32_t res;
+        ubuf_t *buf;
+
+        /* wait for a buffer to come free */
+        while (!streams->uring_free) {
+            uring_wait(streams, &res);
+        }
+        buf = streams->uring_free;
+
+        if (wait) {
+            uring_poll(streams->ring, r->fd, POLLIN, URING_POLL);
+        }
+        uring_queue(streams->ring,
+                uring_fixed(streams->ring) ? IORING_OP_READ_FIXED :
+                IORING_OP_READ, r->fd, buf->data, len, URING_READ);
+
+        start = stats_clock(demux->stats);
+        while (!uring_wait(streams, &res));
+        stats_read(demux->stats, start, 1);
+
+        wait = res == -EAGAIN;
+        if (res == -EAGAIN || res == -EINTR) {
+            continue;
+        }
+        else if (res < 0) {
+            fprintf(stderr, "Error: while reading archive: %s\n",
+                    strerror(-res));
+            return -1;
+        }
+        else if (res == 0) {
+            fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+            return -1;
+        }
+
+        r->offset += res;
+        remaining -= res;
+        total += res;
+
+        if (r->crc >= 0) {
+            sum = crc32c(sum, buf->data, res);
+            if (!remaining) {
+                demux_verify(demux, r->crc, sum);
+            }
+        }
+
+        /* the buffer joins the destination's list of writes */
+        streams->uring_free = buf->next;
+        streams->uring_busy++;
+        buf->next = NULL;
+        buf->len = res;
+        buf->offset = 0;
+        buf->start = stats_clock(demux->stats);
+        buf->slot = demux == streams->sdemux ? -1 : demux - streams->demux;
+
+        if (demux->uring_tail) {
+            demux->uring_tail->next = buf;
+            demux->uring_tail = buf;
+        }
+        else {
+            demux->uring_head = demux->uring_tail = buf;
+            uring_write(streams, demux, 0);
+        }
+    }
+
+    if (reader_skip(r, (TAR_BLOCK_SIZE - (r->size % TAR_BLOCK_SIZE))
+            % TAR_BLOCK_SIZE) < 0) {
+        return -1;
+    }
+
+    return total;
+}
+
+/*
+ * Set up the ring and its buffers, registering the buffers with the
+ * kernel where it allows. Without io_uring in the kernel, the payload
+ * is moved as with -z instead.
+ */
+static void uring_start(streams_t *streams)
+{
+    unsigned char *region;
+    int i;
+
+    streams->ring = uring_create(2 * URING_BUFFERS + 4);
+    if (!streams->ring) {
+        return;
+    }
+
+    region = malloc(URING_BUFFERS * URING_BUFFER);
+    streams->uring_bufs = calloc(URING_BUFFERS, sizeof(ubuf_t));
+    if (!region || !streams->uring_bufs) {
+        fprintf(stderr, "Could not allocate buffer.\n");
+        exit(3);
+    }
+    uring_register(streams->ring, region, URING_BUFFERS * URING_BUFFER);
+
+    for (i = 0; i < URING_BUFFERS; i++) {
+        streams->uring_bufs[i].data = region + i * URING_BUFFER;
+        streams->uring_bufs[i].next = streams->uring_free;
+        streams->uring_free = &streams->uring_bufs[i];
+    }
+}
+
+/*
+ * Release the ring and its buffers, once all writes are done.
+ */
+static void uring_stop(streams_t *streams)
+{
+    if (streams->ring) {
+        uring_drain(streams);
+        uring_destroy(streams->ring);
+        free(streams->uring_bufs[0].data);
+        free(streams->uring_bufs);
+    }
+}
+#endif
+
+/*
+ * Leave a hole in the given destination where tarmux skipped one in
+ * the source, should the next fragment start further on than the data
+ * written so far. Everything before the hole is written first.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+static int demux_sparse(streams_t *streams, demux_t *demux, int64_t offset)
+{
+    if (offset < 0 || offset == demux->offset) {
+        return 0;
+    }
+
+    demux_drain(streams);
+#ifdef HAVE_URING
+    if (demux->uring_head) {
+        uring_drain(streams);
+    }
+#endif
+
+    if (offset < demux->offset) {
+        fprintf(stderr,
+                "Error: Fragment offset %" PRId64 " out of sequence, expected at least %" PRId64 ", aborting: %s\n",
+                offset, demux->offset, demux->pathname);
+        return -1;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (demux->queue) {
+        queue_hole(demux, offset - demux->offset);
+    }
+    else
+#endif
+    if (sparse_skip(demux->fd, offset - demux->offset)) {
+        fprintf(stderr, "Error: could not leave a hole in %s: %s\n",
+                demux->pathname, strerror(errno));
+        return -1;
+    }
+
+    demux->offset = offset;
+
+    return 0;
+}
+
+/*
+ * Demultiplex an uncompressed tar stream by parsing the headers
+ * ourselves, so that the payload can be moved directly from the input
+ * to each destination.
+ *
+ * Returns 0 at the end of the archive, -1 on error, and -2 if the
+ * stream is not a tar stream and must be handed to libarchive instead.
+ */
+static int splice_demux(streams_t *streams, reader_t *r)
+{
+    for (;;) {
+        int64_t start = stats_clock(streams->stats);
+        demux_t *dm;
+        ssize_t total;
+        int rv;
+
+        rv = reader_next(r);
+        stats_wait(streams->stats, start, 0);
+        if (rv <= 0) {
+#ifdef HAVE_URING
+            uring_drain(streams);
+#endif
+            demux_drain(streams);
+            return rv;
+        }
+
+        dm = demux_find(streams, r->pathname);
+        if (!dm) {
+            if (reader_pass(r, r->size)) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (demux_sparse(streams, dm, r->sparse)) {
+            return -1;
+        }
+
+        stats_arrival(dm->stats, r->stamped);
+
+        if (r->codec) {
+            unsigned char *packed;
+
+            start = stats_clock(dm->stats);
+            if (!(packed = (unsigned char *)reader_data(r, r->size))) {
+                return -1;
+            }
+            stats_read(dm->stats, start, 1);
+#ifdef HAVE_URING
+            uring_drain(streams);
+#endif
+            demux_decompress(streams, dm, r->codec, packed, r->size,
+                    r->original, r->crc);
+            continue;
+        }
+        demux_drain(streams);
+
+#ifdef HAVE_URING
+        if (streams->ring && !dm->queue) {
+            total = uring_transfer(streams, r, dm);
+        }
+        else
+#endif
+        total = splice_transfer(r, dm);
+        if (total < 0) {
+            return -1;
+        }
+
+#ifdef HAVE_URING
+        /* the file is closed once everything for it is written */
+        if (!total && dm->uring_head) {
+            uring_drain(streams);
+        }
+#endif
+        demux_end(streams, dm, total);
+    }
+}
+
+/*
+ * Extract the given range of bytes of each wanted stream, using the
+ * index written by tarmux to seek directly to the fragments covering
+ * the range. The rest of the archive is never read. An end of -1 means
+ * the end of each stream.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int index_demux(streams_t *streams, reader_t *r, FILE *index,
+        int64_t start, int64_t end)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int rv = 0;
+
+    while (!rv && (len = getline(&line, &line_size, index)) > 0) {
+        intmax_t offset, from, length, fragment, found;
+        const char *pathname;
+        demux_t *dm;
+        int64_t skip, count, tail, begin;
+        uint32_t sum;
+        int consumed = 0;
+        int next;
+
+        if (line[len - 1] == '\n') {
+            line[--len] = 0;
+        }
+
+        if (sscanf(line, "%jd %jd %jd %jd %n", &offset, &from, &length,
+                &fragment, &consumed) < 4 || !consumed) {
+            fprintf(stderr, "Error: Corrupt index line, aborting: %s\n", line);
+            rv = -1;
+            break;
+        }
+        pathname = line + consumed;
+
+        /* not in the range we want, bar the hole a sparse file ends on */
+        if (length ? from + length <= start || (end >= 0 && from >= end)
+                : from <= start) {
+            continue;
+        }
+
+        if (streams->sdemux) {
+            dm = streams->sdemux;
+            if (!dm->pathname) {
+                dm->pathname = strdup(pathname);
+                dm->len = strlen(pathname);
+            }
+            else if (strcmp(dm->pathname, pathname)) {
+                continue;
+            }
+        }
+        else if (!(dm = demux_lookup(streams, pathname, strlen(pathname)))) {
+            continue;
+        }
+
+        /* where tarmux skipped a hole in the source, leave one */
+        skip = (from > start ? from : start) - start;
+        if (end >= 0 && skip > end - start) {
+            skip = end - start;
+        }
+        if (demux_sparse(streams, dm, skip)) {
+            rv = -1;
+            break;
+        }
+        if (!length) {
+            continue;
+        }
+
+        if (lseek(r->fd, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Error: Could not seek archive: %s\n",
+                    strerror(errno));
+            rv = -1;
+            break;
+        }
+        r->offset = offset;
+
+        /* make sure the index and the archive agree */
+        begin = stats_clock(streams->stats);
+        next = reader_next(r);
+        stats_wait(streams->stats, begin, 0);
+        if (next != 1 || r->size != length
+                || ustar_pathlen(r->pathname, &found) != (int)strlen(pathname)
+                || strncmp(r->pathname, pathname, strlen(pathname))
+                || found != fragment) {
+            fprintf(stderr,
+                    "Error: Index does not match archive at offset %" PRIdMAX ", aborting.\n",
+                    offset);
+            rv = -1;
+            break;
+        }
+        if (r->codec) {
+            fprintf(stderr,
+                    "Error: Compressed fragments cannot be read through an index, aborting.\n");
+            rv = -1;
+            break;
+        }
+
+        skip = start > from ? start - from : 0;
+        count = (end >= 0 && from + length > end ? end - from : length) - skip;
+
+        /*
+         * A checksummed fragment is read whole, the parts outside the
+         * range included, so that it can be verified.
+         */
+        tail = r->crc >= 0 ? length - skip - count : 0;
+        if (r->crc < 0 && skip) {
+            if (lseek(r->fd, skip, SEEK_CUR) < 0) {
+                fprintf(stderr, "Error: Could not seek archive: %s\n",
+                        strerror(errno));
+                rv = -1;
+                break;
+            }
+            r->offset += skip;
+            skip = 0;
+        }
+
+        stats_fragment(dm->stats, count);
+
+        sum = 0;
+        while (skip || count || tail) {
+            int64_t want = skip ? skip : count ? count : tail;
+            ssize_t size;
+
+            begin = stats_clock(dm->stats);
+            size = reader_read(r, r->buffer,
+                    want > (int64_t)r->buffer_size ? r->buffer_size : want);
+            stats_read(dm->stats, begin, 1);
+            if (size <= 0) {
+                if (!size) {
+                    fprintf(stderr, "Error: Truncated tar stream, aborting.\n");
+                }
+                rv = -1;
+                break;
+            }
+            if (r->crc >= 0) {
+                sum = crc32c(sum, r->buffer, size);
+            }
+            if (skip) {
+                skip -= size;
+            }
+            else if (count) {
+                if (demux_write(dm, r->buffer, size)) {
+                    rv = -1;
+                    break;
+                }
+                dm->offset += size;
+                count -= size;
+            }
+            else {
+                tail -= size;
+            }
+        }
+
+        if (!rv) {
+            demux_verify(dm, r->crc, sum);
+        }
+    }
+
+    free(line);
+
+    return rv;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Read the fragments of one lane of a striped tar stream into memory,
+ * handing each to the writer in the order read.
+ *
+ * Fragments are read while the reorder buffer has room. Should the
+ * writer run dry with the buffer full, every waiting lane may read one
+ * fragment more, as the fragment the writer needs next is always at
+ * the head of one of the lanes.
+ */
+static void *lane_reader(void *arg)
+{
+    lane_t *lane = arg;
+    lanes_t *lanes = lane->lanes;
+    reader_t *r = &lane->reader;
+
+    for (;;) {
+        lane_fragment_t *frag;
+        unsigned int starved;
+        size_t padded;
+        int rv;
+
+        rv = reader_next(r);
+        if (rv == -2) {
+            fprintf(stderr,
+                    "Error: Lane is not a plain tar stream, aborting: %s\n",
+                    lane->name);
+            exit(1);
+        }
+        else if (rv < 0) {
+            exit(1);
+        }
+        else if (rv == 0) {
+            break;
+        }
+
+        /* the destinations are fixed when selecting, so look freely */
+        if (lanes->streams->select) {
+            intmax_t index;
+            size_t len = ustar_pathlen(r->pathname, &index);
+
+            if (!demux_lookup(lanes->streams, r->pathname, len)) {
+                if (reader_pass(r, r->size)) {
+                    exit(1);
+                }
+                continue;
+            }
+        }
+
+        padded = (r->size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+
+        pthread_mutex_lock(&lanes->lock);
+        starved = lanes->starved;
+        while (lanes->buffered && lanes->buffered + r->size > lanes->size
+                && !lanes->dry && starved == lanes->starved) {
+            pthread_cond_wait(&lanes->space, &lanes->lock);
+        }
+        lanes->buffered += r->size;
+        pthread_mutex_unlock(&lanes->lock);
+
+        frag = calloc(1, sizeof(lane_fragment_t));
+        if (!frag || !(frag->payload = malloc(padded ? padded : 1))) {
+            fprintf(stderr, "Could not allocate reorder buffer.\n");
+            exit(3);
+        }
+        if (reader_read(r, frag->payload, padded) != (ssize_t)padded) {
+            fprintf(stderr, "Error: Truncated tar stream, aborting: %s\n",
+                    lane->name);
+            exit(1);
+        }
+
+        frag->pathname = r->pathname;
+        r->pathname = NULL;
+        frag->size = r->size;
+        frag->original = r->original;
+        frag->crc = r->crc;
+        frag->sparse = r->sparse;
+        frag->stamped = r->stamped;
+        frag->codec = r->codec;
+
+        pthread_mutex_lock(&lanes->lock);
+        if (lanes->tail) {
+            lanes->tail->next = frag;
+        }
+        else {
+            lanes->head = frag;
+        }
+        lanes->tail = frag;
+        pthread_cond_signal(&lanes->ready);
+        pthread_mutex_unlock(&lanes->lock);
+    }
+
+    pthread_mutex_lock(&lanes->lock);
+    lanes->running--;
+    pthread_cond_signal(&lanes->ready);
+    pthread_mutex_unlock(&lanes->lock);
+
+    return NULL;
+}
+
+/*
+ * Write a fragment read from a lane to its destination, the fragments
+ * before it having been written already, and release its room in the
+ * reorder buffer.
+ */
+static void lanes_write(streams_t *streams, lanes_t *lanes,
+        lane_fragment_t *frag)
+{
+    demux_t *dm = demux_find(streams, frag->pathname);
+
+    if (demux_sparse(streams, dm, frag->sparse)) {
+        exit(1);
+    }
+
+    stats_arrival(dm->stats, frag->stamped);
+
+    if (frag->codec) {
+        demux_decompress(streams, dm, frag->codec, frag->payload, frag->size,
+                frag->original, frag->crc);
+    }
+    else {
+        demux_drain(streams);
+        demux_verify(dm, frag->crc, crc32c(0, frag->payload, frag->size));
+        if (demux_write(dm, frag->payload, frag->size)) {
+            exit(1);
+        }
+        demux_end(streams, dm, frag->size);
+        free(frag->payload);
+    }
+
+    pthread_mutex_lock(&lanes->lock);
+    lanes->buffered -= frag->size;
+    pthread_cond_broadcast(&lanes->space);
+    pthread_mutex_unlock(&lanes->lock);
+
+    free(frag->pathname);
+    free(frag);
+}
+
+/*
+ * Write a fragment read from a lane if the fragments of its stream
+ * before it have all been written, followed by any fragments held back
+ * that then follow on. Otherwise the fragment is held back until they
+ * have been.
+ */
+static void lanes_deliver(streams_t *streams, lanes_t *lanes,
+        lane_fragment_t *frag)
+{
+    while (frag) {
+        lane_fragment_t **held;
+        demux_t *dm;
+        intmax_t index;
+        size_t len;
+
+        len = ustar_pathlen(frag->pathname, &index);
+        dm = streams->sdemux ? streams->sdemux
+                : demux_lookup(streams, frag->pathname, len);
+
+        /* ahead of its stream, wait for the fragments before it */
+        if (dm && index > dm->index) {
+            frag->next = lanes->held;
+            lanes->held = frag;
+            return;
+        }
+
+        lanes_write(streams, lanes, frag);
+
+        /* the fragment that follows on may be waiting already */
+        for (held = &lanes->held; *held; held = &(*held)->next) {
+            len = ustar_pathlen((*held)->pathname, &index);
+            if (index == dm->index && dm->pathname && len == dm->len
+                    && !strncmp((*held)->pathname, dm->pathname, len)) {
+                break;
+            }
+        }
+        frag = *held;
+        if (frag) {
+            *held = frag->next;
+        }
+    }
+}
+
+/*
+ * Demultiplex a tar stream striped by tarmux across the given lanes,
+ * reading every lane at once on a thread of its own, and writing the
+ * fragments of each stream in order of their index, through a reorder
+ * buffer of up to size bytes.
+ *
+ * Returns 0 once every lane has reached its end of archive, or -1 if
+ * fragments are missing.
+ */
+static int lanes_demux(streams_t *streams, const char **filenames,
+        int count, size_t buffer_size, size_t size)
+{
+    lanes_t lanes = { 0 };
+    lane_t *lane;
+    int i;
+
+    lane = calloc(count, sizeof(lane_t));
+    if (!lane) {
+        fprintf(stderr, "Could not allocate lanes.\n");
+        exit(3);
+    }
+
+    pthread_mutex_init(&lanes.lock, NULL);
+    pthread_cond_init(&lanes.ready, NULL);
+    pthread_cond_init(&lanes.space, NULL);
+    lanes.streams = streams;
+    lanes.size = size;
+    lanes.running = count;
+
+    for (i = 0; i < count; i++) {
+        reader_t *r = &lane[i].reader;
+
+        lane[i].lanes = &lanes;
+        lane[i].name = filenames[i];
+
+        if ((r->fd = open(filenames[i], O_RDONLY)) < 0) {
+            perror(filenames[i]);
+            exit(1);
+        }
+        r->null_fd = -1;
+        r->buffer_size = buffer_size;
+        r->buffer = malloc(buffer_size);
+        if (!r->buffer) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&lane[i].thread, NULL, lane_reader, &lane[i])) {
+            fprintf(stderr, "Could not start lane thread.\n");
+            exit(3);
+        }
+    }
+
+    for (;;) {
+        int64_t start = stats_clock(streams->stats);
+        lane_fragment_t *frag;
+
+        pthread_mutex_lock(&lanes.lock);
+        while (!lanes.head && lanes.running) {
+            lanes.dry = 1;
+            lanes.starved++;
+            pthread_cond_broadcast(&lanes.space);
+            pthread_cond_wait(&lanes.ready, &lanes.lock);
+        }
+        lanes.dry = 0;
+        frag = lanes.head;
+        if (frag) {
+            lanes.head = frag->next;
+            if (!lanes.head) {
+                lanes.tail = NULL;
+            }
+            frag->next = NULL;
+        }
+        pthread_mutex_unlock(&lanes.lock);
+        stats_wait(streams->stats, start, 1);
+
+        if (!frag) {
+            break;
+        }
+
+        lanes_deliver(streams, &lanes, frag);
+    }
+
+    demux_drain(streams);
+
+    for (i = 0; i < count; i++) {
+        pthread_join(lane[i].thread, NULL);
+        close(lane[i].reader.fd);
+        free(lane[i].reader.pathname);
+        free(lane[i].reader.buffer);
+    }
+    free(lane);
+
+    pthread_cond_destroy(&lanes.space);
+    pthread_cond_destroy(&lanes.ready);
+    pthread_mutex_destroy(&lanes.lock);
+
+    if (lanes.held) {
+        fprintf(stderr,
+                "Error: Fragments missing from the lanes, aborting: %s\n",
+                lanes.held->pathname);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Decide how the tar stream may be read in large blocks, while leaving
+ * whatever follows the end of the archive for the next reader of the
+ * input.
+ *
+ * A seekable input is read ahead, and wound back once the end of the
+ * archive is known. A pipe is copied with tee() into a pipe of our own
+ * and read from there, and a socket is read with MSG_PEEK, in both
+ * cases consuming the input only as far as libarchive has consumed the
+ * archive. Any other input is read a record at a time, as tar streams
+ * end on a record boundary.
+ */
+static void reader_ahead(reader_t *r)
+{
+    struct stat st;
+
+    r->ahead = AHEAD_NONE;
+    r->blocksize = TAR_RECORD_SIZE;
+    r->null_fd = -1;
+
+    if (fstat(r->fd, &st)) {
+        return;
+    }
+
+    if ((S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+            && lseek(r->fd, 0, SEEK_CUR) >= 0) {
+        r->ahead = AHEAD_SEEK;
+        r->blocksize = r->buffer_size;
+    }
+#ifdef HAVE_SPLICE
+    else if (S_ISFIFO(st.st_mode) && !pipe(r->tee)) {
+        r->null_fd = open("/dev/null", O_WRONLY);
+        r->ahead = AHEAD_TEE;
+        r->window = AHEAD_WINDOW;
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+        {
+            int in, own;
+
+            /* the more each pipe holds, the more each tee() sees */
+            if (fcntl(r->fd, F_GETPIPE_SZ) < (int)r->buffer_size) {
+                fcntl(r->fd, F_SETPIPE_SZ, (int)r->buffer_size);
+            }
+            if (fcntl(r->tee[1], F_GETPIPE_SZ) < (int)r->buffer_size) {
+                fcntl(r->tee[1], F_SETPIPE_SZ, (int)r->buffer_size);
+            }
+
+            in = fcntl(r->fd, F_GETPIPE_SZ);
+            own = fcntl(r->tee[1], F_GETPIPE_SZ);
+            if (in > 0 && own > 0) {
+                r->window = in < own ? in : own;
+            }
+        }
+#endif
+    }
+#endif
+    else if (S_ISSOCK(st.st_mode)) {
+        int rcvbuf = 0;
+        socklen_t len = sizeof(rcvbuf);
+
+        r->ahead = AHEAD_PEEK;
+        r->window = AHEAD_WINDOW;
+        if (!getsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len)
+                && rcvbuf > 0) {
+            /* the kernel doubles what was asked for, for its own use */
+            r->window = rcvbuf / 2;
+        }
+    }
+
+    /* leave room for what libarchive has seen but not yet consumed */
+    if (r->ahead == AHEAD_TEE || r->ahead == AHEAD_PEEK) {
+        if (r->buffer_size < 2 * AHEAD_WINDOW) {
+            unsigned char *buffer = realloc(r->buffer, 2 * AHEAD_WINDOW);
+            if (buffer) {
+                r->buffer = buffer;
+                r->buffer_size = 2 * AHEAD_WINDOW;
+            }
+        }
+        r->blocksize = r->buffer_size / 2;
+        if (r->window > r->blocksize) {
+            r->window = r->blocksize;
+        }
+    }
 }
 
-void version()
+/*
+ * Consume len bytes of the input that have already been seen through
+ * tee() or MSG_PEEK, discarding them.
+ */
+static int reader_consume(reader_t *r, size_t len)
 {
-    printf(PACKAGE_STRING "\n");
+    while (len) {
+        ssize_t size;
+
+#ifdef HAVE_SPLICE
+        if (r->null_fd >= 0) {
+            size = splice(r->fd, NULL, r->null_fd, NULL, len, 0);
+            if (size < 0 && errno == EINVAL) {
+                /* no splice to /dev/null here, read instead */
+                close(r->null_fd);
+                r->null_fd = -1;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+            size = read(r->fd, r->buffer,
+                    len < r->buffer_size ? len : r->buffer_size);
+        }
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN) {
+                wait_fd(r->fd, POLLIN);
+                continue;
+            }
+            return -1;
+        }
+        else if (size == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        len -= size;
+        r->consumed += size;
+    }
+
+    return 0;
+}
+
+/*
+ * Look at the input without consuming it, through tee() into our own
+ * pipe, or with MSG_PEEK.
+ */
+static ssize_t reader_peek(reader_t *r, size_t len)
+{
+    ssize_t size;
+
+#ifdef HAVE_SPLICE
+    if (r->ahead == AHEAD_TEE) {
+        ssize_t offset;
+
+        size = tee(r->fd, r->tee[1], len, 0);
+
+        /* our own pipe holds all that was copied */
+        for (offset = 0; size > 0 && offset < size; ) {
+            ssize_t got = read(r->tee[0], r->buffer + offset, size - offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            else if (got <= 0) {
+                return -1;
+            }
+            offset += got;
+        }
+
+        return size;
+    }
+#endif
+
+    size = recv(r->fd, r->buffer, len, MSG_PEEK);
+
+    return size;
 }
 
 /*
- * Returns the length of the path, ignoring any trailing
- * numeric suffix following the last dot.
+ * Read the next block of the input, setting offset to where the data
+ * not yet handed to libarchive starts within the buffer.
  *
- * If the path does not contain a numeric suffix, the
- * length of the whole path is returned.
+ * A pipe or socket still holds what libarchive has seen but not yet
+ * consumed, which is looked at again and skipped. Should nothing new
+ * have arrived, we wait for more, or for the writer to go away. Should
+ * libarchive have looked further ahead than the pipe or socket can
+ * hold, such as while guessing the format, that data is consumed, as
+ * nothing more could arrive behind it.
  */
-static int pathlen(const char *pathname, intmax_t *index)
+static ssize_t reader_fetch(reader_t *r, size_t *offset)
 {
-    const char *slider;
+    size_t skip;
+    ssize_t size;
 
-    *index = 0;
+    *offset = 0;
 
-    slider = strrchr(pathname, '.');
+    if (r->ahead != AHEAD_TEE && r->ahead != AHEAD_PEEK) {
+        return read(r->fd, r->buffer, r->blocksize);
+    }
 
-    if (slider) {
-        int i, offset, valid = 1;
+    skip = r->fetched - r->consumed;
+    if (skip >= r->window) {
+        if (reader_consume(r, skip)) {
+            return -1;
+        }
+        skip = 0;
+    }
 
-        offset = slider - pathname;
+    for (;;) {
+        struct pollfd pfd;
 
-        i = offset + 1;
-        while (pathname[i]) {
-            if (!isdigit(pathname[i])) {
-                valid = 0;
-            }
-            else {
-                (*index) *= 10;
-                (*index) += (pathname[i] - '0');
-            }
-            i++;
+        size = reader_peek(r, skip + r->blocksize);
+        if (size < 0 || (size_t)size > skip) {
+            break;
         }
 
-        if (valid) {
-            return offset;
+        pfd.fd = r->fd;
+        pfd.events = POLLIN;
+        if (!size || poll(&pfd, 1, 0) < 0 || (pfd.revents & POLLHUP)) {
+            return 0;
         }
+        poll(NULL, 0, 1);
+    }
 
-        return i;
+    if (size > 0) {
+        *offset = skip;
+        size -= skip;
     }
 
-    return strlen(pathname);
+    return size;
 }
 
-ssize_t transfer(struct archive *a, demux_t *demux)
+/*
+ * Read callback handing the tar stream to libarchive, starting with
+ * any data already read while looking for a tar header.
+ *
+ * When looking ahead, the input is first consumed as far as libarchive
+ * has consumed the stream, so that what libarchive has only peeked at
+ * stays in the input should the archive end there.
+ */
+static la_ssize_t reader_archive_read(struct archive *a, void *client_data,
+        const void **buff)
 {
-    const void *buff;
-    size_t len;
-    off_t offset;
+    reader_t *r = client_data;
+    size_t offset;
     ssize_t size;
 
-    int rv;
-    ssize_t total = 0;
+    if (r->prefix) {
+        size = r->prefix;
+        r->prefix = 0;
+        r->fetched += size;
+        r->consumed += size;
+        *buff = r->tail = r->block;
+        r->tail_len = size;
+        return size;
+    }
 
-    for (;;) {
+    /* what the last archive read past its end, kept for this one */
+    if (r->carry_len) {
+        size = r->carry_len;
+        r->carry_len = 0;
+        r->fetched += size;
+        r->consumed += size;
+        *buff = r->tail = r->carry;
+        r->tail_len = size;
+        return size;
+    }
 
-        rv = archive_read_data_block(a, &buff, &len, &offset);
-        if (rv == ARCHIVE_FATAL) {
-            fprintf(stderr, "Error: while reading data block: %s\n", archive_error_string(a));
-            break;
+    if (r->ahead == AHEAD_TEE || r->ahead == AHEAD_PEEK) {
+        int64_t done = archive_filter_bytes(a, -1);
+
+        if (done > r->fetched) {
+            done = r->fetched;
         }
-        if (rv == ARCHIVE_WARN) {
-            fprintf(stderr, "Warning: while reading data block: %s\n", archive_error_string(a));
+        if (done > r->consumed && reader_consume(r, done - r->consumed)) {
+            archive_set_error(a, errno, "Could not read archive: %s",
+                    strerror(errno));
+            return -1;
         }
+    }
 
-        while (len) {
-            size = write(demux->fd, buff, len);
-            if (size < 0) {
-                fprintf(stderr, "Error: could not write data block to %s: %s\n",
-                        demux->pathname, strerror(errno));
-                break;
+    for (;;) {
+        size = reader_fetch(r, &offset);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            len -= size;
-            buff += size;
-            total += size;
-        };
-
-        if (rv == ARCHIVE_RETRY) {
-            fprintf(stderr, "Warning (Retry): while reading data block: %s\n", archive_error_string(a));
-            continue;
+            else if (errno == EAGAIN) {
+                wait_fd(r->fd, POLLIN);
+                continue;
+            }
+            archive_set_error(a, errno, "Could not read archive: %s",
+                    strerror(errno));
         }
-        if (rv == ARCHIVE_EOF) {
-            return total;
+        else {
+            r->fetched += size;
+            if (r->ahead != AHEAD_TEE && r->ahead != AHEAD_PEEK) {
+                r->consumed += size;
+            }
         }
+        *buff = r->tail = r->buffer + offset;
+        r->tail_len = size > 0 ? size : 0;
+        return size;
     }
+}
 
-    return -1;
+/*
+ * Leave the input just past the end of the archive, for the next
+ * reader of the input to pick up where we stopped.
+ *
+ * An uncompressed tar stream ends on the record boundary following
+ * the last data libarchive consumed, which may lie beyond what has
+ * been read so far. A compressed stream ends where the decompressor
+ * stopped consuming.
+ *
+ * When the next archive is to be read by us as well, whatever was read
+ * past the end that is still in the buffer is kept for it instead.
+ */
+static int reader_handoff(reader_t *r, struct archive *a)
+{
+    int64_t end;
+
+    if (archive_filter_count(a) > 1) {
+        end = archive_filter_bytes(a, -1);
+    }
+    else {
+        end = archive_filter_bytes(a, 0);
+        end = (end + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE * TAR_RECORD_SIZE;
+    }
+
+    if (r->keep && r->consumed == r->fetched && end <= r->fetched
+            && r->fetched - end <= (int64_t)r->tail_len) {
+        r->carry_len = r->fetched - end;
+        r->carry = r->tail + r->tail_len - r->carry_len;
+    }
+    else if (r->ahead == AHEAD_SEEK) {
+        if (end != r->consumed
+                && lseek(r->fd, end - r->consumed, SEEK_CUR) < 0) {
+            return -1;
+        }
+    }
+    else if (end > r->consumed && reader_consume(r, end - r->consumed)
+            && errno != EPIPE) {
+        /* an input cut short at the end is no concern of ours */
+        return -1;
+    }
+
+    /* a following archive counts from its own start */
+    r->fetched = r->consumed = 0;
+
+    return 0;
 }
 
 int main(int argc, char * const argv[])
@@ -166,24 +2978,36 @@ int main(int argc, char * const argv[])
 
     struct archive *a;
     struct archive_entry *entry;
-    demux_t *demux = NULL;
-    demux_t *sdemux = NULL;
+    streams_t streams = { 0 };
+    reader_t reader = { { 0 } };
 
     const char *name = argv[0];
     const char **filenames = NULL;
+    const char *policy = NULL;
+    const char *index_file = NULL;
+    const char *range = NULL;
+    const char *stats_file = NULL;
+    FILE *index = NULL;
 
-    size_t blocksize = 10240;
+    size_t buffer_size = 1024 * 1024;
     ssize_t total = 0;
+    int64_t range_start = 0;
+    int64_t range_end = -1;
+    int64_t stats_interval = 0;
+    size_t reorder = 64 * 1024 * 1024;
 
     int opt;
-    int all = 0;
+    int lanes = 0;
     int raw = 0;
+    int zerocopy = 0;
+    int uring = 0;
     int filenames_num = 0;
-    int rv;
-    int demux_count;
+    int rv = 0;
     int i;
 
-    while ((opt = getopt(argc, argv, "hvarf:n:-:")) != -1) {
+    streams.jobs = -1;
+
+    while ((opt = getopt(argc, argv, "hvamrzULsf:n:b:q:p:i:R:j:S:t:-:")) != -1) {
         switch (opt) {
         case '-':
             if (!strcmp(optarg, "help")) {
@@ -194,6 +3018,52 @@ int main(int argc, char * const argv[])
                 version();
                 exit(0);
             }
+            else if (!strcmp(optarg, "splice")) {
+                zerocopy = 1;
+            }
+            else if (!strcmp(optarg, "uring")) {
+                uring = 1;
+            }
+            else if (!strcmp(optarg, "multiple")) {
+                streams.multiple = 1;
+            }
+            else if (!strcmp(optarg, "lanes")) {
+                lanes = 1;
+            }
+            else if (!strcmp(optarg, "select")) {
+                streams.select = 1;
+            }
+            else if (!strncmp(optarg, "reorder=", 8)) {
+                reorder = strtoul(optarg + 8, NULL, 10);
+            }
+            else if (!strncmp(optarg, "template=", 9)) {
+                streams.template = optarg + 9;
+                streams.multiple = 1;
+            }
+            else if (!strncmp(optarg, "block=", 6)) {
+                buffer_size = strtoul(optarg + 6, NULL, 10);
+            }
+            else if (!strncmp(optarg, "queue=", 6)) {
+                streams.queue_size = strtoul(optarg + 6, NULL, 10);
+            }
+            else if (!strncmp(optarg, "policy=", 7)) {
+                policy = optarg + 7;
+            }
+            else if (!strncmp(optarg, "index=", 6)) {
+                index_file = optarg + 6;
+            }
+            else if (!strncmp(optarg, "range=", 6)) {
+                range = optarg + 6;
+            }
+            else if (!strncmp(optarg, "jobs=", 5)) {
+                streams.jobs = atoi(optarg + 5);
+            }
+            else if (!strncmp(optarg, "stats=", 6)) {
+                stats_file = optarg + 6;
+            }
+            else if (!strncmp(optarg, "stats-interval=", 15)) {
+                stats_interval = strtoll(optarg + 15, NULL, 10);
+            }
             break;
         case 'h':
             help(name);
@@ -202,11 +3072,51 @@ int main(int argc, char * const argv[])
             version();
             exit(0);
         case 'a':
-            all = 1;
+            streams.all = 1;
+            break;
+        case 'm':
+            streams.multiple = 1;
+            break;
+        case 't':
+            streams.template = optarg;
+            streams.multiple = 1;
             break;
         case 'r':
             raw = 1;
             break;
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'U':
+            uring = 1;
+            break;
+        case 'L':
+            lanes = 1;
+            break;
+        case 's':
+            streams.select = 1;
+            break;
+        case 'b':
+            buffer_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            streams.queue_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'i':
+            index_file = optarg;
+            break;
+        case 'R':
+            range = optarg;
+            break;
+        case 'j':
+            streams.jobs = atoi(optarg);
+            break;
+        case 'S':
+            stats_file = optarg;
+            break;
         case 'f':
             filenames = realloc(filenames,
                     (filenames_num + 2) * sizeof(const char *));
@@ -220,181 +3130,404 @@ int main(int argc, char * const argv[])
         }
     }
 
-    /* make sure we don't die on sigpipe */
-    signal(SIGPIPE, SIG_IGN);
+    if (!policy || !strcmp(policy, "block")) {
+        streams.policy = POLICY_BLOCK;
+    }
+    else if (!strcmp(policy, "spill")) {
+        streams.policy = POLICY_SPILL;
+    }
+    else if (!strcmp(policy, "drop")) {
+        streams.policy = POLICY_DROP;
+    }
+    else {
+        fprintf(stderr,
+                "Error: Policy must be one of 'block', 'spill' or 'drop', aborting.\n");
+        exit(1);
+    }
+#ifdef HAVE_PTHREAD_H
+    if (streams.jobs < 0) {
+        streams.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#endif
+    if (streams.jobs < 0) {
+        streams.jobs = 0;
+    }
+#ifndef HAVE_URING
+    if (uring) {
+        fprintf(stderr,
+                "Error: io_uring not supported on this platform, aborting.\n");
+        exit(2);
+    }
+#endif
+#ifndef HAVE_PTHREAD_H
+    if (streams.queue_size) {
+        fprintf(stderr,
+                "Error: Queues not supported on this platform, aborting.\n");
+        exit(2);
+    }
+#endif
 
-    /* remaining parameters are files to mux, otherwise default to stdin */
-    demux_count = argc - optind;
-    if (demux_count || all) {
-        demux = calloc(demux_count, sizeof(demux_t));
-        for (i = 0; i < demux_count; i++) {
+    if (index_file) {
+        if (raw || filenames_num > 1) {
+            fprintf(stderr,
+                    "Error: An index can only be used with a single tar stream, aborting.\n");
+            exit(1);
+        }
+        if (!(index = fopen(index_file, "r"))) {
+            perror(index_file);
+            exit(1);
+        }
+    }
+    if (range) {
+        char *end;
 
-            demux[i].pathname = strdup(argv[optind + i]);
+        range_start = strtoll(range, &end, 10);
+        if (*end == '-' && end[1]) {
+            range_end = strtoll(end + 1, &end, 10);
+        }
+        else if (*end == '-') {
+            end++;
+        }
+        if (*end || range_start < 0 || (range_end >= 0 && range_end < range_start)
+                || !index) {
+            fprintf(stderr,
+                    "Error: A range must be given as start-end, with an index, aborting.\n");
+            exit(1);
+        }
+    }
 
-            if ((demux[i].fd = open(demux[i].pathname,
-                    O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666)) < 0) {
-                perror(demux[i].pathname);
-                exit(2);
-            }
+    if (streams.multiple) {
+        if (streams.all || raw || index || filenames_num > 1) {
+            fprintf(stderr,
+                    "Error: Many tar streams can only be read from a single input, without -a, -r or -i, aborting.\n");
+            exit(1);
+        }
+        if (streams.template ? argc - optind || !strstr(streams.template, "%d")
+                : !(argc - optind)) {
+            fprintf(stderr,
+                    "Error: Many tar streams need either a file for each stream, or a template containing %%d, aborting.\n");
+            exit(1);
+        }
+#ifdef HAVE_PTHREAD_H
+        /* write out each stream while the next is read */
+        if (!streams.queue_size && !zerocopy && !uring) {
+            streams.queue_size = buffer_size;
+        }
+#endif
+    }
 
+    if (streams.select && (streams.all || streams.multiple || !(argc - optind))) {
+        fprintf(stderr,
+                "Error: Selecting streams needs the files/pipes to select, and cannot be used with -a or -m, aborting.\n");
+        exit(1);
+    }
+    if (lanes) {
+#ifndef HAVE_PTHREAD_H
+        fprintf(stderr,
+                "Error: Lanes not supported on this platform, aborting.\n");
+        exit(2);
+#endif
+        if (!filenames || raw || zerocopy || uring || index
+                || streams.multiple) {
+            fprintf(stderr,
+                    "Error: Lanes must be given with -f, and cannot be used with -r, -z, -U, -i or -m, aborting.\n");
+            exit(1);
         }
     }
-    else {
-        sdemux = calloc(1, sizeof(demux_t));
-        sdemux->fd = STDOUT_FILENO;
+
+    if (stats_interval < 0) {
+        fprintf(stderr, "Error: Statistics interval must be positive, aborting.\n");
+        exit(1);
+    }
+    if (buffer_size < TAR_RECORD_SIZE) {
+        fprintf(stderr, "Error: Block size must be at least %d bytes, aborting.\n",
+                TAR_RECORD_SIZE);
+        exit(1);
     }
 
-    /* set up the input archive */
-    a = archive_read_new();
-    archive_read_support_filter_all(a);
-    if (raw) {
-        archive_read_support_format_raw(a);
+    crc32c_init();
+
+    /* make sure we don't die on sigpipe */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* before any other thread, so SIGUSR1 is left to the statistics */
+    if (stats_file) {
+        streams.stats = stats_create("tardemux", stats_file, stats_interval);
+    }
+
+    /* remaining parameters are files to mux, otherwise default to stdin */
+    if (streams.multiple) {
+        streams.targets = argv + optind;
+        streams.target_count = argc - optind;
+        reader.keep = 1;
+    }
+    else if (argc - optind || streams.all) {
+        for (i = optind; i < argc; i++) {
+            demux_add(&streams, argv[i], strlen(argv[i]));
+        }
     }
     else {
-        archive_read_support_format_all(a);
+        streams.sdemux = calloc(1, sizeof(demux_t));
+        streams.sdemux->fd = STDOUT_FILENO;
+        streams.sdemux->stats = stats_source(streams.stats, "-");
     }
 
-    if (!filenames) {
-        archive_read_open_fd(a, STDIN_FILENO, blocksize);
+    /*
+     * parse plain tar streams ourselves, moving the data without copies,
+     * and passing over the streams not selected without reading them
+     */
+    reader.fd = -1;
+    reader.null_fd = -1;
+#ifdef HAVE_PTHREAD_H
+    if (lanes && lanes_demux(&streams, filenames, filenames_num, buffer_size,
+            reorder)) {
+        exit(1);
     }
-    else {
-        if ((rv = archive_read_open_filenames(a, filenames, blocksize))) {
-            fprintf(stderr, "Could not open archive(s): %s\n",
-                    archive_error_string(a));
+#endif
+    if ((zerocopy || uring || index || streams.select) && !raw && !lanes
+            && filenames_num <= 1) {
+
+        if (!filenames) {
+            reader.fd = STDIN_FILENO;
+        }
+        else if ((reader.fd = open(filenames[0], O_RDONLY)) < 0) {
+            perror(filenames[0]);
             exit(1);
         }
-    }
 
-    for (;;) {
-        intmax_t index;
+        reader.buffer_size = buffer_size;
+        reader.buffer = malloc(buffer_size);
+        if (!reader.buffer) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
 
-        rv = archive_read_next_header(a, &entry);
-        if (rv == ARCHIVE_FATAL) {
-            fprintf(stderr, "Error: while reading archive header: %s\n", archive_error_string(a));
-            exit(1);
+        /* with an index, seek straight to the fragments we want */
+        if (index) {
+            if (lseek(reader.fd, 0, SEEK_CUR) < 0) {
+                fprintf(stderr,
+                        "Error: The archive must be seekable to use an index, aborting.\n");
+                exit(1);
+            }
+            if (index_demux(&streams, &reader, index, range_start, range_end)) {
+                exit(1);
+            }
+            fclose(index);
         }
-        else if (rv == ARCHIVE_WARN) {
-            fprintf(stderr, "Warning: while reading archive header: %s\n", archive_error_string(a));
+        else {
+#ifdef HAVE_URING
+            if (uring) {
+                uring_start(&streams);
+            }
+#endif
+            /* each of many streams starts where the last one ended */
+            while (!(rv = splice_demux(&streams, &reader))
+                    && streams.multiple && multi_close(&streams)) {
+                reader.offset = 0;
+            }
+            if (rv == -1) {
+                exit(1);
+            }
+            /* nothing follows the last of many streams */
+            if (rv == -2 && streams.multiple && streams.multi_count
+                    && !reader.prefix) {
+                rv = 0;
+            }
+#ifdef HAVE_URING
+            uring_stop(&streams);
+#endif
         }
-        else if (rv == ARCHIVE_RETRY) {
-            fprintf(stderr, "Warning (Retry): while reading archive header: %s\n", archive_error_string(a));
-            continue;
+
+    }
+
+    /*
+     * otherwise fall back to libarchive, reading stdin, or the input of
+     * many streams, in large blocks
+     */
+    if ((!filenames || streams.multiple) && reader.fd < 0) {
+        if (!filenames) {
+            reader.fd = STDIN_FILENO;
         }
-        else if (rv == ARCHIVE_EOF) {
-            break;
+        else if ((reader.fd = open(filenames[0], O_RDONLY)) < 0) {
+            perror(filenames[0]);
+            exit(1);
         }
-        /* otherwise ARCHIVE_OK */
+        reader.buffer_size = buffer_size;
+        reader.buffer = malloc(buffer_size);
+        if (!reader.buffer) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+        rv = -2;
+    }
+    if (!lanes && (reader.fd < 0 || rv == -2)) {
 
-        /* handle demux to stdout */
-        if (sdemux) {
-            const char *pathname = archive_entry_pathname(entry);
-            if (!sdemux->pathname) {
-                sdemux->pathname = strndup(pathname, pathlen(pathname, &index));
-                if (index) {
-                    fprintf(stderr,
-                            "Error: First stream index is non-zero (%" PRIdMAX "), not at the start of the stream, aborting: %s\n",
-                            index, archive_entry_pathname(entry));
-                    exit(4);
-                }
-                total = transfer(a, sdemux);
-                if (total < 0) {
-                    exit(1);
-                }
-                else if (total == 0) {
-                    break;
-                }
+        if (reader.fd >= 0) {
+            reader_ahead(&reader);
+        }
+
+        /* each of many streams is an archive of its own, read in turn */
+        do {
+            a = archive_read_new();
+            archive_read_support_filter_all(a);
+            if (raw) {
+                archive_read_support_format_raw(a);
             }
-            else if (!strncmp(sdemux->pathname, pathname, pathlen(pathname, &index))) {
-                total = transfer(a, sdemux);
-                if (total < 0) {
+            else {
+                archive_read_support_format_all(a);
+            }
+
+            if (reader.fd >= 0) {
+                if ((rv = archive_read_open(a, &reader, NULL, reader_archive_read,
+                        NULL))) {
+                    fprintf(stderr, "Could not open archive(s): %s\n",
+                            archive_error_string(a));
                     exit(1);
                 }
-                else if (total == 0) {
-                    break;
-                }
             }
             else {
-                fprintf(stderr,
-                        "Error: Unexpected additional path in stream, aborting: %s\n",
-                        archive_entry_pathname(entry));
-                exit(1);
+                if ((rv = archive_read_open_filenames(a, filenames, buffer_size))) {
+                    fprintf(stderr, "Could not open archive(s): %s\n",
+                            archive_error_string(a));
+                    exit(1);
+                }
             }
-        }
 
-        /* handle demux to individual files */
-        else {
-            demux_t *dm = NULL;
-            int found = 0;
-            for (i = 0; i < demux_count; i++) {
-                const char *pathname = archive_entry_pathname(entry);
-
-                if (!strncmp(demux[i].pathname, pathname, pathlen(pathname, &index))) {
-                    dm = &demux[i];
-                    found = 1;
+            for (;;) {
+                int64_t start = stats_clock(streams.stats);
+                demux_t *dm;
+                int64_t size;
+                int64_t crc;
+                int64_t sparse;
+                int64_t stamped;
+                int codec;
+
+                rv = archive_read_next_header(a, &entry);
+                stats_wait(streams.stats, start, 0);
+                if (rv == ARCHIVE_FATAL) {
+                    fprintf(stderr, "Error: while reading archive header: %s\n", archive_error_string(a));
+                    exit(1);
+                }
+                else if (rv == ARCHIVE_WARN) {
+                    fprintf(stderr, "Warning: while reading archive header: %s\n", archive_error_string(a));
+                }
+                else if (rv == ARCHIVE_RETRY) {
+                    fprintf(stderr, "Warning (Retry): while reading archive header: %s\n", archive_error_string(a));
+                    continue;
+                }
+                else if (rv == ARCHIVE_EOF) {
+                    demux_drain(&streams);
+                    if (reader.fd >= 0 && reader_handoff(&reader, a)) {
+                        fprintf(stderr, "Error: while leaving the archive: %s\n",
+                                strerror(errno));
+                        exit(1);
+                    }
                     break;
                 }
+                /* otherwise ARCHIVE_OK */
 
-            }
-            if (!found) {
-                if (all) {
-                    demux = realloc(demux, (demux_count + 1) * sizeof(demux_t));
+                dm = demux_find(&streams, archive_entry_pathname(entry));
+                if (!dm) {
+                    if (archive_read_data_skip(a) == ARCHIVE_FATAL) {
+                        fprintf(stderr, "Error: while skipping archive data: %s\n",
+                                archive_error_string(a));
+                        exit(1);
+                    }
+                    continue;
+                }
 
-                    demux[demux_count].pathname = strdup(
-                            archive_entry_pathname(entry));
+                codec = entry_attrs(entry, &size, &crc, &sparse, &stamped);
 
-                    if ((demux[demux_count].fd = open(
-                            demux[demux_count].pathname,
-                            O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666))
-                            < 0) {
-                        perror(demux[demux_count].pathname);
-                        exit(2);
-                    }
+                if (demux_sparse(&streams, dm, sparse)) {
+                    exit(1);
+                }
 
-                    dm = &demux[demux_count];
+                stats_arrival(dm->stats, stamped);
 
-                    demux_count++;
+                if (codec) {
+                    unsigned char *packed;
+                    size_t len;
 
+                    start = stats_clock(dm->stats);
+                    if (!(packed = transfer_packed(a, entry, &len))) {
+                        exit(1);
+                    }
+                    stats_read(dm->stats, start, 1);
+                    demux_decompress(&streams, dm, codec, packed, len, size, crc);
+                    continue;
                 }
-                else {
-                    fprintf(stderr,
-                            "Error: Unnamed path in stream, aborting: %s\n",
-                            archive_entry_pathname(entry));
-                    exit(1);
-                }
-            }
-            if (dm) {
-                total = transfer(a, dm);
+                demux_drain(&streams);
+
+                total = transfer(a, dm, crc);
                 if (total < 0) {
                     exit(1);
                 }
-                else if (total == 0) {
-                    if (close(dm->fd)) {
-                        fprintf(stderr, "Error: Could not close %s: %s\n",
-                                dm->pathname, strerror(errno));
-                        exit(1);
-                    }
-                    dm->fd = 0;
-                    break;
-                }
+
+                demux_end(&streams, dm, total);
+
             }
+
+            archive_read_free(a);
+        } while (streams.multiple && multi_close(&streams));
+
+    }
+
+    /* clean up the input */
+    if (reader.fd >= 0) {
+        if (filenames) {
+            close(reader.fd);
         }
+        if (reader.ahead == AHEAD_TEE) {
+            close(reader.tee[0]);
+            close(reader.tee[1]);
+        }
+        if (reader.null_fd >= 0) {
+            close(reader.null_fd);
+        }
+        free(reader.pathname);
+        free(reader.buffer);
+    }
 
+    if (streams.pool) {
+        pool_destroy(streams.pool);
     }
 
     /* clean up the output files */
-    if (demux) {
-        for (i = 0; i < demux_count; i++) {
-            if (demux[i].fd) {
-                close(demux[i].fd);
+    if (streams.demux) {
+        for (i = 0; i < streams.demux_count; i++) {
+#ifdef HAVE_PTHREAD_H
+            if (streams.demux[i].queue) {
+                queue_finish(&streams.demux[i]);
+            }
+#endif
+            if (streams.demux[i].fd >= 0) {
+                close(streams.demux[i].fd);
             }
-            free(demux[i].pathname);
+            free(streams.demux[i].pathname);
         }
-        free(demux);
+        free(streams.demux);
+        free(streams.table);
     }
-    if (sdemux) {
-        free(sdemux->pathname);
-        free(sdemux);
+    if (streams.sdemux && !streams.multiple) {
+        free(streams.sdemux->pathname);
+        free(streams.sdemux);
     }
+    for (i = 0; i < streams.multi_count; i++) {
+#ifdef HAVE_PTHREAD_H
+        if (streams.multi[i]->queue) {
+            queue_finish(streams.multi[i]);
+        }
+#endif
+        if (streams.multi[i]->fd >= 0) {
+            close(streams.multi[i]->fd);
+        }
+        free(streams.multi[i]->pathname);
+        free(streams.multi[i]->target);
+        free(streams.multi[i]);
+    }
+    free(streams.multi);
+
+    stats_finish(streams.stats);
 
     exit(0);
 }
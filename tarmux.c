@@ -15,23 +15,54 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <getopt.h>
 #include <poll.h>
+#include <search.h>
 #include <time.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
 #include "config.h"
+#include "arena.h"
+#include "codec.h"
+#include "control.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "pool.h"
+#include "sparse.h"
+#include "uring.h"
+#include "ustar.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #ifndef HAVE_CLOCK_GETTIME
 /* clock_gettime is not implemented on MacOSX */
@@ -49,18 +80,192 @@ int clock_gettime(int clk_id, struct timespec *t)
 }
 #endif
 
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+#define EPOLL_EVENTS 256
+
+static const unsigned char zeros[TAR_RECORD_SIZE];
+
+typedef enum copy_e
+{
+    COPY_UNKNOWN = 0,
+    COPY_RW,
+    COPY_SENDFILE,
+    COPY_FILE_RANGE
+} copy_e;
+
+typedef struct fragment_t
+{
+    unsigned char *buffer;
+    ssize_t len;
+    int64_t captured;
+} fragment_t;
+
+struct threads_t;
+
+/*
+ * A pathname read while attaching, given on the command line or added
+ * over the control channel, and where its fragments left off, so that
+ * a source added again under the same name follows on from the last
+ * rather than starting again at index zero.
+ */
+typedef struct attach_source_t
+{
+    int64_t index;
+    int64_t written;
+    int active;
+    char pathname[];
+} attach_source_t;
+
 typedef struct mux_t
 {
     struct archive_entry *entry;
+    stats_source_t *stats;
     const char *pathname;
     int64_t index;
+    int64_t deficit;
+    int64_t written;
+    char *name;
+    size_t base;
+    int digits;
+    unsigned int digit_sum;
+    unsigned char *template;
+    unsigned int template_sum;
+    int no_template;
+    unsigned char *pending;
+    size_t pending_size;
+    size_t fill;
+    size_t held;
+    int64_t since;
+    int64_t captured;
+    struct mux_t *ready_next;
+    struct mux_t *linger_next;
+    struct mux_t *linger_prev;
+    attach_source_t *attach_source;
+    int weight;
     int fd;
+    int splice;
+    int file;
+    int nonblock;
+    int drained;
+    int ready;
+    int parked;
+    int attached;
+    int detached;
+#ifdef HAVE_PTHREAD_H
+    struct threads_t *threads;
+    pthread_t thread;
+    pthread_cond_t space;
+    fragment_t *ring;
+    int ring_head;
+    int ring_count;
+#endif
+#ifdef HAVE_URING
+    unsigned char *uring_buffer;
+    size_t uring_got;
+    size_t uring_size;
+    int uring_busy;
+    int uring_reading;
+    int uring_eof;
+#endif
 } mux_t;
 
+typedef struct sched_t
+{
+    arena_t *arena;
+    size_t quantum;
+    size_t coalesce;
+    size_t cap;
+    size_t file;
+    int64_t latency;
+    int64_t linger;
+    double rate;
+    /* the sources holding coalesced data, oldest and so first due first */
+    mux_t *linger_head;
+    mux_t *linger_tail;
+} sched_t;
+
+#ifdef HAVE_PTHREAD_H
+typedef struct threads_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    sched_t *sched;
+    size_t buffer_size;
+    int depth;
+    int timestamp;
+} threads_t;
+#endif
+
+typedef struct lane_t
+{
+    const char *name;
+    int64_t offset;
+    int fd;
+    int pipe;
+    int socket;
+    copy_e copy;
+} lane_t;
+
+typedef struct out_t
+{
+    struct archive *a;
+    unsigned char *header;
+    size_t header_size;
+    char *records;
+    size_t records_size;
+    FILE *index;
+    pool_t *pool;
+    stats_t *stats;
+    lane_t *lanes;
+    struct pollfd *lane_poll;
+    int64_t base;
+    int64_t offset;
+    int64_t payload;
+    int64_t fragments;
+    int fd;
+    int pipe;
+    int socket;
+    int direct;
+    int raw;
+    int checksum;
+    int sparse;
+    int timestamp;
+    codec_e codec;
+    copy_e copy;
+    int level;
+    int lane;
+    int lane_count;
+} out_t;
+
+typedef struct attach_t
+{
+    control_t *control;
+    void *sources;
+    int zerocopy;
+    int files;
+} attach_t;
+
+typedef struct job_t
+{
+    out_t *out;
+    mux_t *mux;
+    unsigned char *buffer;
+    unsigned char *packed;
+    size_t len;
+    ssize_t packed_len;
+    int64_t captured;
+} job_t;
+
 void help(const char *name)
 {
     printf(
-            "Usage: %s [-r] [-f streamname] [-n sourcename] [file1] [file2] [...]\n"
+            "Usage: %s [-r] [-z] [-H] [-e] [-U] [-t depth] [-q quantum] [-w weights]\n"
+                    "       [-l ms] [-c bytes] [-L ms] [-b bytes] [-M bytes] [-F bytes] [-s]\n"
+                    "       [-i indexname] [-C codec[:level]] [-j jobs] [-k] [-T] [-S statsname]\n"
+                    "       [-A path] [-f streamname] [-n sourcename] [file1] [file2] [...]\n"
                     "\n"
                     "This tool multiplexes streams such that they may be combined on one\n"
                     "system and then split apart on another. It does so by wrapping each\n"
@@ -81,8 +286,122 @@ void help(const char *name)
                     "\n"
                     "  -f name, --file=name\t\tThe name of the output file to which tar\n"
                     "\t\t\t\tstreams will be appended, defaults to stdout.\n"
+                    "\t\t\t\tGiven more than once, fragments are striped\n"
+                    "\t\t\t\tacross the files as lanes, each a tar stream of\n"
+                    "\t\t\t\tits own, the lane that can take more going first.\n"
+                    "\t\t\t\tRead them back with tardemux -L.\n"
                     "  -n pathname, --name=pathname\tThe pathname to embed in the tar\n"
                     "\t\t\t\tfiles when the input is stdin. Defaults to '-'.\n"
+                    "  -z, --splice\t\t\tWrite the tar headers directly and move data\n"
+                    "\t\t\t\tfrom pipes and sockets to the output using splice(),\n"
+                    "\t\t\t\twithout copying it. Falls back to normal operation\n"
+                    "\t\t\t\tif the output is not a pipe or socket. As with -H,\n"
+                    "\t\t\t\t-U, -F and -s, the stream is not written in whole\n"
+                    "\t\t\t\trecords, so streams that follow one another on a\n"
+                    "\t\t\t\tpipe need a tardemux that reads exactly to the end\n"
+                    "\t\t\t\tof each, as the tardemux of this release does.\n"
+                    "  -H, --fast-header\t\tWrite the tar headers directly to any\n"
+                    "\t\t\t\toutput, patching a template header for each\n"
+                    "\t\t\t\tfragment rather than building it from scratch.\n"
+                    "  -e, --epoll\t\t\tWait for sources with edge triggered epoll,\n"
+                    "\t\t\t\ttouching only the sources with data waiting. Suits\n"
+                    "\t\t\t\tthousands of sources.\n"
+                    "  -U, --uring\t\t\tRead the sources and write the output\n"
+                    "\t\t\t\tthrough io_uring, submitting the reads of all\n"
+                    "\t\t\t\tsources and a batched write of everything read\n"
+                    "\t\t\t\tin one system call. Headers are written directly\n"
+                    "\t\t\t\tas with -H. Falls back to normal operation if the\n"
+                    "\t\t\t\tkernel does not support io_uring.\n"
+                    "  -t depth, --threads=depth\tRead each source on its own thread,\n"
+                    "\t\t\t\tbuffering up to depth fragments per source while\n"
+                    "\t\t\t\tthe output is busy.\n"
+                    "  -q bytes, --quantum=bytes\tThe number of bytes each source may\n"
+                    "\t\t\t\tsend per round, multiplied by its weight. Defaults\n"
+                    "\t\t\t\tto the buffer size.\n"
+                    "  -w list, --weights=list\tComma separated weights of each file\n"
+                    "\t\t\t\tin order, defaults to 1 for each file.\n"
+                    "  -l ms, --latency=ms\t\tThe maximum time a ready source should\n"
+                    "\t\t\t\twait for its next fragment under load, limiting the\n"
+                    "\t\t\t\tsize of fragments from busy sources to suit the\n"
+                    "\t\t\t\tmeasured speed of the output.\n"
+                    "  -c bytes, --coalesce=bytes\tGather the data from each source\n"
+                    "\t\t\t\tinto fragments of at least this size, reducing the\n"
+                    "\t\t\t\theader overhead of sources that trickle. Data is\n"
+                    "\t\t\t\tcopied through userspace when coalescing. The\n"
+                    "\t\t\t\theader to payload ratio is reported on exit.\n"
+                    "  -L ms, --linger=ms\t\tThe longest time data may wait to be\n"
+                    "\t\t\t\tcoalesced before it is written. Defaults to 50ms.\n"
+                    "  -b bytes, --buffer=bytes\tThe largest fragment read from a\n"
+                    "\t\t\t\tsource at a time, defaults to 1MB.\n"
+                    "  -M bytes, --memory=bytes\tThe memory shared by the sources for\n"
+                    "\t\t\t\tfragments waiting to be written, when reading on\n"
+                    "\t\t\t\tthreads, through io_uring, or coalescing. Sources\n"
+                    "\t\t\t\ttake smaller buffers as memory runs short, and\n"
+                    "\t\t\t\tare not read once it is spent. Defaults to 64MB,\n"
+                    "\t\t\t\tand to at least the buffer size.\n"
+                    "  --source-memory=bytes\t\tThe most memory one source may hold,\n"
+                    "\t\t\t\tin powers of two, so that busy sources leave\n"
+                    "\t\t\t\tmemory for the others. Defaults to no limit.\n"
+                    "  --hugepages\t\t\tBack the shared memory with huge pages,\n"
+                    "\t\t\t\tfalling back to transparent huge pages.\n"
+                    "  -F bytes, --file-fragment=bytes\n"
+                    "\t\t\t\tThe largest fragment of a regular file source, 0\n"
+                    "\t\t\t\tfor the whole file in one fragment. The headers are\n"
+                    "\t\t\t\twritten directly as with -H, and the payload of a\n"
+                    "\t\t\t\tregular file, of known size, is moved straight to\n"
+                    "\t\t\t\tthe output with copy_file_range() or sendfile().\n"
+                    "\t\t\t\tA larger fragment than the file has earned is paid\n"
+                    "\t\t\t\tfor by sitting out the rounds that follow, so other\n"
+                    "\t\t\t\tsources keep their share. Regular files are moved\n"
+                    "\t\t\t\tthe same way with -z and -H, in fragments of the\n"
+                    "\t\t\t\tbuffer size.\n"
+                    "  -s, --sparse\t\t\tSkip the holes in regular file sources, as\n"
+                    "\t\t\t\tfound with SEEK_DATA and SEEK_HOLE, recording\n"
+                    "\t\t\t\twhere the data picks up again so that tardemux\n"
+                    "\t\t\t\tcan leave the same holes. Regular files are moved\n"
+                    "\t\t\t\tas with -F.\n"
+                    "  -i name, --index=name\t\tAppend an index of the fragments written\n"
+                    "\t\t\t\tto the named file, one line per fragment giving\n"
+                    "\t\t\t\tthe offset of the fragment in the tar stream, the\n"
+                    "\t\t\t\toffset and length of the data within the source,\n"
+                    "\t\t\t\tthe fragment index and the source pathname. Used\n"
+                    "\t\t\t\tby tardemux to extract a range of a source.\n"
+                    "  -C codec[:level], --compress=codec[:level]\n"
+                    "\t\t\t\tCompress the payload of each fragment with the\n"
+                    "\t\t\t\tgiven codec, 'zstd' or 'lz4', where built in.\n"
+                    "\t\t\t\tFragments are compressed independently and in\n"
+                    "\t\t\t\tparallel, and written in order. Fragments that\n"
+                    "\t\t\t\tdo not shrink are stored as is.\n"
+                    "  -j jobs, --jobs=jobs\t\tThe number of threads compressing\n"
+                    "\t\t\t\tfragments, defaults to the number of CPUs.\n"
+                    "  -k, --checksum\t\tRecord a CRC32C of the payload of each\n"
+                    "\t\t\t\tfragment, verified by tardemux. Data is read\n"
+                    "\t\t\t\tthrough userspace when checksumming.\n"
+                    "  -T, --timestamp\t\tStamp each fragment with the time it\n"
+                    "\t\t\t\twas read, to the nanosecond, from which tardemux\n"
+                    "\t\t\t\tkeeps latency statistics.\n"
+                    "  -S name, --stats=name\t\tKeep statistics of the bytes and\n"
+                    "\t\t\t\tfragments written per source, the fragment sizes,\n"
+                    "\t\t\t\tand the time spent waiting to read and write,\n"
+                    "\t\t\t\twritten as JSON to the named file, or to stderr\n"
+                    "\t\t\t\tif '-', on SIGUSR1 and on exit.\n"
+                    "  --stats-interval=ms\t\tAlso write the statistics every\n"
+                    "\t\t\t\tinterval.\n"
+                    "  -A path, --attach=path\tAdd and remove sources while running,\n"
+                    "\t\t\t\ttaking commands from the FIFO at path, or else from\n"
+                    "\t\t\t\ta UNIX datagram socket created there, one command\n"
+                    "\t\t\t\tper line or datagram. 'add pathname' adds a source\n"
+                    "\t\t\t\tread from the descriptor passed with the datagram,\n"
+                    "\t\t\t\tor else by opening the pathname, and embedded\n"
+                    "\t\t\t\tunder the pathname with its fragments counted\n"
+                    "\t\t\t\tfrom zero, or on from where they left off if the\n"
+                    "\t\t\t\tpathname was added before and has since ended.\n"
+                    "\t\t\t\t'remove pathname' closes the source as\n"
+                    "\t\t\t\tif it had ended. 'finish' stops listening, and\n"
+                    "\t\t\t\ttarmux exits once the sources left have ended.\n"
+                    "\t\t\t\tNot available with threads or io_uring.\n"
+                    "  --max-sources=n\t\tThe most sources open at once when\n"
+                    "\t\t\t\tattaching, defaults to 1024.\n"
                     "  [file1] [...]\t\t\tOptional files/pipes whose content will be included in\n"
                     "\t\t\t\tthe tar stream. Regardless of the type of source, data is\n"
                     "\t\t\t\tembedded as a regular file in the tar stream.\n"
@@ -97,285 +416,3366 @@ void version()
     printf(PACKAGE_STRING "\n");
 }
 
-static void entry_pathindex(mux_t *mux)
+/*
+ * Advance the name of the source to that of the next fragment, by
+ * counting up the decimal index suffix in place, rather than formatting
+ * the whole name for each fragment.
+ */
+static void mux_suffix(mux_t *mux)
 {
-    char *name;
-
-    name = malloc(
-            (snprintf(NULL, 0, "%s.%" PRId64 "", mux->pathname, mux->index) + 1)
-                    * sizeof(char));
-    sprintf(name, "%s.%" PRId64 "", mux->pathname, mux->index);
+    char *digit;
 
-    archive_entry_copy_pathname(mux->entry, name);
+    if (!mux->name) {
+        size_t len = strlen(mux->pathname);
 
-    free(name);
+        mux->name = malloc(len + 22);
+        if (!mux->name) {
+            fprintf(stderr, "Could not allocate name.\n");
+            exit(3);
+        }
+        memcpy(mux->name, mux->pathname, len);
+        mux->base = len + 1;
+        mux->digits = snprintf(mux->name + len, 22, ".%" PRId64, mux->index) - 1;
+        mux->digit_sum = 0;
+        for (digit = mux->name + mux->base; *digit; digit++) {
+            mux->digit_sum += *digit;
+        }
+    }
+    else {
+        for (digit = mux->name + mux->base + mux->digits - 1; ; digit--) {
+            if (*digit != '9') {
+                (*digit)++;
+                mux->digit_sum++;
+                break;
+            }
+            *digit = '0';
+            mux->digit_sum -= 9;
+            if (digit == mux->name + mux->base) {
+                /* all nines, grow by a digit */
+                *digit = '1';
+                mux->name[mux->base + mux->digits++] = '0';
+                mux->name[mux->base + mux->digits] = 0;
+                mux->digit_sum += 1 + '0';
+                break;
+            }
+        }
+    }
 
     mux->index++;
-
 }
 
-int main(int argc, char * const argv[])
+static void entry_pathindex(mux_t *mux)
 {
+    mux_suffix(mux);
 
-    struct archive *a;
-    mux_t *mux;
-    struct pollfd *fds;
-
-    const char *name = argv[0];
-    const char *out_file = "-";
-    const char *stdin_name = "-";
-    unsigned char *buffer;
+    archive_entry_copy_pathname(mux->entry, mux->name);
+}
 
-    size_t buffer_size = 1024 * 1024;
+/*
+ * Release a source that has reached end of file.
+ */
+static void mux_close(mux_t *mux)
+{
+    archive_entry_free(mux->entry);
+    close(mux->fd);
 
-    int out_fd = STDOUT_FILENO;
-    int opt;
-    int mux_count;
-    int i;
-    int remaining;
-    int raw = 0;
-    int rv;
+    free(mux->name);
+    free(mux->template);
 
-    while ((opt = getopt(argc, argv, "hvrf:n:-:")) != -1) {
-        switch (opt) {
-        case '-':
-            if (!strcmp(optarg, "help")) {
-                help(name);
-                exit(0);
-            }
-            else if (!strcmp(optarg, "version")) {
-                version();
-                exit(0);
-            }
-            else if (!strcmp(optarg, "name")) {
-                stdin_name = optarg;
-                exit(0);
-            }
-            break;
-        case 'h':
-            help(name);
-            exit(0);
-        case 'v':
-            version();
-            exit(0);
-        case 'r':
-            raw = 1;
-            break;
-        case 'f':
-            out_file = optarg;
-            break;
-        case 'n':
-            stdin_name = optarg;
-            break;
-        default:
-            help(name);
-            exit(1);
-        }
+    if (mux->attach_source) {
+        mux->attach_source->index = mux->index;
+        mux->attach_source->written = mux->written;
+        mux->attach_source->active = 0;
     }
 
-    /* make sure we don't die on sigpipe */
-    signal(SIGPIPE, SIG_IGN);
+    /* the slot may be taken by a source attached later */
+    mux->entry = NULL;
+    mux->detached = 0;
+}
 
-    /* make sure our tar stream is open for append */
-    if (strcmp(out_file, "-")) {
-        if ((out_fd = open(out_file, O_WRONLY | O_CREAT | O_APPEND, 0666))
-                < 0) {
-            perror(out_file);
-            exit(1);
-        }
+/*
+ * Set up a source embedded under the given pathname, reading from the
+ * given descriptor, or opening the pathname if the descriptor is -1.
+ *
+ * Returns 0 on success, or -1 with errno set, in which case the
+ * descriptor has been closed.
+ */
+static int mux_open(mux_t *mux, const char *pathname, int fd, out_t *out,
+        int zerocopy, int files)
+{
+    struct stat st;
+
+    if (fd < 0 && (fd = open(pathname, O_RDONLY | O_NONBLOCK)) < 0) {
+        return -1;
     }
 
-    /* set up the output tar archive */
-    a = archive_write_new();
+    if (fstat(fd, &st)) {
+        int err = errno;
 
-    if (raw) {
-#ifdef HAVE_ARCHIVE_WRITE_SET_FORMAT_RAW
-        archive_write_set_format_raw(a);
-#else
-        fprintf(stderr,
-                "Error: Raw mode not supported on this platform, aborting.\n");
-        exit(2);
-#endif
-    }
-    else {
-        archive_write_set_format_pax_restricted(a);
+        close(fd);
+        errno = err;
+        return -1;
     }
 
-    archive_write_open_fd(a, out_fd);
+    mux->entry = archive_entry_new();
+    mux->pathname = pathname;
+    mux->fd = fd;
 
-    /* remaining parameters are files to mux, otherwise default to stdin */
-    mux_count = argc - optind;
-    mux = calloc(mux_count > 0 ? mux_count : 1, sizeof(mux_t));
-    fds = calloc(mux_count > 0 ? mux_count : 1, sizeof(struct pollfd));
-    for (i = 0; i < mux_count; i++) {
-        struct stat st;
+    archive_entry_copy_sourcepath(mux->entry, pathname);
+    archive_entry_copy_stat(mux->entry, &st);
+    archive_entry_set_filetype(mux->entry, AE_IFREG);
 
-        mux[i].entry = archive_entry_new();
-        mux[i].pathname = argv[optind + i];
+    mux->splice = zerocopy && !out->codec && !out->checksum
+            && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+            && (out->pipe || S_ISFIFO(st.st_mode));
+    mux->file = files && S_ISREG(st.st_mode);
 
-        archive_entry_set_filetype(mux[i].entry, AE_IFREG);
-        archive_entry_copy_sourcepath(mux[i].entry, argv[optind + i]);
+    return 0;
+}
 
-        if ((mux[i].fd = open(archive_entry_sourcepath(mux[i].entry),
-                O_RDONLY | O_NONBLOCK)) < 0) {
-            perror(archive_entry_sourcepath(mux[i].entry));
-            exit(2);
+/*
+ * Append the pax records for the extended attributes of the given entry
+ * to the given buffer, returning their length.
+ *
+ * As libarchive does, each attribute is given twice, base64 encoded as
+ * LIBARCHIVE.xattr, and as is as SCHILY.xattr. Only the short text
+ * attributes set by tarmux itself are expected here.
+ */
+static size_t pax_xattrs(char *buf, struct archive_entry *entry)
+{
+    static const char base64[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const char *name;
+    const void *value;
+    size_t size, len = 0;
+
+    archive_entry_xattr_reset(entry);
+    while (archive_entry_xattr_next(entry, &name, &value, &size)
+            == ARCHIVE_OK) {
+        const unsigned char *v = value;
+        char key[128], text[128], encoded[176];
+        size_t i, j = 0;
+
+        if (size >= sizeof(text)) {
+            size = sizeof(text) - 1;
         }
+        memcpy(text, value, size);
+        text[size] = 0;
 
-        if ((rv = fstat(mux[i].fd, &st))) {
-            perror(mux[i].pathname);
-            exit(1);
-        }
-        archive_entry_copy_stat(mux[i].entry, &st);
+        /* base64 without padding, as libarchive writes it */
+        for (i = 0; i < size; i += 3) {
+            unsigned int bits = v[i] << 16;
 
-        fds[i].fd = mux[i].fd;
-        fds[i].events = POLLIN;
+            if (i + 1 < size) {
+                bits |= v[i + 1] << 8;
+            }
+            if (i + 2 < size) {
+                bits |= v[i + 2];
+            }
+            encoded[j++] = base64[(bits >> 18) & 63];
+            encoded[j++] = base64[(bits >> 12) & 63];
+            if (i + 1 < size) {
+                encoded[j++] = base64[(bits >> 6) & 63];
+            }
+            if (i + 2 < size) {
+                encoded[j++] = base64[bits & 63];
+            }
+        }
+        encoded[j] = 0;
 
+        snprintf(key, sizeof(key), "LIBARCHIVE.xattr.%s", name);
+        len += ustar_pax_record(buf ? buf + len : NULL, key, encoded);
+        snprintf(key, sizeof(key), "SCHILY.xattr.%s", name);
+        len += ustar_pax_record(buf ? buf + len : NULL, key, text);
     }
-    if (mux_count == 0) {
-        struct timespec tp;
 
-        mux[0].entry = archive_entry_new();
-        mux[0].pathname = stdin_name;
+    return len;
+}
 
-        archive_entry_set_filetype(mux[0].entry, AE_IFREG);
-        archive_entry_copy_sourcepath(mux[0].entry, stdin_name);
+/*
+ * Build the header for the next fragment of the given entry into the
+ * header buffer, returning the number of bytes to be written.
+ *
+ * The header holds the same bytes libarchive writes for the entry, the
+ * extended attributes included.
+ */
+static size_t entry_header(out_t *out, struct archive_entry *entry)
+{
+    ustar_header_t h = { 0 };
+    size_t needed;
+
+    h.pathname = archive_entry_pathname(entry);
+    h.len = strlen(h.pathname);
+    h.uname = archive_entry_uname(entry);
+    h.gname = archive_entry_gname(entry);
+    h.uid = archive_entry_uid(entry);
+    h.gid = archive_entry_gid(entry);
+    h.size = archive_entry_size(entry);
+    h.mtime = archive_entry_mtime(entry);
+    h.nsec = archive_entry_mtime_nsec(entry);
+    h.mode = archive_entry_perm(entry);
+
+    h.records_len = pax_xattrs(NULL, entry);
+    if (out->records_size < h.records_len + 1) {
+        out->records = realloc(out->records, h.records_len + 1);
+        if (!out->records) {
+            fprintf(stderr, "Could not allocate header buffer.\n");
+            exit(3);
+        }
+        out->records_size = h.records_len + 1;
+    }
+    pax_xattrs(out->records, entry);
+    h.records = out->records;
+
+    needed = ustar_header(NULL, &h);
+    if (out->header_size < needed) {
+        out->header = realloc(out->header, needed);
+        if (!out->header) {
+            fprintf(stderr, "Could not allocate header buffer.\n");
+            exit(3);
+        }
+        out->header_size = needed;
+    }
 
-        mux[0].fd = STDIN_FILENO;
+    return ustar_header(out->header, &h);
+}
 
-        clock_gettime(CLOCK_REALTIME, &tp);
-        archive_entry_set_atime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
-        archive_entry_set_birthtime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
-        archive_entry_set_ctime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
+/*
+ * Wait until the output can accept more data.
+ */
+static int out_wait(int fd)
+{
+    struct pollfd pfd;
 
-        archive_entry_set_perm(mux[0].entry, 0666);
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
 
-        fds[0].fd = mux[0].fd;
-        fds[0].events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        return -1;
+    }
 
-        mux_count = 1;
+    return 0;
+}
 
+/*
+ * Write a buffer to the output in full.
+ */
+static int out_write(out_t *out, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t size = write(out->fd, buf, len);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN && !out_wait(out->fd)) {
+                continue;
+            }
+            return -1;
+        }
+        buf += size;
+        len -= size;
+        out->offset += size;
     }
 
-    /* sanity check - we can only use raw if we're muxing one file */
-    if (raw) {
-        if (mux_count > 1) {
-            fprintf(stderr,
-                    "Error: Raw mode cannot be used with multiple files, aborting.\n");
-            exit(3);
-        }
-        else {
-            if ((rv = archive_write_header(a, mux[0].entry))) {
-                fprintf(stderr, "Could not write header: %s\n",
-                        archive_error_string(a));
-                exit(1);
+    return 0;
+}
+
+/*
+ * Write zero padding to the output. When the output is a pipe, the
+ * zeros are mapped into the pipe with vmsplice() rather than copied.
+ */
+static int out_pad(out_t *out, size_t len)
+{
+#ifdef HAVE_VMSPLICE
+    if (out->pipe) {
+        while (len) {
+            struct iovec iov;
+            ssize_t size;
+
+            iov.iov_base = (void *)zeros;
+            iov.iov_len = len > sizeof(zeros) ? sizeof(zeros) : len;
+
+            size = vmsplice(out->fd, &iov, 1, 0);
+            if (size < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                else if (errno == EAGAIN && !out_wait(out->fd)) {
+                    continue;
+                }
+                return -1;
             }
+            len -= size;
+            out->offset += size;
         }
+        return 0;
     }
+#endif
 
-    /* create a buffer for our needs */
-    buffer = malloc(buffer_size);
-    if (!buffer) {
-        fprintf(stderr, "Could not allocate buffer.\n");
-        exit(3);
+    while (len) {
+        size_t size = len > sizeof(zeros) ? sizeof(zeros) : len;
+        if (out_write(out, zeros, size)) {
+            return -1;
+        }
+        len -= size;
     }
 
-    remaining = mux_count;
-
-    while (remaining) {
-        int rc;
+    return 0;
+}
 
-        rc = poll(fds, mux_count, -1);
-        if (rc < 0) {
-            perror("Error: failure during poll");
-            exit(2);
+/*
+ * Write the given vector to the output in full.
+ */
+static int out_writev(out_t *out, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt) {
+        ssize_t size = writev(out->fd, iov, iovcnt);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN && !out_wait(out->fd)) {
+                continue;
+            }
+            return -1;
+        }
+        out->offset += size;
+        while (iovcnt && (size_t)size >= iov->iov_len) {
+            size -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + size;
+            iov->iov_len -= size;
+        }
+    }
 
-        for (i = 0; i < mux_count; i++) {
-            if ((fds[i].revents & POLLIN) || (fds[i].revents & POLLHUP)) {
-                ssize_t offset = 0;
-                size_t size = buffer_size;
-
-                do {
-                    ssize_t len;
-
-                    len = read(fds[i].fd, buffer + offset, size);
-                    if (len < 0) {
-                        if (EOF == errno) {
-                            len = 0;
-                            break;
-                        }
-                        else {
-                            perror(archive_entry_sourcepath(mux[i].entry));
-                            exit(4);
-                        }
-                    }
-                    else if (len == 0) {
-                        break;
-                    }
+    return 0;
+}
+
+/*
+ * Patch the next fragment's index and size into the template ustar
+ * header of the given source, building the template on first use.
+ *
+ * Only the name suffix, size and checksum change between fragments, so
+ * the checksum is the sum of the unchanging fields taken once, plus the
+ * changing digits.
+ *
+ * Returns NULL if the fragment needs a header the template cannot give,
+ * such as one with a pax extended header, or extended attributes.
+ */
+static unsigned char *ustar_template(mux_t *mux, size_t len)
+{
+    struct archive_entry *entry = mux->entry;
+    unsigned char *block;
+    unsigned int checksum;
+    int64_t size = len;
+    int i;
 
-                    offset += len;
-                    size -= len;
+    if (mux->no_template || mux->base + mux->digits > 100
+            || size > 077777777777LL || archive_entry_xattr_count(entry)) {
+        return NULL;
+    }
 
-                    /* if we would block, leave */
-                    if (poll(&fds[i], 1, 0) < 1) {
-                        break;
-                    }
+    if (!mux->template) {
+        int64_t uid = archive_entry_uid(entry);
+        int64_t gid = archive_entry_gid(entry);
+        int64_t mtime = archive_entry_mtime(entry);
 
-                } while (size);
+        if (uid < 0 || uid > 0777777 || gid < 0 || gid > 0777777
+                || mtime < 0 || mtime > 077777777777LL) {
+            mux->no_template = 1;
+            return NULL;
+        }
 
-                if (!raw) {
+        mux->template = malloc(TAR_BLOCK_SIZE);
+        if (!mux->template) {
+            fprintf(stderr, "Could not allocate header buffer.\n");
+            exit(3);
+        }
 
-                    entry_pathindex(&mux[i]);
+        /* everything but the index, with a zero size and blank checksum */
+        ustar_block(mux->template, mux->name, mux->base,
+                archive_entry_perm(entry), uid, gid, 0, mtime, '0',
+                archive_entry_uname(entry), archive_entry_gname(entry));
+        memset(mux->template + 148, ' ', 8);
 
-                    archive_entry_set_size(mux[i].entry, offset);
+        mux->template_sum = 0;
+        for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+            mux->template_sum += mux->template[i];
+        }
+    }
 
-                    if ((rv = archive_write_header(a, mux[i].entry))) {
-                        fprintf(stderr, "Could not write header: %s\n",
-                                archive_error_string(a));
-                        exit(1);
-                    }
+    block = mux->template;
 
-                }
+    memcpy(block + mux->base, mux->name + mux->base, mux->digits);
 
-                offset = archive_write_data(a, buffer, offset);
-                if (offset < 0) {
-                    fprintf(stderr, "Error: Could not write data: %s\n",
-                            archive_error_string(a));
-                    exit(4);
-                }
+    checksum = mux->template_sum + mux->digit_sum;
+    for (i = 10; i >= 0; i--) {
+        block[124 + i] = '0' + (size & 7);
+        checksum += size & 7;
+        size >>= 3;
+    }
 
-                if (offset == 0) {
+    ustar_octal(block + 148, 6, checksum);
+    block[154] = '\0';
 
-                    if ((rv = archive_write_finish_entry(a))) {
-                        fprintf(stderr, "Could not write finish entry: %s\n",
-                                archive_error_string(a));
-                        exit(1);
-                    }
+    return block;
+}
 
-                    fds[i].events = 0;
-                    archive_entry_free(mux[i].entry);
-                    close(mux[i].fd);
+/*
+ * Make the given lane the output, keeping the place reached in the lane
+ * we leave.
+ */
+static void out_switch(out_t *out, int i)
+{
+    lane_t *lane = &out->lanes[out->lane];
+
+    lane->offset = out->offset;
+    lane->copy = out->copy;
+
+    lane = &out->lanes[i];
+    out->lane = i;
+    out->fd = lane->fd;
+    out->pipe = lane->pipe;
+    out->socket = lane->socket;
+    out->copy = lane->copy;
+    out->offset = lane->offset;
+}
 
-                    remaining--;
+/*
+ * Move the output to the lane the next fragment is written to: the
+ * first lane after the last one used that can take more without
+ * blocking, so that faster lanes carry more of the stream, or simply
+ * the next lane if all of them would block.
+ */
+static void out_lane(out_t *out)
+{
+    int i, next = (out->lane + 1) % out->lane_count;
 
-                }
+    if (poll(out->lane_poll, out->lane_count, 0) > 0) {
+        for (i = 0; i < out->lane_count; i++) {
+            int j = (out->lane + 1 + i) % out->lane_count;
 
+            if (out->lane_poll[j].revents) {
+                next = j;
+                break;
             }
-
         }
-
     }
 
-    if ((rv = archive_write_close(a))) {
-        fprintf(stderr, "Could not close write: %s\n", archive_error_string(a));
-        exit(1);
-    }
-
-    archive_write_free(a);
+    out_switch(out, next);
+}
 
-    close(out_fd);
+/*
+ * Record the next fragment of the given source in the index, if one is
+ * being kept: the offset of the fragment's header in the output, the
+ * offset of the payload within the source, the length of the payload,
+ * the fragment index and the source pathname.
+ */
+static void out_index(out_t *out, mux_t *mux, size_t len, int64_t offset)
+{
+    if (out->index && fprintf(out->index,
+            "%" PRId64 " %" PRId64 " %zu %" PRId64 " %s\n", out->base + offset,
+            mux->written, len, mux->index, mux->pathname) < 0) {
+        fprintf(stderr, "Error: Could not write index: %s\n",
+                strerror(errno));
+        exit(4);
+    }
+
+    mux->written += len;
+}
+
+/*
+ * Build the header of the next fragment of the given source, sized to
+ * hold len bytes, returning its length. When striping, the output moves
+ * to the lane the fragment is to be written to.
+ */
+static size_t out_build(out_t *out, mux_t *mux, size_t len,
+        unsigned char **header)
+{
+    if (out->lane_count > 1) {
+        out_lane(out);
+    }
+
+    out_index(out, mux, len, out->offset);
+
+    mux_suffix(mux);
+
+    if ((*header = ustar_template(mux, len))) {
+        return TAR_BLOCK_SIZE;
+    }
+
+    archive_entry_copy_pathname(mux->entry, mux->name);
+    archive_entry_set_size(mux->entry, len);
+
+    len = entry_header(out, mux->entry);
+
+    *header = out->header;
+
+    return len;
+}
+
+/*
+ * Count a fragment of len bytes from the given source.
+ */
+static void out_count(out_t *out, mux_t *mux, size_t len)
+{
+    out->fragments++;
+    out->payload += len;
+
+    stats_fragment(mux->stats, len);
+}
+
+/*
+ * Write the header of the next fragment of the given source, sized
+ * to hold len bytes.
+ */
+static int out_header(out_t *out, mux_t *mux, size_t len)
+{
+    unsigned char *header;
+    size_t size;
+
+    out_count(out, mux, len);
+
+    size = out_build(out, mux, len, &header);
+
+    return out_write(out, header, size);
+}
+
+/*
+ * Pad the payload of a fragment of len bytes to the tar block size.
+ */
+static int out_finish(out_t *out, size_t len)
+{
+    size_t pad = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+    return pad ? out_pad(out, pad) : 0;
+}
+
+/*
+ * Write the end of archive marker on its own, padded out to a whole
+ * record, for when the archive outlives its last source, and on every
+ * lane when striping.
+ */
+static int out_end(out_t *out)
+{
+    int i;
+
+    for (i = 0; i < out->lane_count; i++) {
+
+        if (out->lane_count > 1) {
+            out_switch(out, i);
+        }
+
+        if (out_write(out, zeros, 2 * TAR_BLOCK_SIZE)) {
+            return -1;
+        }
+
+        if (out_pad(out, (TAR_RECORD_SIZE - (out->offset % TAR_RECORD_SIZE))
+                % TAR_RECORD_SIZE) && errno != EPIPE) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write the closing fragment of the given source, an empty fragment
+ * marking the end of the stream.
+ *
+ * If this is the last source, the end of archive marker is written in
+ * the same write as the header, followed by padding out to a whole
+ * record as libarchive does. A reader that has seen the end of archive
+ * marker may legitimately exit before reading the padding, so a broken
+ * pipe at this point is not an error. When striping, every lane gets
+ * an end of archive marker of its own.
+ */
+static int out_close(out_t *out, mux_t *mux, int last)
+{
+    struct iovec iov[2];
+
+    out_count(out, mux, 0);
+
+    iov[0].iov_len = out_build(out, mux, 0, (unsigned char **)&iov[0].iov_base);
+
+    if (!last) {
+        return out_writev(out, iov, 1);
+    }
+
+    if (out->lane_count > 1) {
+        return out_writev(out, iov, 1) || out_end(out) ? -1 : 0;
+    }
+
+    iov[1].iov_base = (void *)zeros;
+    iov[1].iov_len = 2 * TAR_BLOCK_SIZE;
+
+    if (out_writev(out, iov, 2)) {
+        return -1;
+    }
+
+    if (out_pad(out, (TAR_RECORD_SIZE - (out->offset % TAR_RECORD_SIZE))
+            % TAR_RECORD_SIZE) && errno != EPIPE) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stamp the next fragment of the given source with the wall clock time
+ * it was read.
+ */
+static void entry_time(mux_t *mux, int64_t captured)
+{
+    char number[32];
+
+    snprintf(number, sizeof(number), "%" PRId64 ".%09" PRId64,
+            captured / 1000000000, captured % 1000000000);
+    archive_entry_xattr_add_entry(mux->entry, STATS_ATTR_TIME, number,
+            strlen(number));
+}
+
+/*
+ * Set the extended attributes of the next fragment of the given source:
+ * the codec and original size when compressed from size bytes, the
+ * CRC32C of the payload as written, and the time the fragment was
+ * captured, if asked for. The payload is still in the cache from being
+ * read, so no second trip to memory is needed.
+ */
+static void entry_attrs(out_t *out, mux_t *mux, const unsigned char *buffer,
+        size_t len, size_t size, int64_t captured)
+{
+    const char *name = codec_name(out->codec);
+    char number[32];
+
+    archive_entry_xattr_clear(mux->entry);
+
+    if (size) {
+        snprintf(number, sizeof(number), "%zu", size);
+        archive_entry_xattr_add_entry(mux->entry, CODEC_ATTR_NAME, name,
+                strlen(name));
+        archive_entry_xattr_add_entry(mux->entry, CODEC_ATTR_SIZE, number,
+                strlen(number));
+    }
+
+    if (out->checksum && len) {
+        snprintf(number, sizeof(number), "%08" PRIx32,
+                crc32c(0, buffer, len));
+        archive_entry_xattr_add_entry(mux->entry, CRC32C_ATTR_NAME, number,
+                strlen(number));
+    }
+
+    if (captured) {
+        entry_time(mux, captured);
+    }
+}
+
+/*
+ * Write a fragment read from the given source to the output, either
+ * through libarchive, or directly if we write the tar stream ourselves.
+ * An empty fragment marks the end of the source. A fragment compressed
+ * from size bytes is marked as such, as is the time it was captured.
+ *
+ * Returns the length written, exiting on error.
+ */
+static ssize_t out_emit(out_t *out, mux_t *mux,
+        const unsigned char *buffer, size_t len, size_t size, int last,
+        int64_t captured)
+{
+    struct archive *a = out->a;
+    int64_t start = stats_clock(out->stats);
+    ssize_t offset;
+
+    /* the closing fragment of a sparse file keeps the hole it ends on */
+    if ((out->codec || out->checksum || out->timestamp)
+            && (len || !out->sparse)) {
+        entry_attrs(out, mux, buffer, len, size, captured);
+    }
+
+    if (out->direct) {
+
+        if (!len) {
+            if (out_close(out, mux, last)) {
+                fprintf(stderr, "Could not close write: %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+        }
+        else {
+            struct iovec iov[3];
+
+            out_count(out, mux, len);
+
+            /* header, payload and padding in one go */
+            iov[0].iov_len = out_build(out, mux, len,
+                    (unsigned char **)&iov[0].iov_base);
+            iov[1].iov_base = (void *)buffer;
+            iov[1].iov_len = len;
+            iov[2].iov_base = (void *)zeros;
+            iov[2].iov_len = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE))
+                    % TAR_BLOCK_SIZE;
+
+            if (out_writev(out, iov, iov[2].iov_len ? 3 : 2)) {
+                fprintf(stderr, "Error: Could not write data: %s\n",
+                        strerror(errno));
+                exit(4);
+            }
+        }
+
+        stats_write(mux->stats, start);
+
+        return len;
+    }
+
+    out_count(out, mux, len);
+
+    if (!out->raw) {
+
+        /* padding of the last entry first, so the offset is exact */
+        if (out->index) {
+            if (archive_write_finish_entry(a)) {
+                fprintf(stderr, "Could not write finish entry: %s\n",
+                        archive_error_string(a));
+                exit(1);
+            }
+            out_index(out, mux, len, archive_filter_bytes(a, 0));
+        }
+
+        entry_pathindex(mux);
+
+        archive_entry_set_size(mux->entry, len);
+
+        if (archive_write_header(a, mux->entry)) {
+            fprintf(stderr, "Could not write header: %s\n",
+                    archive_error_string(a));
+            exit(1);
+        }
+
+    }
+
+    offset = archive_write_data(a, buffer, len);
+    if (offset < 0) {
+        fprintf(stderr, "Error: Could not write data: %s\n",
+                archive_error_string(a));
+        exit(4);
+    }
+
+    if (offset == 0) {
+        if (archive_write_finish_entry(a)) {
+            fprintf(stderr, "Could not write finish entry: %s\n",
+                    archive_error_string(a));
+            exit(1);
+        }
+    }
+
+    stats_write(mux->stats, start);
+
+    return offset;
+}
+
+
+/*
+ * Compress a fragment, run on a worker thread. A fragment that does not
+ * shrink is left as is.
+ */
+static void job_work(void *arg)
+{
+    job_t *job = arg;
+    size_t cap = codec_bound(job->out->codec, job->len);
+
+    job->packed = malloc(cap);
+    if (!job->packed) {
+        fprintf(stderr, "Could not allocate compression buffer.\n");
+        exit(3);
+    }
+
+    job->packed_len = codec_compress(job->out->codec, job->out->level,
+            job->buffer, job->len, job->packed, cap);
+    if (job->packed_len >= (ssize_t)job->len) {
+        job->packed_len = -1;
+    }
+}
+
+/*
+ * Write a compressed fragment, run in the order the fragments were
+ * read.
+ */
+static void job_done(void *arg, void *ctx)
+{
+    job_t *job = arg;
+
+    if (job->packed_len > 0) {
+        out_emit(job->out, job->mux, job->packed, job->packed_len, job->len,
+                0, job->captured);
+    }
+    else {
+        out_emit(job->out, job->mux, job->buffer, job->len, 0, 0,
+                job->captured);
+    }
+
+    free(job->packed);
+    free(job->buffer);
+    free(job);
+}
+
+/*
+ * Write a fragment read from the given source to the output, handing
+ * it to the compression pool first if we are compressing. The buffer
+ * is copied, as the caller reuses it as soon as we return.
+ *
+ * The closing fragment waits for the fragments before it, as the source
+ * is released once it has been written.
+ *
+ * A fragment is stamped with the time its first byte was read, if this
+ * was noted, or otherwise now, being read just before.
+ *
+ * Returns the length of the fragment, exiting on error.
+ */
+static ssize_t out_fragment(out_t *out, mux_t *mux,
+        const unsigned char *buffer, size_t len, int last)
+{
+    int64_t captured = 0;
+    job_t *job;
+
+    if (out->timestamp && len) {
+        captured = mux->captured ? mux->captured : stats_realtime();
+    }
+    mux->captured = 0;
+
+    if (!out->pool) {
+        return out_emit(out, mux, buffer, len, 0, last, captured);
+    }
+
+    if (!len) {
+        pool_drain(out->pool);
+        return out_emit(out, mux, buffer, len, 0, last, captured);
+    }
+
+    job = calloc(1, sizeof(job_t));
+    if (!job || !(job->buffer = malloc(len))) {
+        fprintf(stderr, "Could not allocate compression buffer.\n");
+        exit(3);
+    }
+    memcpy(job->buffer, buffer, len);
+    job->out = out;
+    job->mux = mux;
+    job->len = len;
+    job->captured = captured;
+
+    pool_submit(out->pool, job);
+
+    return len;
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move the data waiting on the given source to the output as a single
+ * fragment, without the data passing through userspace.
+ *
+ * Returns the length of the fragment, zero on end of file, in which
+ * case nothing has been written.
+ */
+static ssize_t splice_fragment(out_t *out, mux_t *mux, size_t max)
+{
+    size_t len, remaining;
+    int64_t start;
+    int avail = 0;
+
+    if (ioctl(mux->fd, FIONREAD, &avail) < 0) {
+        return -1;
+    }
+
+    len = remaining = (size_t)avail > max ? max : (size_t)avail;
+
+    /* end of file, leave the closing fragment to the caller */
+    if (!len) {
+        struct pollfd fd;
+
+        fd.fd = mux->fd;
+        fd.events = POLLIN;
+        fd.revents = 0;
+
+        /* a non blocking source may simply be empty */
+        if (mux->nonblock && poll(&fd, 1, 0) < 1) {
+            mux->drained = 1;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    start = stats_clock(out->stats);
+
+    if (out->timestamp) {
+        archive_entry_xattr_clear(mux->entry);
+        entry_time(mux, stats_realtime());
+    }
+
+    if (out_header(out, mux, len)) {
+        return -1;
+    }
+
+    while (remaining) {
+        ssize_t size = splice(mux->fd, NULL, out->fd, NULL, remaining,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN && !out_wait(out->fd)) {
+                continue;
+            }
+            return -1;
+        }
+        else if (size == 0) {
+            /* the source shrank underneath us, the fragment is corrupt */
+            errno = EPIPE;
+            return -1;
+        }
+        remaining -= size;
+        out->offset += size;
+    }
+
+    if (out_finish(out, len)) {
+        return -1;
+    }
+
+    stats_write(mux->stats, start);
+
+    return len;
+}
+#endif
+
+/*
+ * Move the next fragment of a regular file source, of up to max bytes,
+ * straight from the file to the output. The size of the file is known,
+ * so the header goes first and the payload follows with
+ * copy_file_range() when the output is a file too, or sendfile()
+ * otherwise, falling back to reading through the buffer where the
+ * kernel will do neither.
+ *
+ * When keeping files sparse, holes are skipped, and the fragment that
+ * follows a hole records where in the file its data lies. A hole at
+ * the end of the file is recorded against the closing fragment.
+ *
+ * Returns the length of the fragment, zero at the end of the file, in
+ * which case nothing has been written.
+ */
+static ssize_t file_fragment(out_t *out, mux_t *mux, size_t max,
+        unsigned char *buffer, size_t buffer_size)
+{
+    size_t len, remaining;
+    struct stat st;
+    int64_t start;
+    off_t pos;
+
+    if (fstat(mux->fd, &st) || (pos = lseek(mux->fd, 0, SEEK_CUR)) < 0) {
+        return -1;
+    }
+
+    if (out->sparse) {
+        off_t data, hole;
+        int found = sparse_data(mux->fd, pos, st.st_size, &data, &hole);
+
+        if (found < 0) {
+            return -1;
+        }
+        else if (!found) {
+            data = hole = st.st_size;
+        }
+
+        if (data > pos) {
+            char number[32];
+
+            snprintf(number, sizeof(number), "%jd", (intmax_t)data);
+            archive_entry_xattr_add_entry(mux->entry, SPARSE_ATTR_OFFSET,
+                    number, strlen(number));
+
+            /* the index gives offsets within the file, holes and all */
+            mux->written += data - pos;
+            pos = data;
+        }
+
+        if ((uint64_t)(hole - pos) < max) {
+            max = hole - pos;
+        }
+    }
+
+    /* end of file, leave the closing fragment to the caller */
+    if (st.st_size <= pos) {
+        return 0;
+    }
+
+    len = remaining = (uint64_t)(st.st_size - pos) < max ?
+            (size_t)(st.st_size - pos) : max;
+
+    start = stats_clock(out->stats);
+
+    if (out->timestamp) {
+        entry_time(mux, stats_realtime());
+    }
+
+    if (out_header(out, mux, len)) {
+        return -1;
+    }
+    if (out->sparse || out->timestamp) {
+        archive_entry_xattr_clear(mux->entry);
+    }
+
+    while (remaining) {
+        ssize_t size;
+
+#ifdef HAVE_COPY_FILE_RANGE
+        if (out->copy == COPY_FILE_RANGE) {
+            size = copy_file_range(mux->fd, NULL, out->fd, NULL, remaining, 0);
+            if (size < 0 && (errno == EXDEV || errno == EINVAL
+                    || errno == EBADF || errno == ENOSYS
+                    || errno == EOPNOTSUPP)) {
+                /* not between these two, such as on append */
+                out->copy = COPY_SENDFILE;
+                continue;
+            }
+        }
+        else
+#endif
+#ifdef HAVE_SENDFILE
+        if (out->copy != COPY_RW) {
+            size = sendfile(out->fd, mux->fd, NULL, remaining);
+            if (size < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                out->copy = COPY_RW;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+            size = read(mux->fd, buffer,
+                    remaining < buffer_size ? remaining : buffer_size);
+            if (size > 0) {
+                if (out_write(out, buffer, size)) {
+                    return -1;
+                }
+                remaining -= size;
+                continue;
+            }
+        }
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN && !out_wait(out->fd)) {
+                continue;
+            }
+            return -1;
+        }
+        else if (size == 0) {
+            /* the file shrank underneath us, the fragment is corrupt */
+            errno = EPIPE;
+            return -1;
+        }
+        remaining -= size;
+        out->offset += size;
+    }
+
+    if (out_finish(out, len)) {
+        return -1;
+    }
+
+    stats_write(mux->stats, start);
+
+    return len;
+}
+
+/*
+ * Read as much data as is immediately available from the given source,
+ * up to the size of the buffer.
+ *
+ * Non blocking sources are read until they would block, and are then
+ * marked as drained, with no further poll needed.
+ *
+ * Returns the length read, zero on end of file, or -1 with errno set
+ * to EAGAIN if a non blocking source had nothing to read.
+ */
+static ssize_t read_fragment(mux_t *mux, struct pollfd *fd,
+        unsigned char *buffer, size_t size)
+{
+    ssize_t offset = 0;
+
+    /* a source removed over the control channel ends here */
+    if (mux->detached) {
+        return 0;
+    }
+
+    do {
+        int64_t start = stats_clock(mux->stats);
+        ssize_t len;
+
+        len = read(mux->fd, buffer + offset, size);
+        stats_read(mux->stats, start, 1);
+        if (len < 0) {
+            if (mux->nonblock && errno == EAGAIN) {
+                mux->drained = 1;
+                if (!offset) {
+                    return -1;
+                }
+                break;
+            }
+            else if (mux->nonblock && errno == EINTR) {
+                continue;
+            }
+            else if (EOF == errno) {
+                len = 0;
+                break;
+            }
+            else {
+                perror(archive_entry_sourcepath(mux->entry));
+                exit(4);
+            }
+        }
+        else if (len == 0) {
+            break;
+        }
+
+        offset += len;
+        size -= len;
+
+        /* if we would block, leave */
+        if (!mux->nonblock && poll(fd, 1, 0) < 1) {
+            break;
+        }
+
+    } while (size);
+
+    return offset;
+}
+
+/*
+ * Return a monotonic timestamp in nanoseconds.
+ */
+static int64_t now_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (int64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/*
+ * Track the rate at which the output accepts data, as an moving
+ * average in bytes per nanosecond.
+ */
+static void sched_rate(sched_t *sched, size_t len, int64_t elapsed)
+{
+    double rate;
+
+    /* tiny writes say little about the output */
+    if (len < 4096 || elapsed <= 0) {
+        return;
+    }
+
+    rate = (double)len / elapsed;
+
+    sched->rate = sched->rate ? (sched->rate * 7 + rate) / 8 : rate;
+}
+
+/*
+ * Take a buffer for the next read of the given source from the shared
+ * arena, of up to the wanted size and within the source's own share of
+ * memory, waiting for memory to be freed if asked.
+ *
+ * Returns NULL if the source must not be read until memory is freed,
+ * otherwise sets got to the length that may be read into the buffer.
+ */
+static unsigned char *mux_alloc(mux_t *mux, sched_t *sched, size_t want,
+        size_t *got, int wait)
+{
+    size_t held = __atomic_load_n(&mux->held, __ATOMIC_RELAXED);
+    unsigned char *buffer;
+    size_t size, room;
+
+    if (sched->cap) {
+        if (held >= sched->cap) {
+            return NULL;
+        }
+
+        /* the arena rounds up to a whole block, so take one that fits */
+        for (room = ARENA_BLOCK; room <= (sched->cap - held) / 2; room <<= 1);
+        if (want > room) {
+            want = room;
+        }
+    }
+
+    buffer = wait ? arena_wait(sched->arena, want, &size) :
+            arena_alloc(sched->arena, want, &size);
+    if (buffer) {
+        __atomic_add_fetch(&mux->held, size, __ATOMIC_RELAXED);
+        *got = size < want ? size : want;
+    }
+
+    return buffer;
+}
+
+/*
+ * Return a buffer taken by mux_alloc() to the shared arena.
+ */
+static void mux_free(mux_t *mux, sched_t *sched, unsigned char *buffer)
+{
+    __atomic_sub_fetch(&mux->held, arena_free(sched->arena, buffer),
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Write the data accumulated by the given source as a single fragment,
+ * and give the buffer back for other sources to use.
+ */
+static void mux_flush(out_t *out, mux_t *mux, sched_t *sched)
+{
+    int64_t start = now_ns();
+
+    if (mux->linger_prev) {
+        mux->linger_prev->linger_next = mux->linger_next;
+    }
+    else {
+        sched->linger_head = mux->linger_next;
+    }
+    if (mux->linger_next) {
+        mux->linger_next->linger_prev = mux->linger_prev;
+    }
+    else {
+        sched->linger_tail = mux->linger_prev;
+    }
+    mux->linger_next = mux->linger_prev = NULL;
+
+    out_fragment(out, mux, mux->pending, mux->fill, 0);
+
+    sched_rate(sched, mux->fill, now_ns() - start);
+
+    mux_free(mux, sched, mux->pending);
+    mux->pending = NULL;
+    mux->fill = 0;
+}
+
+/*
+ * Read the data waiting on the given source into a buffer of its own
+ * from the arena, and write a fragment once enough data has
+ * accumulated, or the buffer is full. The caller writes out whatever
+ * lingers past the deadline.
+ *
+ * Returns the length read, zero on end of file, in which case the
+ * pending data and the closing fragment have been written. Returns -1
+ * with the source parked if there is no memory to read into, in which
+ * case the caller leaves the source alone until memory is freed.
+ */
+static ssize_t mux_coalesce(out_t *out, mux_t *mux, struct pollfd *fd,
+        size_t size, size_t buffer_size, sched_t *sched, int last)
+{
+    ssize_t len;
+
+    mux->parked = 0;
+
+    if (!mux->pending && !mux->detached) {
+        mux->pending = mux_alloc(mux, sched, buffer_size,
+                &mux->pending_size, 0);
+        if (!mux->pending) {
+            mux->parked = 1;
+            return -1;
+        }
+    }
+
+    if (size > mux->pending_size - mux->fill) {
+        size = mux->pending_size - mux->fill;
+    }
+
+    len = read_fragment(mux, fd, mux->pending + mux->fill, size);
+
+    if (len < 0) {
+        /* hold no memory while there is nothing to show for it */
+        if (!mux->fill) {
+            mux_free(mux, sched, mux->pending);
+            mux->pending = NULL;
+        }
+        return len;
+    }
+    else if (!len) {
+        if (mux->fill) {
+            mux_flush(out, mux, sched);
+        }
+        out_fragment(out, mux, zeros, 0, last);
+        mux_free(mux, sched, mux->pending);
+        mux->pending = NULL;
+        return 0;
+    }
+
+    /* the linger is the same for all, so the newest is due last */
+    if (!mux->fill) {
+        mux->since = now_ns();
+        if (out->timestamp) {
+            mux->captured = stats_realtime();
+        }
+
+        mux->linger_prev = sched->linger_tail;
+        if (sched->linger_tail) {
+            sched->linger_tail->linger_next = mux;
+        }
+        else {
+            sched->linger_head = mux;
+        }
+        sched->linger_tail = mux;
+    }
+    mux->fill += len;
+
+    if (mux->fill >= sched->coalesce || mux->fill == mux->pending_size) {
+        mux_flush(out, mux, sched);
+    }
+
+    return len;
+}
+
+/*
+ * Write out the coalesced data that has lingered past the deadline,
+ * touching only the sources holding data that is due.
+ *
+ * Returns the time in milliseconds until the next deadline, or -1 if
+ * no data is waiting.
+ */
+static int mux_linger(out_t *out, sched_t *sched)
+{
+    int64_t now = now_ns();
+    int64_t left;
+
+    while (sched->linger_head) {
+        left = sched->linger_head->since + sched->linger - now;
+        if (left > 0) {
+            return (left + 999999) / 1000000;
+        }
+        mux_flush(out, sched->linger_head, sched);
+    }
+
+    return -1;
+}
+
+static int attach_compare(const void *a, const void *b)
+{
+    return strcmp(((const attach_source_t *)a)->pathname,
+            ((const attach_source_t *)b)->pathname);
+}
+
+/*
+ * Find the pathname among those added over the control channel so far,
+ * remembering it if it is new.
+ */
+static attach_source_t *attach_source(attach_t *attach, const char *pathname)
+{
+    attach_source_t *source, **found;
+    size_t len = strlen(pathname);
+
+    source = malloc(sizeof(attach_source_t) + len + 1);
+    if (!source) {
+        fprintf(stderr, "Could not allocate name.\n");
+        exit(3);
+    }
+    memset(source, 0, sizeof(attach_source_t));
+    memcpy(source->pathname, pathname, len + 1);
+
+    found = tsearch(source, &attach->sources, attach_compare);
+    if (!found) {
+        fprintf(stderr, "Could not allocate name.\n");
+        exit(3);
+    }
+    if (*found != source) {
+        free(source);
+    }
+
+    return *found;
+}
+
+/*
+ * Act on the commands waiting on the control channel.
+ *
+ * An added source takes a free slot, and is marked attached for the
+ * caller to start watching. A pathname added again once its source has
+ * ended carries on counting its fragments where it left off, so that
+ * tardemux sees one stream that was closed and opened again. A removed
+ * source is marked detached, and reads as end of file when next served,
+ * so that it is closed as any other source, after its coalesced data. On finish the channel is
+ * closed, ending the archive here should no sources be left.
+ *
+ * The channel counts as a source in remaining while open, so that no
+ * source is taken for the last while more may yet be added.
+ */
+static void mux_control(out_t *out, attach_t *attach, mux_t *mux,
+        int mux_count, int *remaining)
+{
+    attach_source_t *source;
+    const char *pathname;
+    int command, fd, found, i;
+
+    while ((command = control_next(attach->control, &pathname, &fd))
+            != CONTROL_NONE) {
+
+        switch (command) {
+        case CONTROL_ADD:
+
+            source = attach_source(attach, pathname);
+            if (source->active) {
+                fprintf(stderr,
+                        "Warning: %s is already being read, ignoring.\n",
+                        pathname);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                break;
+            }
+
+            for (i = 0; i < mux_count && mux[i].entry; i++);
+            if (i == mux_count) {
+                fprintf(stderr,
+                        "Warning: No room for %s, ignoring.\n", pathname);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                break;
+            }
+
+            memset(&mux[i], 0, sizeof(mux_t));
+
+            if (mux_open(&mux[i], source->pathname, fd, out,
+                    attach->zerocopy, attach->files)) {
+                fprintf(stderr, "Warning: Could not add %s: %s\n",
+                        pathname, strerror(errno));
+                break;
+            }
+
+            mux[i].attach_source = source;
+            mux[i].index = source->index;
+            mux[i].written = source->written;
+            source->active = 1;
+
+            mux[i].stats = stats_source(out->stats, pathname);
+            mux[i].weight = 1;
+            mux[i].attached = 1;
+
+            (*remaining)++;
+
+            break;
+        case CONTROL_REMOVE:
+
+            found = 0;
+            for (i = 0; i < mux_count; i++) {
+                if (mux[i].entry && !strcmp(mux[i].pathname, pathname)) {
+                    mux[i].detached = 1;
+                    mux[i].splice = 0;
+                    mux[i].file = 0;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr,
+                        "Warning: No source %s to remove, ignoring.\n",
+                        pathname);
+            }
+
+            break;
+        case CONTROL_FINISH:
+
+            control_destroy(attach->control);
+            attach->control = NULL;
+
+            if (!--(*remaining) && out->direct) {
+                if (out->pool) {
+                    pool_drain(out->pool);
+                }
+                if (out_end(out)) {
+                    fprintf(stderr, "Could not close write: %s\n",
+                            strerror(errno));
+                    exit(1);
+                }
+            }
+
+            return;
+        case CONTROL_INVALID:
+
+            fprintf(stderr, "Warning: Ignoring unknown control command.\n");
+
+            break;
+        default:
+
+            perror("Error: failure reading control channel");
+            exit(2);
+
+        }
+
+    }
+}
+
+/*
+ * Multiplex the sources from a single thread, polling for sources with
+ * data waiting and writing each fragment as it is read.
+ *
+ * Ready sources are served by deficit round robin. Each source earns a
+ * quantum of bytes per round in proportion to its weight, and may read
+ * up to the credit it has earned. When a latency target is set, each
+ * round is limited to the data the output can accept within the target,
+ * shared between the ready sources by weight, so that a quiet source
+ * never waits behind more than one round.
+ *
+ * When coalescing, small reads accumulate per source until the minimum
+ * fragment size is reached, or the data has lingered long enough, so
+ * that trickling sources do not pay a header for every few bytes. A
+ * source with nothing to read into once the memory budget is spent is
+ * no longer polled until memory is freed.
+ *
+ * When attaching, the control channel is polled after the sources, and
+ * the sources come and go from the slots given.
+ */
+static void mux_poll(out_t *out, mux_t *mux, struct pollfd *fds,
+        int mux_count, size_t buffer_size, sched_t *sched, attach_t *attach)
+{
+    unsigned char *buffer;
+    unsigned long freed = 0;
+    int remaining;
+    int parked = 0;
+    int timeout = -1;
+    int next = 0;
+    int n, i;
+
+    /* create a buffer for our needs */
+    buffer = malloc(buffer_size);
+    if (!buffer) {
+        fprintf(stderr, "Could not allocate buffer.\n");
+        exit(3);
+    }
+
+    remaining = attach ? 1 : 0;
+    for (i = 0; i < mux_count; i++) {
+        remaining += mux[i].entry != NULL;
+    }
+
+    while (remaining) {
+        double budget = 0;
+        int weights = 0;
+        int64_t start = stats_clock(out->stats);
+        int rc;
+
+        /* memory has been freed, try the parked sources again */
+        if (parked && arena_freed(sched->arena) != freed) {
+            for (i = 0; i < mux_count; i++) {
+                if (mux[i].parked) {
+                    mux[i].parked = 0;
+                    fds[i].fd = mux[i].fd;
+                }
+            }
+            parked = 0;
+        }
+
+        rc = poll(fds, mux_count + (attach ? 1 : 0), timeout);
+        stats_wait(out->stats, start, 1);
+        if (rc < 0) {
+            perror("Error: failure during poll");
+            exit(2);
+        }
+
+        /* sources coming and going */
+        if (attach && attach->control && fds[mux_count].revents) {
+            mux_control(out, attach, mux, mux_count, &remaining);
+            for (i = 0; i < mux_count; i++) {
+                if (mux[i].attached) {
+                    mux[i].attached = 0;
+                    fds[i].fd = mux[i].fd;
+                    fds[i].events = POLLIN;
+                    fds[i].revents = 0;
+                }
+            }
+            if (!attach->control) {
+                fds[mux_count].fd = -1;
+            }
+        }
+
+        /* how much may we write this round and still meet the target? */
+        if (sched->latency && sched->rate) {
+            budget = sched->rate * sched->latency;
+            for (i = 0; i < mux_count; i++) {
+                if ((fds[i].revents & POLLIN) || (fds[i].revents & POLLHUP)) {
+                    weights += mux[i].weight;
+                }
+            }
+        }
+
+        for (n = 0; n < mux_count; n++) {
+            i = (next + n) % mux_count;
+            if ((fds[i].revents & POLLIN) || (fds[i].revents & POLLHUP)
+                    || mux[i].detached) {
+                ssize_t offset;
+                size_t size;
+                int64_t start;
+
+                mux[i].deficit += sched->quantum * mux[i].weight;
+
+                /* a file still paying for a large fragment sits out */
+                if (mux[i].deficit <= 0) {
+                    continue;
+                }
+
+                size = mux[i].deficit > (int64_t)buffer_size ?
+                        buffer_size : (size_t)mux[i].deficit;
+                if (mux[i].file) {
+                    size = sched->file;
+                }
+                if (weights) {
+                    double share = budget * mux[i].weight / weights;
+                    if (share < TAR_BLOCK_SIZE) {
+                        share = TAR_BLOCK_SIZE;
+                    }
+                    if (share < size) {
+                        size = share;
+                    }
+                }
+
+                start = now_ns();
+
+                if (sched->coalesce) {
+
+                    offset = mux_coalesce(out, &mux[i], &fds[i], size,
+                            buffer_size, sched, remaining == 1);
+
+                    /* a negative descriptor is ignored by poll */
+                    if (mux[i].parked) {
+                        if (!parked++) {
+                            freed = arena_freed(sched->arena);
+                        }
+                        fds[i].fd = -1;
+                        mux[i].deficit = 0;
+                        continue;
+                    }
+
+                }
+                else if (mux[i].file) {
+
+                    offset = file_fragment(out, &mux[i], size, buffer,
+                            buffer_size);
+                    if (offset < 0) {
+                        fprintf(stderr, "Error: Could not copy data: %s\n",
+                                strerror(errno));
+                        exit(4);
+                    }
+                    else if (offset == 0) {
+                        out_fragment(out, &mux[i], buffer, 0, remaining == 1);
+                    }
+
+                }
+                else
+#ifdef HAVE_SPLICE
+                if (mux[i].splice) {
+
+                    offset = splice_fragment(out, &mux[i], size);
+                    if (offset < 0) {
+                        fprintf(stderr, "Error: Could not splice data: %s\n",
+                                strerror(errno));
+                        exit(4);
+                    }
+                    else if (offset == 0) {
+                        out_fragment(out, &mux[i], buffer, 0, remaining == 1);
+                    }
+
+                }
+                else
+#endif
+                {
+
+                    offset = read_fragment(&mux[i], &fds[i], buffer, size);
+
+                    offset = out_fragment(out, &mux[i], buffer, offset,
+                            remaining == 1);
+
+                }
+
+                if (!sched->coalesce) {
+                    sched_rate(sched, offset, now_ns() - start);
+                }
+
+                /* a source with nothing more waiting keeps no credit */
+                if ((size_t)offset < size) {
+                    mux[i].deficit = 0;
+                }
+                else {
+                    mux[i].deficit -= offset;
+                }
+
+                if (offset == 0) {
+
+                    fds[i].fd = -1;
+                    fds[i].events = 0;
+                    mux_close(&mux[i]);
+
+                    remaining--;
+
+                }
+
+            }
+
+        }
+
+        next = (next + 1) % mux_count;
+
+        /* write out data that has lingered, and sleep until the next */
+        if (sched->coalesce) {
+            timeout = mux_linger(out, sched);
+        }
+
+    }
+
+    free(buffer);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+typedef struct ready_t
+{
+    mux_t *head;
+    mux_t *tail;
+    int count;
+    int weights;
+} ready_t;
+
+/*
+ * Add a source to the back of the ready list, unless already present.
+ */
+static void ready_push(ready_t *ready, mux_t *mux)
+{
+    if (mux->ready) {
+        return;
+    }
+
+    mux->ready = 1;
+    mux->drained = 0;
+    mux->ready_next = NULL;
+
+    if (ready->tail) {
+        ready->tail->ready_next = mux;
+    }
+    else {
+        ready->head = mux;
+    }
+    ready->tail = mux;
+
+    ready->count++;
+    ready->weights += mux->weight;
+}
+
+/*
+ * Remove the source at the front of the ready list.
+ */
+static mux_t *ready_pop(ready_t *ready)
+{
+    mux_t *mux = ready->head;
+
+    ready->head = mux->ready_next;
+    if (!ready->head) {
+        ready->tail = NULL;
+    }
+
+    mux->ready = 0;
+    mux->ready_next = NULL;
+
+    ready->count--;
+    ready->weights -= mux->weight;
+
+    return mux;
+}
+
+/*
+ * Start watching the given source, making it non blocking, and add it
+ * to the ready list, as reads tell us who has data.
+ */
+static void mux_watch(int efd, mux_t *mux, ready_t *ready)
+{
+    struct epoll_event ev = { 0 };
+    int flags;
+
+    flags = fcntl(mux->fd, F_GETFL);
+    if (flags < 0 || fcntl(mux->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror(archive_entry_sourcepath(mux->entry));
+        exit(2);
+    }
+    mux->nonblock = 1;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = mux;
+
+    /* regular files are refused by epoll, but never block */
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, mux->fd, &ev) < 0 && errno != EPERM) {
+        perror(archive_entry_sourcepath(mux->entry));
+        exit(2);
+    }
+
+    ready_push(ready, mux);
+}
+
+/*
+ * Multiplex the sources from a single thread using edge triggered epoll,
+ * for when there are too many sources to poll each time round.
+ *
+ * Sources are made non blocking, and join a ready list when epoll says
+ * data has arrived. Each source is read until it would block, at which
+ * point it leaves the list until the next edge, so that only the ready
+ * sources are ever touched. Regular files cannot be watched by epoll,
+ * and are simply always ready.
+ *
+ * Sources are served from the ready list by deficit round robin as in
+ * mux_poll(), one visit per source present at the start of each round.
+ * A source parked for want of memory keeps its data waiting, and so
+ * will see no further edge; it rejoins the list once memory is freed.
+ *
+ * When attaching, the control channel is watched alongside, and an
+ * added source joins the ready list as the sources given at the start
+ * do. A removed source joins it to be closed.
+ */
+static void mux_epoll(out_t *out, mux_t *mux, int mux_count,
+        size_t buffer_size, sched_t *sched, attach_t *attach)
+{
+    struct epoll_event events[EPOLL_EVENTS];
+    ready_t ready = { 0 };
+    unsigned char *buffer;
+    unsigned long freed = 0;
+    int parked = 0;
+    int control = 0;
+    int remaining;
+    int timeout = -1;
+    int efd;
+    int n, i;
+
+    /* create a buffer for our needs */
+    buffer = malloc(buffer_size);
+    if (!buffer) {
+        fprintf(stderr, "Could not allocate buffer.\n");
+        exit(3);
+    }
+
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    if (efd < 0) {
+        perror("Error: could not create epoll");
+        exit(2);
+    }
+
+    remaining = 0;
+    for (i = 0; i < mux_count; i++) {
+        if (mux[i].entry) {
+            mux_watch(efd, &mux[i], &ready);
+            remaining++;
+        }
+    }
+
+    /* the control channel is told apart by its data */
+    if (attach) {
+        struct epoll_event ev = { 0 };
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = attach;
+
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, control_fd(attach->control),
+                &ev) < 0) {
+            perror("Error: could not watch control channel");
+            exit(2);
+        }
+
+        remaining++;
+    }
+
+    while (remaining) {
+        double budget = 0;
+        int weights = 0;
+        int64_t start = stats_clock(out->stats);
+        int count;
+
+        /* memory has been freed, try the parked sources again */
+        if (parked && arena_freed(sched->arena) != freed) {
+            for (i = 0; i < mux_count; i++) {
+                if (mux[i].parked) {
+                    mux[i].parked = 0;
+                    ready_push(&ready, &mux[i]);
+                }
+            }
+            parked = 0;
+        }
+
+        /* sources already ready must not wait for new arrivals */
+        n = epoll_wait(efd, events, EPOLL_EVENTS, ready.head ? 0 : timeout);
+        stats_wait(out->stats, start, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n < 0) {
+            perror("Error: failure during epoll");
+            exit(2);
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == attach) {
+                control = 1;
+                continue;
+            }
+            ready_push(&ready, events[i].data.ptr);
+        }
+
+        /* sources coming and going */
+        if (control) {
+            mux_control(out, attach, mux, mux_count, &remaining);
+            for (i = 0; i < mux_count; i++) {
+                if (mux[i].attached) {
+                    mux[i].attached = 0;
+                    mux_watch(efd, &mux[i], &ready);
+                }
+                else if (mux[i].entry && mux[i].detached) {
+                    ready_push(&ready, &mux[i]);
+                }
+            }
+            control = 0;
+        }
+
+        /* how much may we write this round and still meet the target? */
+        if (sched->latency && sched->rate) {
+            budget = sched->rate * sched->latency;
+            weights = ready.weights;
+        }
+
+        for (count = ready.count; count && ready.head; count--) {
+            mux_t *m = ready_pop(&ready);
+            ssize_t offset;
+            size_t size;
+            int64_t start;
+
+            m->deficit += sched->quantum * m->weight;
+
+            /* a file still paying for a large fragment sits out */
+            if (m->deficit <= 0) {
+                ready_push(&ready, m);
+                continue;
+            }
+
+            size = m->deficit > (int64_t)buffer_size ?
+                    buffer_size : (size_t)m->deficit;
+            if (m->file) {
+                size = sched->file;
+            }
+            if (weights) {
+                double share = budget * m->weight / weights;
+                if (share < TAR_BLOCK_SIZE) {
+                    share = TAR_BLOCK_SIZE;
+                }
+                if (share < size) {
+                    size = share;
+                }
+            }
+
+            start = now_ns();
+
+            if (sched->coalesce) {
+
+                offset = mux_coalesce(out, m, NULL, size, buffer_size, sched,
+                        remaining == 1);
+
+                if (m->parked) {
+                    if (!parked++) {
+                        freed = arena_freed(sched->arena);
+                    }
+                    m->deficit = 0;
+                    continue;
+                }
+
+            }
+            else if (m->file) {
+
+                offset = file_fragment(out, m, size, buffer, buffer_size);
+                if (offset < 0) {
+                    fprintf(stderr, "Error: Could not copy data: %s\n",
+                            strerror(errno));
+                    exit(4);
+                }
+                else if (offset == 0) {
+                    out_fragment(out, m, buffer, 0, remaining == 1);
+                }
+
+            }
+            else
+#ifdef HAVE_SPLICE
+            if (m->splice) {
+
+                offset = splice_fragment(out, m, size);
+                if (offset < 0 && errno != EAGAIN) {
+                    fprintf(stderr, "Error: Could not splice data: %s\n",
+                            strerror(errno));
+                    exit(4);
+                }
+                else if (offset == 0) {
+                    out_fragment(out, m, buffer, 0, remaining == 1);
+                }
+
+            }
+            else
+#endif
+            {
+
+                offset = read_fragment(m, NULL, buffer, size);
+
+                if (offset >= 0) {
+                    offset = out_fragment(out, m, buffer, offset,
+                            remaining == 1);
+                }
+
+            }
+
+            /* nothing there after all, wait for the next edge */
+            if (offset < 0) {
+                m->deficit = 0;
+                continue;
+            }
+
+            if (!sched->coalesce) {
+                sched_rate(sched, offset, now_ns() - start);
+            }
+
+            if (offset == 0) {
+
+                epoll_ctl(efd, EPOLL_CTL_DEL, m->fd, NULL);
+                mux_close(m);
+
+                remaining--;
+
+                continue;
+            }
+
+            /* a source with nothing more waiting keeps no credit */
+            if ((size_t)offset < size) {
+                m->deficit = 0;
+            }
+            else {
+                m->deficit -= offset;
+            }
+
+            /* until a read would block, the source is still ready */
+            if (!m->drained) {
+                ready_push(&ready, m);
+            }
+
+        }
+
+        /* write out data that has lingered, and sleep until the next */
+        if (sched->coalesce) {
+            timeout = mux_linger(out, sched);
+        }
+
+    }
+
+    close(efd);
     free(buffer);
+}
+#endif
+
+#ifdef HAVE_URING
+/* what a completion on the ring is for, in the low bits of its tag */
+#define URING_READ 0
+#define URING_WRITE 1
+#define URING_POLL 2
+#define URING_KIND 3
+
+/* fragments written by one writev(), up to three vectors each */
+#define URING_BATCH 256
+
+/* the most buffer memory we pin for the kernel */
+#define URING_PIN (64 * 1024 * 1024)
+
+typedef struct uring_entry_t
+{
+    mux_t *mux;
+    unsigned char *buffer;
+    size_t len;
+    int64_t captured;
+} uring_entry_t;
+
+typedef struct uring_out_t
+{
+    uring_t *ring;
+    uring_entry_t *fifo;
+    int fifo_size;
+    int fifo_head;
+    int fifo_count;
+    struct iovec iov[URING_BATCH * 3 + 1];
+    uring_entry_t batch[URING_BATCH];
+    size_t header_offset[URING_BATCH];
+    int header_iov[URING_BATCH];
+    unsigned char *headers;
+    size_t headers_size;
+    int64_t start;
+    int count;
+    int iovcnt;
+    int writing;
+    int closing;
+} uring_out_t;
+
+/*
+ * Queue a read of the next fragment of the given source into the
+ * buffer taken for it, waiting for the source to become readable first
+ * if it would block.
+ */
+static void uring_read(uring_out_t *u, mux_t *mux, int wait)
+{
+    unsigned char *buffer = mux->uring_buffer;
+    uint64_t tag = (uintptr_t)mux | URING_READ;
+
+    if (wait) {
+        uring_poll(u->ring, mux->fd, POLLIN, (uintptr_t)mux | URING_POLL);
+    }
+
+    if (uring_fixed(u->ring)) {
+        uring_queue(u->ring, IORING_OP_READ_FIXED, mux->fd, buffer,
+                mux->uring_got, tag);
+    }
+    else {
+        uring_queue(u->ring, IORING_OP_READ, mux->fd, buffer,
+                mux->uring_got, tag);
+    }
+
+    mux->uring_reading = 1;
+}
+
+/*
+ * Queue the write of what remains of the batch, waiting for the output
+ * to become writable first if it would block.
+ */
+static void uring_write(uring_out_t *u, out_t *out, int wait)
+{
+    if (wait) {
+        uring_poll(u->ring, out->fd, POLLOUT, URING_POLL);
+    }
+
+    uring_queue(u->ring, IORING_OP_WRITEV, out->fd, u->iov, u->iovcnt,
+            URING_WRITE);
+
+    u->writing = 1;
+}
+
+/*
+ * Gather the fragments waiting to be written into one batch, each with
+ * its header and padding, and queue the batch as a single writev(). The
+ * closing fragment of the last source carries the end of archive
+ * marker.
+ *
+ * The headers are copied, as the template of a source is patched again
+ * for its next fragment.
+ */
+static void uring_gather(uring_out_t *u, out_t *out, int mux_count)
+{
+    size_t used = 0;
+    int i;
+
+    u->count = 0;
+    u->iovcnt = 0;
+
+    while (u->fifo_count && u->count < URING_BATCH) {
+        uring_entry_t *entry = &u->fifo[u->fifo_head];
+        mux_t *mux = entry->mux;
+        const unsigned char *buffer = entry->buffer;
+        unsigned char *header;
+        size_t len = entry->len, size, pad;
+
+        if (out->checksum || out->timestamp) {
+            entry_attrs(out, mux, buffer, len, 0, entry->captured);
+        }
+
+        out_count(out, mux, len);
+
+        size = out_build(out, mux, len, &header);
+        if (used + size > u->headers_size) {
+            u->headers_size = (used + size) * 2;
+            u->headers = realloc(u->headers, u->headers_size);
+            if (!u->headers) {
+                fprintf(stderr, "Could not allocate buffer.\n");
+                exit(3);
+            }
+        }
+        memcpy(u->headers + used, header, size);
+
+        u->header_offset[u->count] = used;
+        u->header_iov[u->count] = u->iovcnt;
+        u->iov[u->iovcnt++].iov_len = size;
+        out->offset += size;
+        used += size;
+
+        if (len) {
+            pad = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+            u->iov[u->iovcnt].iov_base = (void *)buffer;
+            u->iov[u->iovcnt++].iov_len = len;
+            if (pad) {
+                u->iov[u->iovcnt].iov_base = (void *)zeros;
+                u->iov[u->iovcnt++].iov_len = pad;
+            }
+            out->offset += len + pad;
+        }
+        else if (++u->closing == mux_count) {
+            u->iov[u->iovcnt].iov_base = (void *)zeros;
+            u->iov[u->iovcnt++].iov_len = 2 * TAR_BLOCK_SIZE;
+            out->offset += 2 * TAR_BLOCK_SIZE;
+        }
+
+        u->batch[u->count++] = *entry;
+
+        u->fifo_head = (u->fifo_head + 1) % u->fifo_size;
+        u->fifo_count--;
+    }
+
+    /* the headers have stopped moving */
+    for (i = 0; i < u->count; i++) {
+        u->iov[u->header_iov[i]].iov_base = u->headers + u->header_offset[i];
+    }
+
+    u->start = stats_clock(out->stats);
+
+    uring_write(u, out, 0);
+}
+
+/*
+ * Handle the completion of a batch write, queueing the rest of the
+ * batch after a short write. Once the batch is written, the buffers of
+ * the batch go back to the arena, and sources that have closed are
+ * released.
+ *
+ * Returns the number of sources closed.
+ */
+static int uring_written(uring_out_t *u, out_t *out, sched_t *sched,
+        int32_t res)
+{
+    int closed = 0;
+    int i;
+
+    if (res == -EAGAIN || res == -EINTR) {
+        uring_write(u, out, res == -EAGAIN);
+        return 0;
+    }
+    else if (res < 0) {
+        fprintf(stderr, "Error: Could not write data: %s\n", strerror(-res));
+        exit(4);
+    }
+
+    /* a short write, carry on from where it stopped */
+    for (i = 0; i < u->iovcnt && (size_t)res >= u->iov[i].iov_len; i++) {
+        res -= u->iov[i].iov_len;
+    }
+    if (i < u->iovcnt) {
+        memmove(u->iov, u->iov + i, (u->iovcnt - i) * sizeof(struct iovec));
+        u->iovcnt -= i;
+        u->iov[0].iov_base = (char *)u->iov[0].iov_base + res;
+        u->iov[0].iov_len -= res;
+        uring_write(u, out, 0);
+        return 0;
+    }
+
+    if (out->stats) {
+        stats_add(&out->stats->write_ns, stats_clock(out->stats) - u->start);
+    }
+
+    u->writing = 0;
+
+    for (i = 0; i < u->count; i++) {
+        mux_t *mux = u->batch[i].mux;
+
+        if (u->batch[i].buffer) {
+            mux_free(mux, sched, u->batch[i].buffer);
+            mux->uring_busy--;
+        }
+        else {
+            mux_close(mux);
+            closed++;
+        }
+    }
+
+    return closed;
+}
+
+/*
+ * Multiplex the sources through io_uring, reading every source and
+ * writing the output from one ring, so that a round of reads and the
+ * write of everything read costs a single system call, rather than one
+ * per read, write and poll.
+ *
+ * Each source may have two buffers taken from the arena, one being
+ * read while the other waits to be written, and a read is kept in
+ * flight on every source with memory to read into. Fragments are
+ * written in the order their reads complete, up to a quantum per read
+ * in proportion to each source's weight, in batches of one writev()
+ * each. While a batch is being written, the next reads carry on. A
+ * read in flight holds its buffer until data arrives.
+ *
+ * The arena is registered with the ring where the kernel allows and it
+ * is small enough to pin, to spare mapping the pages on each read.
+ */
+static void mux_uring(out_t *out, mux_t *mux, int mux_count,
+        uring_t *ring, size_t buffer_size, sched_t *sched)
+{
+    uring_out_t u = { 0 };
+    unsigned char *region;
+    size_t region_size;
+    int remaining = mux_count;
+    int i;
+
+    u.ring = ring;
+
+    /* two buffers per source, and room for each to close */
+    u.fifo_size = 3 * mux_count;
+    u.fifo = calloc(u.fifo_size, sizeof(uring_entry_t));
+    if (!u.fifo) {
+        fprintf(stderr, "Could not allocate buffer.\n");
+        exit(3);
+    }
+
+    region = arena_base(sched->arena, &region_size);
+    if (region_size <= URING_PIN) {
+        uring_register(ring, region, region_size);
+    }
+
+    for (i = 0; i < mux_count; i++) {
+        size_t size = sched->quantum * mux[i].weight;
+
+        mux[i].uring_size = size < buffer_size ? size : buffer_size;
+
+        /* the ring waits for us, except on descriptors we were handed */
+        if (mux[i].fd != STDIN_FILENO) {
+            int flags = fcntl(mux[i].fd, F_GETFL);
+            if (flags >= 0) {
+                fcntl(mux[i].fd, F_SETFL, flags & ~O_NONBLOCK);
+            }
+        }
+    }
+
+    while (remaining) {
+        int64_t start;
+        uint64_t tag;
+        int32_t res;
+
+        for (i = 0; i < mux_count; i++) {
+            if (!mux[i].uring_reading && !mux[i].uring_eof
+                    && mux[i].uring_busy < 2
+                    && (mux[i].uring_buffer = mux_alloc(&mux[i], sched,
+                            mux[i].uring_size, &mux[i].uring_got, 0))) {
+                uring_read(&u, &mux[i], 0);
+            }
+        }
+
+        if (!u.writing && u.fifo_count) {
+            uring_gather(&u, out, mux_count);
+        }
+
+        start = stats_clock(out->stats);
+        if (uring_submit(ring, 1)) {
+            perror("Error: failure during io_uring");
+            exit(2);
+        }
+        stats_wait(out->stats, start, 1);
+
+        while (uring_reap(ring, &tag, &res)) {
+            mux_t *m = (mux_t *)(uintptr_t)(tag & ~(uint64_t)URING_KIND);
+            uring_entry_t *entry;
+
+            switch (tag & URING_KIND) {
+            case URING_POLL:
+                /* the linked operation reports any error */
+                break;
+            case URING_WRITE:
+                remaining -= uring_written(&u, out, sched, res);
+                break;
+            case URING_READ:
+                if (res == -EAGAIN || res == -EINTR) {
+                    uring_read(&u, m, res == -EAGAIN);
+                    break;
+                }
+                else if (res < 0) {
+                    fprintf(stderr, "%s: %s\n",
+                            archive_entry_sourcepath(m->entry),
+                            strerror(-res));
+                    exit(4);
+                }
+
+                m->uring_reading = 0;
+
+                entry = &u.fifo[(u.fifo_head + u.fifo_count) % u.fifo_size];
+                entry->mux = m;
+                entry->captured = out->timestamp && res ? stats_realtime() : 0;
+                u.fifo_count++;
+
+                if (res == 0) {
+                    mux_free(m, sched, m->uring_buffer);
+                    m->uring_eof = 1;
+                    entry->buffer = NULL;
+                    entry->len = 0;
+                }
+                else {
+                    entry->buffer = m->uring_buffer;
+                    entry->len = res;
+                    m->uring_busy++;
+                    if (m->stats) {
+                        stats_add(&m->stats->reads, 1);
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    /* pad out to a whole record, as libarchive does */
+    if (out_pad(out, (TAR_RECORD_SIZE - (out->offset % TAR_RECORD_SIZE))
+            % TAR_RECORD_SIZE) && errno != EPIPE) {
+        fprintf(stderr, "Could not close write: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    free(u.headers);
+    free(u.fifo);
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Reader thread for a single source, filling the source's ring of
+ * fragments as data arrives, and waiting for the writer when the ring
+ * is full or the source holds its share of memory.
+ *
+ * The buffer for each fragment is only taken from the arena once the
+ * source is readable, so that quiet sources hold no memory, waiting
+ * for memory to be freed if the budget is spent.
+ */
+static void *mux_reader(void *arg)
+{
+    mux_t *mux = arg;
+    threads_t *threads = mux->threads;
+    struct pollfd fd;
+
+    fd.fd = mux->fd;
+    fd.events = POLLIN;
+
+    for (;;) {
+        fragment_t *frag;
+        int64_t start;
+        ssize_t len;
+        size_t size;
+
+        pthread_mutex_lock(&threads->lock);
+        while (mux->ring_count == threads->depth || (threads->sched->cap
+                && __atomic_load_n(&mux->held, __ATOMIC_RELAXED)
+                        >= threads->sched->cap)) {
+            pthread_cond_wait(&mux->space, &threads->lock);
+        }
+        frag = &mux->ring[(mux->ring_head + mux->ring_count) % threads->depth];
+        pthread_mutex_unlock(&threads->lock);
+
+        start = stats_clock(mux->stats);
+        if (poll(&fd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: failure during poll");
+            exit(2);
+        }
+        stats_read(mux->stats, start, 0);
+
+        frag->buffer = mux_alloc(mux, threads->sched, threads->buffer_size,
+                &size, 1);
+
+        len = read_fragment(mux, &fd, frag->buffer, size);
+        frag->captured = threads->timestamp && len ? stats_realtime() : 0;
+
+        /* gather further reads until the fragment is big enough */
+        if (len && threads->sched->coalesce) {
+            int64_t deadline = now_ns() + threads->sched->linger;
+
+            while ((size_t)len < threads->sched->coalesce
+                    && (size_t)len < size) {
+                int64_t left = deadline - now_ns();
+                ssize_t more;
+                int rc;
+
+                if (left <= 0) {
+                    break;
+                }
+
+                start = stats_clock(mux->stats);
+                rc = poll(&fd, 1, (left + 999999) / 1000000);
+                stats_read(mux->stats, start, 0);
+                if (rc < 0 && errno == EINTR) {
+                    continue;
+                }
+                else if (rc < 0) {
+                    perror("Error: failure during poll");
+                    exit(2);
+                }
+                else if (rc == 0) {
+                    break;
+                }
+
+                /* end of file is picked up by the next read */
+                more = read_fragment(mux, &fd, frag->buffer + len,
+                        size - len);
+                if (!more) {
+                    break;
+                }
+                len += more;
+            }
+        }
+
+        pthread_mutex_lock(&threads->lock);
+        frag->len = len;
+        mux->ring_count++;
+        pthread_cond_signal(&threads->ready);
+        pthread_mutex_unlock(&threads->lock);
+
+        if (!len) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Multiplex the sources using one reader thread per source, each
+ * feeding a bounded ring of fragments, while this thread serialises
+ * the fragments into the tar stream. Reads continue while the output
+ * is blocked, until a source's ring is full, or the memory budget is
+ * spent.
+ *
+ * The rings are served by deficit round robin, each source earning a
+ * quantum of bytes in proportion to its weight on each visit.
+ */
+static void mux_threads(out_t *out, mux_t *mux, int mux_count,
+        size_t buffer_size, int depth, sched_t *sched)
+{
+    threads_t threads;
+    int remaining = mux_count;
+    int next = 0;
+    int visited = 0;
+    int idle = 0;
+    int i, j;
+
+    pthread_mutex_init(&threads.lock, NULL);
+    pthread_cond_init(&threads.ready, NULL);
+    threads.sched = sched;
+    threads.buffer_size = buffer_size;
+    threads.depth = depth;
+    threads.timestamp = out->timestamp;
+
+    for (i = 0; i < mux_count; i++) {
+
+        mux[i].threads = &threads;
+        pthread_cond_init(&mux[i].space, NULL);
+
+        mux[i].ring = calloc(depth, sizeof(fragment_t));
+        if (!mux[i].ring) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+
+        if (pthread_create(&mux[i].thread, NULL, mux_reader, &mux[i])) {
+            fprintf(stderr, "Could not create reader thread.\n");
+            exit(3);
+        }
+
+    }
+
+    while (remaining) {
+        fragment_t *frag;
+        ssize_t len;
+
+        /* serve the sources with fragments waiting in turn */
+        pthread_mutex_lock(&threads.lock);
+        for (;;) {
+            j = next;
+            if (mux[j].ring && mux[j].ring_count) {
+                idle = 0;
+                if (!visited) {
+                    mux[j].deficit += sched->quantum * mux[j].weight;
+                    visited = 1;
+                }
+                if (mux[j].ring[mux[j].ring_head].len <= mux[j].deficit) {
+                    break;
+                }
+            }
+            else if (visited) {
+                /* a source with nothing more waiting keeps no credit */
+                mux[j].deficit = 0;
+            }
+            else if (++idle >= mux_count) {
+                int64_t start = stats_clock(out->stats);
+
+                pthread_cond_wait(&threads.ready, &threads.lock);
+                stats_wait(out->stats, start, 1);
+                idle = 0;
+                continue;
+            }
+            next = (next + 1) % mux_count;
+            visited = 0;
+        }
+        frag = &mux[j].ring[mux[j].ring_head];
+        pthread_mutex_unlock(&threads.lock);
+
+        len = frag->len;
+        mux[j].deficit -= len;
+        mux[j].captured = frag->captured;
+
+        out_fragment(out, &mux[j], frag->buffer, len, remaining == 1);
+
+        mux_free(&mux[j], sched, frag->buffer);
+        frag->buffer = NULL;
+
+        pthread_mutex_lock(&threads.lock);
+        mux[j].ring_head = (mux[j].ring_head + 1) % depth;
+        mux[j].ring_count--;
+        pthread_cond_signal(&mux[j].space);
+        pthread_mutex_unlock(&threads.lock);
+
+        if (!len) {
+
+            pthread_join(mux[j].thread, NULL);
+
+            free(mux[j].ring);
+            mux[j].ring = NULL;
+            pthread_cond_destroy(&mux[j].space);
+
+            mux_close(&mux[j]);
+
+            remaining--;
+
+        }
+    }
+
+    pthread_cond_destroy(&threads.ready);
+    pthread_mutex_destroy(&threads.lock);
+}
+#endif
+
+/*
+ * Parse the whole of a numeric option, exiting if it is not a number
+ * between min and max.
+ */
+static int64_t option_number(const char *arg, int64_t min, int64_t max,
+        const char *what)
+{
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(arg, &end, 10);
+    if (errno || end == arg || *end || value < min || value > max) {
+        fprintf(stderr, "Error: %s must be %s, aborting.\n", what,
+                min > 0 ? "a positive number" : "zero or a positive number");
+        exit(1);
+    }
+
+    return value;
+}
+
+int main(int argc, char * const argv[])
+{
+
+    struct archive *a = NULL;
+#ifdef HAVE_URING
+    uring_t *ring;
+#endif
+    mux_t *mux;
+    struct pollfd *fds;
+    out_t out = { 0 };
+    sched_t sched = { 0 };
+
+    const char *name = argv[0];
+    const char **out_files = NULL;
+    const char *stdin_name = "-";
+    const char *weights = NULL;
+    const char *index_file = NULL;
+    const char *compress = NULL;
+    const char *stats_file = NULL;
+    const char *attach_path = NULL;
+    attach_t attach = { 0 };
+
+    size_t buffer_size = 1024 * 1024;
+    size_t memory = 64 * 1024 * 1024;
+
+    int out_fd = STDOUT_FILENO;
+    int out_files_num = 0;
+    int opt;
+    int mux_count;
+    int max_sources = 1024;
+    int slots;
+    int i;
+    int raw = 0;
+    int zerocopy = 0;
+    int edge = 0;
+    int fast = 0;
+    int uring = 0;
+    int depth = 0;
+    int jobs = -1;
+    int huge = 0;
+    int64_t stats_interval = 0;
+    int64_t file_fragment = -1;
+    int files;
+    int rv;
+
+    while ((opt = getopt(argc, argv, "hvrzHeUkTsf:n:i:t:q:w:l:c:L:b:M:F:C:j:S:A:-:")) != -1) {
+        switch (opt) {
+        case '-':
+            if (!strcmp(optarg, "help")) {
+                help(name);
+                exit(0);
+            }
+            else if (!strcmp(optarg, "version")) {
+                version();
+                exit(0);
+            }
+            else if (!strcmp(optarg, "name")) {
+                stdin_name = optarg;
+                exit(0);
+            }
+            else if (!strcmp(optarg, "splice")) {
+                zerocopy = 1;
+            }
+            else if (!strcmp(optarg, "epoll")) {
+                edge = 1;
+            }
+            else if (!strcmp(optarg, "fast-header")) {
+                fast = 1;
+            }
+            else if (!strcmp(optarg, "uring")) {
+                uring = 1;
+            }
+            else if (!strcmp(optarg, "checksum")) {
+                out.checksum = 1;
+            }
+            else if (!strcmp(optarg, "timestamp")) {
+                out.timestamp = 1;
+            }
+            else if (!strcmp(optarg, "sparse")) {
+                out.sparse = 1;
+            }
+            else if (!strcmp(optarg, "hugepages")) {
+                huge = 1;
+            }
+            else if (!strncmp(optarg, "index=", 6)) {
+                index_file = optarg + 6;
+            }
+            else if (!strncmp(optarg, "threads=", 8)) {
+                depth = option_number(optarg + 8, 1, INT_MAX, "Thread buffer depth");
+            }
+            else if (!strncmp(optarg, "quantum=", 8)) {
+                sched.quantum = option_number(optarg + 8, 1, SSIZE_MAX, "Quantum");
+            }
+            else if (!strncmp(optarg, "weights=", 8)) {
+                weights = optarg + 8;
+            }
+            else if (!strncmp(optarg, "latency=", 8)) {
+                sched.latency = option_number(optarg + 8, 1, INT64_MAX / 1000000,
+                        "Latency") * 1000000;
+            }
+            else if (!strncmp(optarg, "coalesce=", 9)) {
+                sched.coalesce = option_number(optarg + 9, 1, SSIZE_MAX,
+                        "Coalesce size");
+            }
+            else if (!strncmp(optarg, "linger=", 7)) {
+                sched.linger = option_number(optarg + 7, 1, INT64_MAX / 1000000,
+                        "Linger") * 1000000;
+            }
+            else if (!strncmp(optarg, "buffer=", 7)) {
+                buffer_size = option_number(optarg + 7, 1, SSIZE_MAX,
+                        "Buffer size");
+            }
+            else if (!strncmp(optarg, "memory=", 7)) {
+                memory = option_number(optarg + 7, 1, SSIZE_MAX, "Memory size");
+            }
+            else if (!strncmp(optarg, "source-memory=", 14)) {
+                size_t cap = option_number(optarg + 14, 1, SSIZE_MAX,
+                        "Source memory size");
+
+                /* blocks are powers of two, so round the cap down to one */
+                for (sched.cap = ARENA_BLOCK; sched.cap <= cap / 2;
+                        sched.cap <<= 1);
+            }
+            else if (!strncmp(optarg, "file-fragment=", 14)) {
+                file_fragment = option_number(optarg + 14, 0, INT64_MAX,
+                        "File fragment size");
+            }
+            else if (!strncmp(optarg, "compress=", 9)) {
+                compress = optarg + 9;
+            }
+            else if (!strncmp(optarg, "jobs=", 5)) {
+                jobs = option_number(optarg + 5, 1, INT_MAX, "Jobs");
+            }
+            else if (!strncmp(optarg, "stats=", 6)) {
+                stats_file = optarg + 6;
+            }
+            else if (!strncmp(optarg, "stats-interval=", 15)) {
+                stats_interval = option_number(optarg + 15, 1, INT64_MAX,
+                        "Statistics interval");
+            }
+            else if (!strncmp(optarg, "attach=", 7)) {
+                attach_path = optarg + 7;
+            }
+            else if (!strncmp(optarg, "max-sources=", 12)) {
+                max_sources = option_number(optarg + 12, 1, INT_MAX,
+                        "Maximum sources");
+            }
+            break;
+        case 'h':
+            help(name);
+            exit(0);
+        case 'v':
+            version();
+            exit(0);
+        case 'r':
+            raw = 1;
+            break;
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'e':
+            edge = 1;
+            break;
+        case 'H':
+            fast = 1;
+            break;
+        case 'U':
+            uring = 1;
+            break;
+        case 'k':
+            out.checksum = 1;
+            break;
+        case 'T':
+            out.timestamp = 1;
+            break;
+        case 's':
+            out.sparse = 1;
+            break;
+        case 'i':
+            index_file = optarg;
+            break;
+        case 'f':
+            out_files = realloc(out_files,
+                    (out_files_num + 1) * sizeof(const char *));
+            out_files[out_files_num++] = optarg;
+            break;
+        case 'n':
+            stdin_name = optarg;
+            break;
+        case 't':
+            depth = option_number(optarg, 1, INT_MAX, "Thread buffer depth");
+            break;
+        case 'q':
+            sched.quantum = option_number(optarg, 1, SSIZE_MAX, "Quantum");
+            break;
+        case 'w':
+            weights = optarg;
+            break;
+        case 'l':
+            sched.latency = option_number(optarg, 1, INT64_MAX / 1000000,
+                    "Latency") * 1000000;
+            break;
+        case 'c':
+            sched.coalesce = option_number(optarg, 1, SSIZE_MAX,
+                    "Coalesce size");
+            break;
+        case 'L':
+            sched.linger = option_number(optarg, 1, INT64_MAX / 1000000,
+                    "Linger") * 1000000;
+            break;
+        case 'b':
+            buffer_size = option_number(optarg, 1, SSIZE_MAX, "Buffer size");
+            break;
+        case 'M':
+            memory = option_number(optarg, 1, SSIZE_MAX, "Memory size");
+            break;
+        case 'F':
+            file_fragment = option_number(optarg, 0, INT64_MAX,
+                    "File fragment size");
+            break;
+        case 'C':
+            compress = optarg;
+            break;
+        case 'j':
+            jobs = option_number(optarg, 1, INT_MAX, "Jobs");
+            break;
+        case 'S':
+            stats_file = optarg;
+            break;
+        case 'A':
+            attach_path = optarg;
+            break;
+        default:
+            help(name);
+            exit(1);
+        }
+    }
+
+#ifndef HAVE_PTHREAD_H
+    if (depth) {
+        fprintf(stderr,
+                "Error: Threads not supported on this platform, aborting.\n");
+        exit(2);
+    }
+#endif
+#ifndef HAVE_SYS_EPOLL_H
+    if (edge) {
+        fprintf(stderr,
+                "Error: Epoll not supported on this platform, aborting.\n");
+        exit(2);
+    }
+#endif
+    if (edge && depth) {
+        fprintf(stderr,
+                "Error: Epoll cannot be used with threads, aborting.\n");
+        exit(1);
+    }
+#ifndef HAVE_URING
+    if (uring) {
+        fprintf(stderr,
+                "Error: io_uring not supported on this platform, aborting.\n");
+        exit(2);
+    }
+#endif
+    if (uring && (edge || depth || zerocopy || sched.coalesce || compress)) {
+        fprintf(stderr,
+                "Error: io_uring cannot be used with %s, aborting.\n",
+                edge ? "epoll" : depth ? "threads" : zerocopy ? "splice" :
+                sched.coalesce ? "coalescing" : "compression");
+        exit(1);
+    }
+    if ((file_fragment >= 0 || out.sparse) && (uring || depth
+            || sched.coalesce || compress || out.checksum || raw)) {
+        fprintf(stderr,
+                "Error: %s cannot be used with %s, aborting.\n",
+                out.sparse ? "Sparse files" : "File fragments",
+                uring ? "io_uring" : depth ? "threads" :
+                sched.coalesce ? "coalescing" : compress ? "compression" :
+                out.checksum ? "checksums" : "raw mode");
+        exit(1);
+    }
+    if (compress) {
+        int codec = codec_parse(compress, &out.level);
+
+        if (codec < 0) {
+            fprintf(stderr,
+                    "Error: Compression codec '%s' not supported, aborting.\n",
+                    compress);
+            exit(2);
+        }
+        if (raw || index_file) {
+            fprintf(stderr,
+                    "Error: Compression cannot be used with %s, aborting.\n",
+                    raw ? "raw mode" : "an index");
+            exit(1);
+        }
+        out.codec = codec;
+    }
+    if (out.checksum && raw) {
+        fprintf(stderr,
+                "Error: Checksums cannot be used with raw mode, aborting.\n");
+        exit(1);
+    }
+    if (out.timestamp && raw) {
+        fprintf(stderr,
+                "Error: Timestamps cannot be used with raw mode, aborting.\n");
+        exit(1);
+    }
+    if (attach_path && (uring || depth || raw)) {
+        fprintf(stderr,
+                "Error: Attaching sources cannot be used with %s, aborting.\n",
+                uring ? "io_uring" : depth ? "threads" : "raw mode");
+        exit(1);
+    }
+    if (out_files_num > 1 && (uring || raw || index_file)) {
+        fprintf(stderr,
+                "Error: Striping across lanes cannot be used with %s, aborting.\n",
+                uring ? "io_uring" : raw ? "raw mode" : "an index");
+        exit(1);
+    }
+    crc32c_init();
+
+    /* make sure we don't die on sigpipe */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* make sure our tar streams are open for append, one for each lane */
+    out.lane_count = out_files_num ? out_files_num : 1;
+    out.lanes = calloc(out.lane_count, sizeof(lane_t));
+    out.lane_poll = calloc(out.lane_count, sizeof(struct pollfd));
+    if (!out.lanes || !out.lane_poll) {
+        fprintf(stderr, "Could not allocate lanes.\n");
+        exit(3);
+    }
+    for (i = 0; i < out.lane_count; i++) {
+        lane_t *lane = &out.lanes[i];
+
+        lane->name = out_files_num ? out_files[i] : "-";
+        lane->fd = STDOUT_FILENO;
+        if (strcmp(lane->name, "-")
+                && (lane->fd = open(lane->name, O_WRONLY | O_CREAT | O_APPEND,
+                        0666)) < 0) {
+            perror(lane->name);
+            exit(1);
+        }
+
+        out.lane_poll[i].fd = lane->fd;
+        out.lane_poll[i].events = POLLOUT;
+    }
+    out_fd = out.lanes[0].fd;
+
+    /*
+     * io_uring writes the headers itself, as do file fragments, and
+     * fragments striped across lanes
+     */
+    fast = fast || uring || file_fragment >= 0 || out.sparse
+            || out.lane_count > 1;
+
+    /* zero copy needs a pipe or socket on the output, otherwise fall back */
+    if (zerocopy || fast) {
+        struct stat st;
+
+        if (raw) {
+            fprintf(stderr,
+                    "Error: %s mode cannot be used with raw mode, aborting.\n",
+                    zerocopy ? "Splice" : uring ? "io_uring" : "Fast header");
+            exit(3);
+        }
+
+        for (i = 0; i < out.lane_count; i++) {
+            lane_t *lane = &out.lanes[i];
+
+            if ((rv = fstat(lane->fd, &st))) {
+                perror(lane->name);
+                exit(1);
+            }
+
+            lane->pipe = S_ISFIFO(st.st_mode);
+            lane->socket = S_ISSOCK(st.st_mode);
+            lane->copy = S_ISREG(st.st_mode) ? COPY_FILE_RANGE : COPY_SENDFILE;
+
+            /* a source may be spliced to any lane, so all must be pipes */
+            zerocopy = zerocopy && (out.lane_count > 1 ? lane->pipe
+                    : lane->pipe || lane->socket);
+        }
+
+        out.fd = out_fd;
+        out.pipe = out.lanes[0].pipe;
+        out.socket = out.lanes[0].socket;
+        out.copy = out.lanes[0].copy;
+
+#ifndef HAVE_SPLICE
+        zerocopy = 0;
+#endif
+    }
+
+    /* set up the output tar archive, unless we write it ourselves */
+    out.direct = zerocopy || fast;
+    if (!out.direct) {
+
+        a = archive_write_new();
+
+        if (raw) {
+#ifdef HAVE_ARCHIVE_WRITE_SET_FORMAT_RAW
+            archive_write_set_format_raw(a);
+#else
+            fprintf(stderr,
+                    "Error: Raw mode not supported on this platform, aborting.\n");
+            exit(2);
+#endif
+        }
+        else {
+            archive_write_set_format_pax_restricted(a);
+        }
+
+        archive_write_open_fd(a, out_fd);
+
+    }
+
+    out.a = a;
+    out.fd = out_fd;
+    out.raw = raw;
+
+    /* before any other thread, so SIGUSR1 is left to the statistics */
+    if (stats_file) {
+        out.stats = stats_create("tarmux", stats_file, stats_interval);
+    }
+
+    /* fragments are compressed on a pool of threads, written in order */
+    if (out.codec) {
+#ifdef HAVE_PTHREAD_H
+        if (jobs < 0) {
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+#endif
+        if (jobs < 0) {
+            jobs = 0;
+        }
+        out.pool = pool_create(jobs, 2 * jobs, job_work, job_done, NULL);
+    }
+
+    /* the index gives offsets from the start of the output file */
+    if (index_file) {
+        int flags = fcntl(out_fd, F_GETFL);
+
+        if (raw) {
+            fprintf(stderr,
+                    "Error: An index cannot be kept in raw mode, aborting.\n");
+            exit(3);
+        }
+
+        if (!(out.index = fopen(index_file, "a"))) {
+            perror(index_file);
+            exit(1);
+        }
+
+        out.base = lseek(out_fd, 0,
+                flags >= 0 && (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+        if (out.base < 0) {
+            out.base = 0;
+        }
+    }
+
+    /* regular files go straight to the output when we write the headers */
+    files = out.direct && !uring && !depth && !sched.coalesce && !out.codec
+            && !out.checksum;
+    sched.file = file_fragment < 0 ? buffer_size :
+            file_fragment ? (size_t)file_fragment : SIZE_MAX;
+
+    /*
+     * remaining parameters are files to mux, otherwise default to stdin,
+     * unless sources are to be attached, in which case there is room
+     * for as many as may be open at once, and the control channel
+     */
+    mux_count = argc - optind;
+    slots = attach_path && max_sources > mux_count ? max_sources : mux_count;
+    mux = calloc(slots > 0 ? slots : 1, sizeof(mux_t));
+    fds = calloc(slots + 1, sizeof(struct pollfd));
+    for (i = 0; i < mux_count; i++) {
+
+        if (mux_open(&mux[i], argv[optind + i], -1, &out, zerocopy, files)) {
+            perror(argv[optind + i]);
+            exit(2);
+        }
+
+        fds[i].fd = mux[i].fd;
+        fds[i].events = POLLIN;
+
+    }
+    if (mux_count == 0 && !attach_path) {
+        struct timespec tp;
+
+        mux[0].entry = archive_entry_new();
+        mux[0].pathname = stdin_name;
+
+        archive_entry_set_filetype(mux[0].entry, AE_IFREG);
+        archive_entry_copy_sourcepath(mux[0].entry, stdin_name);
+
+        mux[0].fd = STDIN_FILENO;
+
+        clock_gettime(CLOCK_REALTIME, &tp);
+        archive_entry_set_atime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
+        archive_entry_set_birthtime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
+        archive_entry_set_ctime(mux[0].entry, tp.tv_sec, tp.tv_nsec);
+
+        archive_entry_set_perm(mux[0].entry, 0666);
+
+        if ((zerocopy || files) && !out.codec && !out.checksum) {
+            struct stat st;
+
+            if ((rv = fstat(mux[0].fd, &st))) {
+                perror(stdin_name);
+                exit(1);
+            }
+
+            mux[0].splice = zerocopy
+                    && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+                    && (out.pipe || S_ISFIFO(st.st_mode));
+            mux[0].file = files && S_ISREG(st.st_mode);
+        }
+
+        fds[0].fd = mux[0].fd;
+        fds[0].events = POLLIN;
+
+        mux_count = 1;
+
+    }
+
+    for (i = 0; i < mux_count; i++) {
+        mux[i].stats = stats_source(out.stats, mux[i].pathname);
+    }
+
+    /* each source earns a quantum per round in proportion to its weight */
+    if (!sched.quantum) {
+        sched.quantum = buffer_size;
+    }
+
+    /* small reads are gathered, but never for too long */
+    if (sched.coalesce > buffer_size) {
+        sched.coalesce = buffer_size;
+    }
+    if (sched.linger <= 0) {
+        sched.linger = 50 * 1000000;
+    }
+    for (i = 0; i < mux_count; i++) {
+        mux[i].weight = 1;
+        if (weights) {
+            char *end;
+            long weight;
+
+            errno = 0;
+            weight = strtol(weights, &end, 10);
+            if (errno || end == weights || weight < 1 || weight > INT_MAX
+                    || (*end && *end != ',')) {
+                fprintf(stderr,
+                        "Error: Weights must be a comma separated list of positive numbers, aborting.\n");
+                exit(1);
+            }
+            mux[i].weight = weight;
+            if (!*end && i + 1 < mux_count) {
+                fprintf(stderr,
+                        "Error: Fewer weights than sources, aborting.\n");
+                exit(1);
+            }
+            weights = *end ? end + 1 : end;
+        }
+    }
+    if (weights && *weights) {
+        fprintf(stderr, "Error: More weights than sources, aborting.\n");
+        exit(1);
+    }
+
+    /* sources come and go over the control channel */
+    if (attach_path) {
+
+        attach.control = control_create(attach_path);
+        if (!attach.control) {
+            perror(attach_path);
+            exit(2);
+        }
+        attach.zerocopy = zerocopy;
+        attach.files = files;
+
+        /* an add may not clash with a source given on the command line */
+        for (i = 0; i < mux_count; i++) {
+            mux[i].attach_source = attach_source(&attach, mux[i].pathname);
+            mux[i].attach_source->active = 1;
+        }
+
+        for (i = mux_count; i < slots; i++) {
+            fds[i].fd = -1;
+        }
+        fds[slots].fd = control_fd(attach.control);
+        fds[slots].events = POLLIN;
+
+        mux_count = slots;
+
+    }
+
+    /* sanity check - we can only use raw if we're muxing one file */
+    if (raw) {
+        if (mux_count > 1) {
+            fprintf(stderr,
+                    "Error: Raw mode cannot be used with multiple files, aborting.\n");
+            exit(3);
+        }
+        else {
+            if ((rv = archive_write_header(a, mux[0].entry))) {
+                fprintf(stderr, "Could not write header: %s\n",
+                        archive_error_string(a));
+                exit(1);
+            }
+        }
+    }
+
+    /* fragments waiting to be written share one budget of memory */
+    if (depth || uring || sched.coalesce) {
+        sched.arena = arena_create(memory, buffer_size, huge);
+        if (!sched.arena) {
+            fprintf(stderr, "Could not allocate buffer.\n");
+            exit(3);
+        }
+    }
+
+#ifdef HAVE_URING
+    /* without io_uring in the kernel, fall back to poll */
+    if (uring && (ring = uring_create(4 * mux_count + 4))) {
+        mux_uring(&out, mux, mux_count, ring, buffer_size, &sched);
+        uring_destroy(ring);
+    }
+    else
+#endif
+    if (depth) {
+#ifdef HAVE_PTHREAD_H
+        mux_threads(&out, mux, mux_count, buffer_size, depth, &sched);
+#endif
+    }
+    else if (edge) {
+#ifdef HAVE_SYS_EPOLL_H
+        mux_epoll(&out, mux, mux_count, buffer_size, &sched,
+                attach.control ? &attach : NULL);
+#endif
+    }
+    else {
+        mux_poll(&out, mux, fds, mux_count, buffer_size, &sched,
+                attach.control ? &attach : NULL);
+    }
+
+    if (out.pool) {
+        pool_destroy(out.pool);
+    }
+
+    arena_destroy(sched.arena);
+
+    if (!out.direct) {
+        if ((rv = archive_write_close(a))) {
+            fprintf(stderr, "Could not close write: %s\n",
+                    archive_error_string(a));
+            exit(1);
+        }
+    }
+
+    /* how much did the headers cost us? */
+    if (sched.coalesce) {
+        int64_t total = out.direct ? out.offset : archive_filter_bytes(a, 0);
+
+        /* the other lanes as they were left */
+        for (i = 0; i < out.lane_count; i++) {
+            if (i != out.lane) {
+                total += out.lanes[i].offset;
+            }
+        }
+
+        fprintf(stderr,
+                "%s: %" PRId64 " fragments, %" PRId64 " payload bytes, %"
+                PRId64 " overhead bytes, header to payload ratio %.3f\n",
+                name, out.fragments, out.payload, total - out.payload,
+                out.payload ? (double)(total - out.payload) / out.payload : 0);
+    }
+
+    if (!out.direct) {
+        archive_write_free(a);
+    }
+
+    stats_finish(out.stats);
+
+    for (i = 0; i < out.lane_count; i++) {
+        close(out.lanes[i].fd);
+    }
+    free(out.lanes);
+    free(out.lane_poll);
+    free(out_files);
+    free(out.header);
+    free(out.records);
+
+    if (out.index && fclose(out.index)) {
+        fprintf(stderr, "Error: Could not write index: %s\n",
+                strerror(errno));
+        exit(4);
+    }
     free(fds);
     free(mux);
 
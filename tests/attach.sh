@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# A source added over the control channel under the name of one that
+# has ended, whether given on the command line or added before, must
+# carry on the same stream, which tardemux writes out as one file.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+TARDEMUX="${TARDEMUX:-$PWD/tardemux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 99
+
+mkdir out || exit 99
+mkfifo control || exit 99
+for f in first second third; do
+    echo $f > $f || exit 99
+done
+
+# wait for the named closing fragment to reach the archive
+closed() {
+    tries=0
+    until grep -aq "x\.$1" archive.tar; do
+        tries=`expr $tries + 1`
+        test $tries -lt 300 || return 1
+        sleep 0.1
+    done
+}
+
+ln -s first x || exit 99
+
+# headers written directly, so that each fragment reaches the archive
+"$TARMUX" -H -A control x > archive.tar &
+pid=$!
+
+exec 3> control
+closed 1 || exit 1
+rm x && ln -s second x && echo "add x" >&3
+closed 3 || exit 1
+rm x && ln -s third x && echo "add x" >&3
+closed 5 || exit 1
+echo finish >&3
+exec 3>&-
+
+wait $pid || exit 1
+
+(cd out && "$TARDEMUX" -a < ../archive.tar) || exit 1
+
+cat first second third | cmp - out/x || exit 1
+
+exit 0
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Successive tardemux runs sharing one input must each take exactly one
+# tar stream of a concatenation, leaving the next in place, whether the
+# input is a file, a pipe or a socket, and whether or not the streams
+# were written in whole records.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+TARDEMUX="${TARDEMUX:-$PWD/tardemux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 99
+
+seq 1 3000 > x1 || exit 99
+seq 5 7000 > x2 || exit 99
+seq 9 11111 > x3 || exit 99
+
+# through libarchive, with -z from a pipe to a pipe, and with -H
+"$TARMUX" -n a < x1 > s1.tar || exit 1
+cat x2 | "$TARMUX" -z -n a | cat > s2.tar || exit 1
+"$TARMUX" -H -n a < x3 > s3.tar || exit 1
+cat s1.tar s2.tar s3.tar s1.tar > all.tar || exit 99
+
+# one tardemux per stream, each in a directory of its own
+cat > demux.sh <<EOS
+for i in 1 2 3 4; do
+    rm -rf o\$i && mkdir o\$i && (cd o\$i && "$TARDEMUX" -a) || exit 1
+done
+EOS
+
+check() {
+    cmp o1/a x1 && cmp o2/a x2 && cmp o3/a x3 && cmp o4/a x1
+}
+
+sh demux.sh < all.tar && check || exit 1
+
+cat all.tar | sh demux.sh && check || exit 1
+
+if command -v python3 > /dev/null; then
+    python3 - <<'EOS' && check || exit 1
+import socket, subprocess, sys, threading
+
+ours, theirs = socket.socketpair()
+
+def feed():
+    with open("all.tar", "rb") as f:
+        ours.sendall(f.read())
+    ours.shutdown(socket.SHUT_WR)
+
+feeder = threading.Thread(target=feed)
+feeder.start()
+rv = subprocess.call(["sh", "demux.sh"], stdin=theirs)
+theirs.close()
+feeder.join()
+sys.exit(rv)
+EOS
+fi
+
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# The headers tarmux writes directly, with -H, must be byte for byte
+# those libarchive writes, for sources with and without attributes.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 99
+
+LONG=`printf '%0120d' 0`
+DEEP=`printf '%060d' 0`/`printf '%060d' 0`
+
+mkdir -p "sub/dir" "$DEEP" || exit 99
+for f in plain "sub/dir/nested" "$LONG" "$DEEP/deep"; do
+    head -c 5000 /dev/urandom > "$f" || exit 99
+    touch -d "2001-02-03 04:05:06.789" "$f" || exit 99
+done
+
+for f in plain "sub/dir/nested" "$LONG" "$DEEP/deep"; do
+    for options in "" "-k" "-C zstd" "-C lz4"; do
+        "$TARMUX" $options "$f" > archive.tar 2> /dev/null || continue
+        "$TARMUX" -H $options "$f" > direct.tar || exit 1
+        if ! cmp archive.tar direct.tar; then
+            echo "headers differ: $options $f"
+            exit 1
+        fi
+    done
+done
+
+exit 0
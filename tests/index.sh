@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Range extraction through an index must give the bytes asked for, and
+# must exit with 4 when a checksummed fragment is corrupt, whether the
+# damage is inside the range or in the part of the fragment skipped.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+TARDEMUX="${TARDEMUX:-$PWD/tardemux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 99
+
+mkdir out || exit 99
+seq 1 40000 > a || exit 99
+
+for options in "" "-k"; do
+    rm -f index out/a
+    "$TARMUX" $options -i index a > archive.tar || exit 1
+    (cd out && "$TARDEMUX" -i ../index -R 10000-20000 -f ../archive.tar a) \
+            || exit 1
+    tail -c +10001 a | head -c 10000 | cmp - out/a || exit 1
+done
+
+# damage a line before, within and after the range
+for line in 1234 3456 7890; do
+    offset=`grep -boa "^$line\$" archive.tar | cut -d: -f1`
+    test -n "$offset" || exit 99
+    cp archive.tar corrupt.tar || exit 99
+    printf X | dd of=corrupt.tar bs=1 seek=$offset conv=notrunc 2> /dev/null \
+            || exit 99
+    (cd out && "$TARDEMUX" -i ../index -R 10000-20000 -f ../corrupt.tar a \
+            2> /dev/null)
+    rv=$?
+    if test $rv -ne 4; then
+        echo "corrupt line $line: exit $rv, expected 4"
+        exit 1
+    fi
+done
+
+exit 0
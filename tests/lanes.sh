@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Fragments striped across lanes by tarmux must be put back in order by
+# tardemux -L, with lanes that are files and lanes that are pipes, with
+# a reorder buffer smaller than the streams, and when selecting one.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+TARDEMUX="${TARDEMUX:-$PWD/tardemux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+cd "$DIR" || exit 99
+
+mkdir in out || exit 99
+seq 1 50000 > in/a || exit 99
+seq 1 30000 | rev > in/b || exit 99
+head -c 100000 /dev/urandom > in/c || exit 99
+
+LANES="-f ../l0 -f ../l1 -f ../l2"
+
+# compare the named streams written out with the sources, and clear them
+check() {
+    for f in "$@"; do
+        cmp in/$f out/$f || return 1
+    done
+    rm -f out/*
+}
+
+(cd in && "$TARMUX" -b 4096 -f ../l0 -f ../l1 -f ../l2 a b c) || exit 1
+
+(cd out && "$TARDEMUX" -L $LANES -a) || exit 1
+check a b c || exit 1
+
+(cd out && "$TARDEMUX" -L --reorder=8192 $LANES -a) || exit 1
+check a b c || exit 1
+
+(cd out && "$TARDEMUX" -L $LANES -s b) || exit 1
+test ! -e out/a -a ! -e out/c || exit 1
+check b || exit 1
+
+# lanes that are pipes, read as they are written
+rm -f l0 l1 l2
+mkfifo l0 l1 l2 || exit 99
+(cd in && "$TARMUX" -b 4096 -f ../l0 -f ../l1 -f ../l2 a b c) &
+pid=$!
+(cd out && "$TARDEMUX" -L $LANES -a) || exit 1
+wait $pid || exit 1
+check a b c || exit 1
+
+exit 0
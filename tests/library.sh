@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# The library must get its own streams back through a round trip in
+# memory, and must demux the streams tarmux writes, with checksums,
+# compressed, and with the holes of sparse files skipped.
+
+TARMUX="${TARMUX:-$PWD/tarmux}"
+LIBTEST="${LIBTEST:-$PWD/tests/libtarmux}"
+DIR=`mktemp -d` || exit 99
+trap 'rm -rf "$DIR"' 0
+
+"$LIBTEST" || exit 1
+
+cd "$DIR" || exit 99
+
+mkdir out || exit 99
+seq 1 100000 > a || exit 99
+head -c 300000 /dev/urandom > b || exit 99
+
+# a file of holes and data, ending on a hole
+head -c 10000 /dev/urandom > s || exit 99
+head -c 10000 /dev/urandom | dd of=s bs=1 seek=1000000 conv=notrunc \
+        2> /dev/null || exit 99
+truncate -s 2000000 s || exit 99
+
+for options in "-k" "-C zstd" "-C lz4 -k" "-s"; do
+    "$TARMUX" $options a b s > archive.tar 2> /dev/null || continue
+    rm -f out/*
+    "$LIBTEST" out < archive.tar || exit 1
+    for f in a b s; do
+        if ! cmp $f out/$f; then
+            echo "streams differ: $options $f"
+            exit 1
+        fi
+    done
+done
+
+exit 0
@@ -0,0 +1,367 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Exercise the libtarmux API.
+ *
+ * With no arguments, sources are muxed in memory, with and without
+ * checksums, and demuxed again from buffers of random sizes, checking
+ * that each stream comes back whole and that the demuxer stops at the
+ * end of the archive.
+ *
+ * With a directory, the tar stream on stdin is demuxed into a file in
+ * that directory for each stream, leaving the holes of sparse streams.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libtarmux.h"
+
+#define SOURCES 3
+#define STREAMS 8
+
+typedef struct buffer_t
+{
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} buffer_t;
+
+typedef struct stream_t
+{
+    char *pathname;
+    buffer_t data;
+    int64_t index;
+    int64_t position;
+    int fd;
+    int closed;
+} stream_t;
+
+typedef struct sink_t
+{
+    stream_t streams[STREAMS];
+    const char *dir;
+    int count;
+} sink_t;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "libtarmux: %s\n", what);
+    exit(1);
+}
+
+static void append(buffer_t *b, const void *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        b->size = (b->len + len) * 2;
+        b->data = realloc(b->data, b->size);
+        if (!b->data) {
+            fail("could not allocate buffer");
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static int writer(void *ctx, const struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        append(ctx, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    return 0;
+}
+
+static ssize_t reader(void *ctx, void *buf, size_t len)
+{
+    return read(*(int *)ctx, buf, len);
+}
+
+/*
+ * Find the stream the fragment belongs to, checking that it follows on
+ * from the one before.
+ */
+static stream_t *sink_stream(sink_t *s, const tardemux_fragment_t *fragment)
+{
+    stream_t *stream;
+    int i;
+
+    for (i = 0; i < s->count; i++) {
+        if (!strcmp(s->streams[i].pathname, fragment->pathname)) {
+            break;
+        }
+    }
+
+    stream = &s->streams[i];
+
+    if (i == s->count) {
+        if (s->count == STREAMS) {
+            fail("too many streams");
+        }
+        memset(stream, 0, sizeof(stream_t));
+        stream->pathname = strdup(fragment->pathname);
+        stream->index = -1;
+        stream->fd = -1;
+        s->count++;
+
+        if (s->dir) {
+            char path[1024];
+
+            snprintf(path, sizeof(path), "%s/%s", s->dir, fragment->pathname);
+            stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (stream->fd < 0) {
+                perror(path);
+                exit(1);
+            }
+        }
+    }
+
+    if (stream->closed) {
+        fail("fragment after the end of a stream");
+    }
+
+    return stream;
+}
+
+static int sink(void *ctx, const tardemux_fragment_t *fragment,
+        const void *buf, size_t len)
+{
+    sink_t *s = ctx;
+    stream_t *stream = sink_stream(s, fragment);
+
+    /* the first call for each fragment follows on from the last */
+    if (fragment->index != stream->index) {
+        if (fragment->index != stream->index + 1) {
+            fail("fragment out of sequence");
+        }
+        stream->index = fragment->index;
+        if (fragment->offset >= 0) {
+            stream->position = fragment->offset;
+        }
+    }
+
+    if (!len) {
+        stream->closed = 1;
+        if (stream->fd >= 0 && (ftruncate(stream->fd, stream->position)
+                || close(stream->fd))) {
+            fail("could not close stream");
+        }
+        return 0;
+    }
+
+    if (stream->fd >= 0) {
+        if (pwrite(stream->fd, buf, len, stream->position) != (ssize_t)len) {
+            fail("could not write stream");
+        }
+    }
+    else {
+        append(&stream->data, buf, len);
+    }
+    stream->position += len;
+
+    return 0;
+}
+
+/*
+ * Mux the sources in memory in fragments of random sizes, and demux
+ * them again from buffers of random sizes.
+ */
+static void roundtrip(int flags)
+{
+    static const char *names[SOURCES] = {
+        "small", "dir/large",
+        "a/pathname/long/enough/that/it/will/not/fit/in/a/ustar/header/"
+        "without/a/pax/extended/header/to/hold/it/in/full/for/us"
+    };
+    static const size_t sizes[SOURCES] = { 100, 1000000, 300000 };
+    static const char trailer[] = "the next stream";
+
+    tarmux_source_t *sources[SOURCES];
+    unsigned char *data[SOURCES];
+    size_t done[SOURCES] = { 0 };
+    buffer_t archive = { 0 };
+    sink_t s = { { { 0 } } };
+    tarmux_t *mux;
+    tardemux_t *demux;
+    size_t offset = 0, archive_len;
+    int i, open_count = SOURCES;
+
+    mux = tarmux_create(writer, &archive, flags);
+    if (!mux) {
+        fail("could not create muxer");
+    }
+
+    for (i = 0; i < SOURCES; i++) {
+        size_t j;
+
+        data[i] = malloc(sizes[i]);
+        if (!data[i]) {
+            fail("could not allocate source");
+        }
+        for (j = 0; j < sizes[i]; j++) {
+            data[i][j] = rand();
+        }
+        sources[i] = tarmux_add(mux, names[i]);
+        if (!sources[i]) {
+            fail("could not add source");
+        }
+    }
+
+    while (open_count) {
+        for (i = 0; i < SOURCES; i++) {
+            size_t len = 1 + rand() % 20000;
+
+            if (!sources[i]) {
+                continue;
+            }
+            if (len > sizes[i] - done[i]) {
+                len = sizes[i] - done[i];
+            }
+            if (!len) {
+                if (tarmux_remove(mux, sources[i])) {
+                    fail("could not remove source");
+                }
+                sources[i] = NULL;
+                open_count--;
+                continue;
+            }
+            if (tarmux_write(mux, sources[i], data[i] + done[i], len)) {
+                fail("could not write fragment");
+            }
+            done[i] += len;
+        }
+    }
+
+    if (tarmux_finish(mux)) {
+        fail("could not finish archive");
+    }
+    tarmux_destroy(mux);
+
+    /* a stream following the archive must be left alone */
+    archive_len = archive.len;
+    append(&archive, trailer, sizeof(trailer));
+
+    demux = tardemux_create(sink, &s);
+    if (!demux) {
+        fail("could not create demuxer");
+    }
+
+    while (!tardemux_done(demux)) {
+        size_t len = 1 + rand() % 30000;
+        ssize_t used;
+
+        if (len > archive.len - offset) {
+            len = archive.len - offset;
+        }
+        if (!len) {
+            fail("archive ended early");
+        }
+        used = tardemux_push(demux, archive.data + offset, len);
+        if (used < 0) {
+            fail(tardemux_error(demux));
+        }
+        offset += used;
+    }
+    tardemux_destroy(demux);
+
+    if (offset != archive_len) {
+        fail("demuxer did not stop at the end of the archive");
+    }
+
+    if (s.count != SOURCES) {
+        fail("wrong number of streams");
+    }
+    for (i = 0; i < SOURCES; i++) {
+        stream_t *stream = &s.streams[i];
+        int j;
+
+        for (j = 0; j < SOURCES && strcmp(names[j], stream->pathname); j++);
+        if (j == SOURCES || !stream->closed
+                || stream->data.len != sizes[j]
+                || memcmp(stream->data.data, data[j], sizes[j])) {
+            fail("stream did not survive the round trip");
+        }
+        free(stream->data.data);
+        free(stream->pathname);
+    }
+
+    for (i = 0; i < SOURCES; i++) {
+        free(data[i]);
+    }
+    free(archive.data);
+}
+
+/*
+ * Demux the tar stream on stdin into the given directory.
+ */
+static void demux_dir(const char *dir)
+{
+    sink_t s = { { { 0 } } };
+    tardemux_t *demux;
+    unsigned char buffer[65536];
+    int fd = STDIN_FILENO;
+    ssize_t got;
+    int i;
+
+    s.dir = dir;
+
+    demux = tardemux_create(sink, &s);
+    if (!demux) {
+        fail("could not create demuxer");
+    }
+
+    while ((got = tardemux_pull(demux, reader, &fd, buffer, sizeof(buffer)))
+            > 0);
+    if (got < 0) {
+        fail(tardemux_error(demux) ? tardemux_error(demux) : strerror(errno));
+    }
+    tardemux_destroy(demux);
+
+    for (i = 0; i < s.count; i++) {
+        if (!s.streams[i].closed) {
+            fail("stream not closed");
+        }
+        free(s.streams[i].pathname);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        demux_dir(argv[1]);
+        return 0;
+    }
+
+    srand(1);
+
+    roundtrip(0);
+    roundtrip(TARMUX_CHECKSUM);
+
+    return 0;
+}
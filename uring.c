@@ -0,0 +1,248 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+struct uring_t
+{
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned queued;
+    int fixed;
+    int fd;
+};
+
+uring_t *uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    uring_t *ring;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+
+    if (entries > 4096) {
+        entries = 4096;
+    }
+
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* reads and writes at the current position, as read() does */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(uring_t));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes
+            + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring
+            + p.cq_off.cqes);
+
+    return ring;
+
+fail:
+    uring_destroy(ring);
+    return NULL;
+}
+
+int uring_register(uring_t *ring, void *base, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = base;
+    iov.iov_len = len;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+            &iov, 1) < 0) {
+        return -1;
+    }
+
+    ring->fixed = 1;
+
+    return 0;
+}
+
+int uring_fixed(uring_t *ring)
+{
+    return ring->fixed;
+}
+
+struct io_uring_sqe *uring_queue(uring_t *ring, int opcode, int fd,
+        const void *addr, unsigned len, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+
+    /* full, hand what we have to the kernel to make room */
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+            >= ring->sq_entries) {
+        uring_submit(ring, 0);
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = tag;
+
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->queued++;
+
+    return sqe;
+}
+
+void uring_poll(uring_t *ring, int fd, short events, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_queue(ring, IORING_OP_POLL_ADD, fd, NULL, 0, tag);
+    sqe->off = 0;
+    sqe->poll_events = events;
+    sqe->flags |= IOSQE_IO_LINK;
+}
+
+int uring_submit(uring_t *ring, unsigned wait)
+{
+    int rv = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rv < 0) {
+        /* a signal, the caller comes back if still waiting */
+        return errno == EINTR ? 0 : -1;
+    }
+
+    /* anything the kernel did not take goes with the next submit */
+    ring->queued -= rv;
+
+    return 0;
+}
+
+int uring_reap(uring_t *ring, uint64_t *tag, int32_t *res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    cqe = &ring->cqes[head & ring->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+#endif
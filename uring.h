@@ -0,0 +1,113 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+/*
+ * A minimal io_uring, driven through the raw system calls.
+ *
+ * Operations are queued on the submission ring, and are handed to the
+ * kernel in one system call along with the wait for completions, so
+ * that a batch of reads and writes costs one system call rather than
+ * one each. Each operation carries a tag that is handed back with its
+ * result.
+ *
+ * Reads and writes use the current file position, like read() and
+ * write(). Operations on a non blocking descriptor fail with -EAGAIN
+ * rather than waiting, in which case the caller queues a poll linked
+ * to a retry.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) \
+        && defined(__NR_io_uring_register)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+typedef struct uring_t uring_t;
+
+/*
+ * Create a ring able to hold the given number of operations in flight.
+ *
+ * Returns NULL with errno set if io_uring is not available, such as on
+ * an older kernel or where it has been disabled, in which case the
+ * caller falls back to plain system calls.
+ */
+uring_t *uring_create(unsigned entries);
+
+/*
+ * Register a region of memory, so that fixed reads and writes within
+ * it need not map the pages on each operation.
+ *
+ * Returns 0 on success, or -1 if the region could not be registered,
+ * in which case plain reads and writes must be used.
+ */
+int uring_register(uring_t *ring, void *base, size_t len);
+
+/*
+ * Returns non zero if a region has been registered.
+ */
+int uring_fixed(uring_t *ring);
+
+/*
+ * Queue an operation, returning the entry to fill in, submitting the
+ * operations already queued if the ring is full. The opcode is one of
+ * the IORING_OP_* values, the len is the length of the buffer, or the
+ * number of vectors, and the tag is handed back on completion.
+ */
+struct io_uring_sqe *uring_queue(uring_t *ring, int opcode, int fd,
+        const void *addr, unsigned len, uint64_t tag);
+
+/*
+ * Queue a poll for the given events, linked to the operation queued
+ * next, so that the operation runs once the descriptor is ready.
+ */
+void uring_poll(uring_t *ring, int fd, short events, uint64_t tag);
+
+/*
+ * Submit the queued operations, waiting for at least wait of them to
+ * complete.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int uring_submit(uring_t *ring, unsigned wait);
+
+/*
+ * Take the next completion, setting the tag and result of the
+ * operation, the result being a length, or a negative errno.
+ *
+ * Returns 1 if there was a completion, or 0 if there were none.
+ */
+int uring_reap(uring_t *ring, uint64_t *tag, int32_t *res);
+
+/*
+ * Release the ring. Operations still in flight are cancelled.
+ */
+void uring_destroy(uring_t *ring);
+
+#endif
+
+#endif
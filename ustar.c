@@ -0,0 +1,530 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "codec.h"
+#include "crc32c.h"
+#include "sparse.h"
+#include "stats.h"
+#include "ustar.h"
+
+int ustar_octal(unsigned char *field, int digits, int64_t value)
+{
+    int i;
+
+    if (value < 0) {
+        return 1;
+    }
+
+    for (i = digits - 1; i >= 0; i--) {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+
+    return value != 0;
+}
+
+size_t ustar_pax_record(char *buf, const char *key, const char *value)
+{
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t digits = 1;
+
+    while ((size_t)snprintf(NULL, 0, "%zu", len + digits) > digits) {
+        digits++;
+    }
+
+    if (buf) {
+        sprintf(buf, "%zu %s=%s\n", len + digits, key, value);
+    }
+
+    return len + digits;
+}
+
+/*
+ * Format a value into a numeric header field as libarchive does, in
+ * octal with its terminator where it fits, spilling over the terminator
+ * where it does not, and in base-256 across the whole field beyond that.
+ */
+static void ustar_field(unsigned char *field, int digits, int width,
+        int64_t value)
+{
+    int i;
+
+    for (; value >= 0 && digits <= width; digits++) {
+        if (!ustar_octal(field, digits, value)) {
+            return;
+        }
+    }
+
+    for (i = width - 1; i >= 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] |= 0x80;
+}
+
+void ustar_block(unsigned char *block, const char *pathname, size_t len,
+        int mode, int64_t uid, int64_t gid, int64_t size, int64_t mtime,
+        char type, const char *uname, const char *gname)
+{
+    unsigned int checksum = 0;
+    size_t prefixlen;
+    int i;
+
+    memset(block, 0, TAR_BLOCK_SIZE);
+
+    if (ustar_split(pathname, len, &prefixlen)) {
+        len = 100;
+    }
+    if (prefixlen) {
+        memcpy(block + 345, pathname, prefixlen);
+        pathname += prefixlen + 1;
+        len -= prefixlen + 1;
+    }
+
+    memcpy(block, pathname, len);
+    block[106] = ' ';
+    block[114] = ' ';
+    block[122] = ' ';
+    block[135] = ' ';
+    block[147] = ' ';
+    ustar_field(block + 100, 6, 8, mode & 07777);
+    ustar_field(block + 108, 6, 8, uid);
+    ustar_field(block + 116, 6, 8, gid);
+    ustar_field(block + 124, 11, 12, size);
+    ustar_field(block + 136, 11, 11, mtime);
+    memset(block + 148, ' ', 8);
+    block[156] = type;
+    memcpy(block + 257, "ustar\0" "00", 8);
+    if (uname) {
+        strncpy((char *)block + 265, uname, 31);
+    }
+    if (gname) {
+        strncpy((char *)block + 297, gname, 31);
+    }
+    ustar_octal(block + 329, 6, 0);
+    block[335] = ' ';
+    ustar_octal(block + 337, 6, 0);
+    block[343] = ' ';
+
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += block[i];
+    }
+    ustar_octal(block + 148, 6, checksum);
+    block[154] = '\0';
+    block[155] = ' ';
+}
+
+int ustar_split(const char *pathname, size_t len, size_t *prefixlen)
+{
+    const char *slash;
+
+    *prefixlen = 0;
+
+    if (len <= 100) {
+        return 0;
+    }
+
+    /* the first slash that leaves a name that fits, but not a leading one */
+    slash = strchr(pathname + len - 101, '/');
+    if (slash == pathname) {
+        slash = strchr(slash + 1, '/');
+    }
+
+    if (!slash || !slash[1] || slash - pathname > 155) {
+        return 1;
+    }
+
+    *prefixlen = slash - pathname;
+
+    return 0;
+}
+
+void ustar_entry_name(char *dest, const char *src, size_t len,
+        const char *insert)
+{
+    const char *prefix, *prefix_end, *suffix, *suffix_end;
+    const char *filename, *filename_end;
+    size_t suffix_len = 99, insert_len = insert ? strlen(insert) + 2 : 0;
+    int slash = 0;
+    char *p;
+
+    if (len < 100 && !insert) {
+        memcpy(dest, src, len);
+        dest[len] = 0;
+        return;
+    }
+
+    /* the filename, without trailing slashes, held to what fits */
+    filename_end = src + len;
+    for (;;) {
+        if (filename_end > src && filename_end[-1] == '/') {
+            filename_end--;
+            slash = 1;
+        }
+        else if (filename_end > src + 1 && filename_end[-1] == '.'
+                && filename_end[-2] == '/') {
+            filename_end -= 2;
+            slash = 1;
+        }
+        else {
+            break;
+        }
+    }
+    if (slash) {
+        suffix_len--;
+    }
+    filename = filename_end - 1;
+    while (filename > src && *filename != '/') {
+        filename--;
+    }
+    if (*filename == '/' && filename < filename_end - 1) {
+        filename++;
+    }
+    suffix_len -= insert_len;
+    if (filename_end > filename + suffix_len) {
+        filename_end = filename + suffix_len;
+    }
+    suffix_len -= filename_end - filename;
+
+    /* the leading directories that fit the prefix */
+    prefix = src;
+    prefix_end = prefix + 155;
+    if (prefix_end > filename) {
+        prefix_end = filename;
+    }
+    while (prefix_end > prefix && *prefix_end != '/') {
+        prefix_end--;
+    }
+    if (prefix_end < filename && *prefix_end == '/') {
+        prefix_end++;
+    }
+
+    /* the directories after them that fit alongside the filename */
+    suffix = prefix_end;
+    suffix_end = suffix + suffix_len;
+    if (suffix_end > filename) {
+        suffix_end = filename;
+    }
+    if (suffix_end < suffix) {
+        suffix_end = suffix;
+    }
+    while (suffix_end > suffix && *suffix_end != '/') {
+        suffix_end--;
+    }
+    if (suffix_end < filename && *suffix_end == '/') {
+        suffix_end++;
+    }
+
+    p = dest;
+    memcpy(p, prefix, prefix_end - prefix);
+    p += prefix_end - prefix;
+    memcpy(p, suffix, suffix_end - suffix);
+    p += suffix_end - suffix;
+    if (insert) {
+        strcpy(p, insert);
+        p += insert_len - 2;
+        *p++ = '/';
+    }
+    memcpy(p, filename, filename_end - filename);
+    p += filename_end - filename;
+    if (slash) {
+        *p++ = '/';
+    }
+    *p = 0;
+}
+
+/*
+ * Format a time as a pax record value, as libarchive does: the seconds,
+ * followed by the nanoseconds without their trailing zeros, if any.
+ */
+static void ustar_time(char *buf, size_t len, int64_t sec, long nsec)
+{
+    int digits = 9;
+
+    if (!nsec) {
+        snprintf(buf, len, "%" PRId64, sec);
+        return;
+    }
+
+    while (!(nsec % 10)) {
+        nsec /= 10;
+        digits--;
+    }
+
+    snprintf(buf, len, "%" PRId64 ".%0*ld", sec, digits, nsec);
+}
+
+/*
+ * Append the pax records needed by the given header to the given
+ * buffer, returning their length, in the order libarchive writes them.
+ * A NULL buffer measures the records without writing them.
+ */
+static size_t ustar_records(char *buf, const ustar_header_t *h, int long_path)
+{
+    char number[32];
+    size_t len = 0;
+
+    if (long_path) {
+        len += ustar_pax_record(buf ? buf + len : NULL, "path", h->pathname);
+    }
+    if (h->size > 077777777777LL) {
+        snprintf(number, sizeof(number), "%" PRId64, h->size);
+        len += ustar_pax_record(buf ? buf + len : NULL, "size", number);
+    }
+    if (h->gid < 0 || h->gid > 0777777) {
+        snprintf(number, sizeof(number), "%" PRId64, h->gid);
+        len += ustar_pax_record(buf ? buf + len : NULL, "gid", number);
+    }
+    if (h->uid < 0 || h->uid > 0777777) {
+        snprintf(number, sizeof(number), "%" PRId64, h->uid);
+        len += ustar_pax_record(buf ? buf + len : NULL, "uid", number);
+    }
+
+    /*
+     * Once there is a pax extended header, libarchive gives the mtime
+     * to the nanosecond in it too, so that we write the same bytes.
+     */
+    if (h->mtime < 0 || h->mtime > 077777777777LL
+            || ((len || h->records_len) && h->nsec)) {
+        ustar_time(number, sizeof(number), h->mtime, h->nsec);
+        len += ustar_pax_record(buf ? buf + len : NULL, "mtime", number);
+    }
+
+    if (h->records_len) {
+        if (buf) {
+            memcpy(buf + len, h->records, h->records_len);
+        }
+        len += h->records_len;
+    }
+
+    return len;
+}
+
+size_t ustar_header(unsigned char *header, const ustar_header_t *h)
+{
+    char shortname[USTAR_NAME_MAX], paxname[USTAR_NAME_MAX];
+    const char *name = h->pathname;
+    size_t namelen = h->len, prefixlen, pax_len, pax_blocks;
+    int long_path;
+
+    /* names that do not fit the ustar header are shortened to fit */
+    long_path = ustar_split(h->pathname, h->len, &prefixlen);
+    if (long_path) {
+        ustar_entry_name(shortname, h->pathname, h->len, NULL);
+        name = shortname;
+        namelen = strlen(shortname);
+    }
+
+    pax_len = ustar_records(NULL, h, long_path);
+    pax_blocks = pax_len ?
+            1 + (pax_len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE : 0;
+
+    if (!header) {
+        return (pax_blocks + 1) * TAR_BLOCK_SIZE;
+    }
+
+    if (pax_len) {
+        /* the pax entry is named after the entry, in a PaxHeader directory */
+        ustar_entry_name(paxname, name, namelen, "PaxHeader");
+
+        /* the owner and time of the pax entry are held to ustar limits */
+        ustar_block(header, paxname, strlen(paxname), h->mode,
+                h->uid < 0 ? 0 : h->uid > 0777777 ? 0777777 : h->uid,
+                h->gid < 0 ? 0 : h->gid > 0777777 ? 0777777 : h->gid,
+                pax_len, h->mtime < 0 ? 0 : h->mtime, 'x', NULL, NULL);
+        header += TAR_BLOCK_SIZE;
+
+        memset(header, 0, (pax_blocks - 1) * TAR_BLOCK_SIZE);
+        ustar_records((char *)header, h, long_path);
+        header += (pax_blocks - 1) * TAR_BLOCK_SIZE;
+    }
+
+    ustar_block(header, name, namelen, h->mode, h->uid, h->gid, h->size,
+            h->mtime, '0', h->uname, h->gname);
+
+    return (pax_blocks + 1) * TAR_BLOCK_SIZE;
+}
+
+void ustar_pax_reset(ustar_pax_t *pax)
+{
+    memset(pax, 0, sizeof(ustar_pax_t));
+    pax->size = -1;
+    pax->codec = CODEC_NONE;
+    pax->crc = -1;
+    pax->sparse = -1;
+}
+
+int ustar_pax(ustar_pax_t *pax, char *buf, size_t len)
+{
+    char *end = buf + len;
+
+    while (buf < end) {
+        char *key, *value, *record = buf;
+        size_t reclen = 0;
+
+        while (buf < end && isdigit((unsigned char)*buf)) {
+            reclen = reclen * 10 + (*buf++ - '0');
+        }
+        if (buf >= end || *buf != ' ' || reclen == 0
+                || reclen > (size_t)(end - record)
+                || record[reclen - 1] != '\n') {
+            return -1;
+        }
+        key = buf + 1;
+        record[reclen - 1] = 0;
+        value = strchr(key, '=');
+        if (value) {
+            *value++ = 0;
+            if (!strcmp(key, "path")) {
+                pax->path = value;
+            }
+            else if (!strcmp(key, "size")) {
+                pax->size = strtoll(value, NULL, 10);
+            }
+            else if (!strcmp(key, "SCHILY.xattr." CODEC_ATTR_NAME)) {
+                pax->codec = codec_parse(value, NULL);
+            }
+            else if (!strcmp(key, "SCHILY.xattr." CODEC_ATTR_SIZE)) {
+                pax->original = strtoll(value, NULL, 10);
+            }
+            else if (!strcmp(key, "SCHILY.xattr." CRC32C_ATTR_NAME)) {
+                pax->crc = strtoul(value, NULL, 16);
+            }
+            else if (!strcmp(key, "SCHILY.xattr." SPARSE_ATTR_OFFSET)) {
+                pax->sparse = strtoll(value, NULL, 10);
+            }
+            else if (!strcmp(key, "SCHILY.xattr." STATS_ATTR_TIME)) {
+                pax->stamp = value;
+            }
+        }
+        buf = record + reclen;
+    }
+
+    return 0;
+}
+
+size_t ustar_pathname(char *dest, const unsigned char *block)
+{
+    const char *name = (const char *)block;
+    const char *prefix = (const char *)block + 345;
+    size_t namelen = strnlen(name, 100);
+    size_t prefixlen = strnlen(prefix, 155);
+
+    /* only a ustar header has a prefix */
+    if (memcmp(block + 257, "ustar\0", 6)) {
+        prefixlen = 0;
+    }
+
+    if (prefixlen) {
+        memcpy(dest, prefix, prefixlen);
+        dest[prefixlen++] = '/';
+    }
+    memcpy(dest + prefixlen, name, namelen);
+    dest[prefixlen + namelen] = 0;
+
+    return prefixlen + namelen;
+}
+
+int ustar_pathlen(const char *pathname, intmax_t *index)
+{
+    const char *slider;
+
+    *index = -1;
+
+    slider = strrchr(pathname, '.');
+
+    if (slider) {
+        intmax_t value = 0;
+        int i, offset, valid = 1;
+
+        offset = slider - pathname;
+
+        i = offset + 1;
+        while (pathname[i]) {
+            if (!isdigit(pathname[i])) {
+                valid = 0;
+            }
+            else {
+                value *= 10;
+                value += (pathname[i] - '0');
+            }
+            i++;
+        }
+
+        if (valid) {
+            if (i > offset + 1) {
+                *index = value;
+            }
+            return offset;
+        }
+
+        return i;
+    }
+
+    return strlen(pathname);
+}
+
+int64_t ustar_number(const unsigned char *field, size_t len)
+{
+    int64_t value = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80) {
+        value = field[0] & 0x3f;
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    while (i < len && field[i] >= '0' && field[i] <= '7') {
+        value = (value << 3) + (field[i] - '0');
+        i++;
+    }
+
+    return value;
+}
+
+int ustar_checksum(const unsigned char *block)
+{
+    int64_t expected = ustar_number(block + 148, 8);
+    int64_t usum = 0, ssum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : block[i];
+        usum += c;
+        ssum += (signed char)c;
+    }
+
+    return expected == usum || expected == ssum;
+}
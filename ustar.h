@@ -0,0 +1,177 @@
+/**
+ *    (C) 2016 Graham Leggett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+
+#ifndef USTAR_H
+#define USTAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The ustar format.
+ *
+ * Shared by tarmux, tardemux and libtarmux, so that the three agree
+ * on the exact bytes of a fragment.
+ */
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE 10240
+
+/* the longest pathname a ustar header holds, prefix and name together */
+#define USTAR_NAME_MAX (155 + 1 + 100 + 1)
+
+/*
+ * Format a value as zero padded octal into a ustar header field.
+ *
+ * Returns non-zero if the value does not fit.
+ */
+int ustar_octal(unsigned char *field, int digits, int64_t value);
+
+/*
+ * Fill in a single ustar header block, calculating the checksum. The
+ * pathname is split between the prefix and name fields where it must
+ * be, and is cut short if it fits neither way.
+ *
+ * Numeric fields that do not fit are written as libarchive writes them,
+ * in octal over the terminator, or else in base-256, and should also be
+ * given in a pax extended header by the caller.
+ */
+void ustar_block(unsigned char *block, const char *pathname, size_t len,
+        int mode, int64_t uid, int64_t gid, int64_t size, int64_t mtime,
+        char type, const char *uname, const char *gname);
+
+/*
+ * The fields of the header of one fragment.
+ */
+typedef struct ustar_header_t
+{
+    const char *pathname;
+    size_t len;
+    const char *uname;
+    const char *gname;
+    /* further pax records, written after our own */
+    const char *records;
+    size_t records_len;
+    int64_t uid;
+    int64_t gid;
+    int64_t size;
+    int64_t mtime;
+    long nsec;
+    int mode;
+} ustar_header_t;
+
+/*
+ * Build the header of a fragment, returning its length. A plain ustar
+ * header is used where the fragment fits, otherwise a pax extended
+ * header is prepended, holding the records libarchive would write in
+ * pax_restricted mode, in the same order, so that the bytes match. A
+ * NULL header measures the header without building it.
+ */
+size_t ustar_header(unsigned char *header, const ustar_header_t *h);
+
+/*
+ * The attributes of a fragment given in a pax extended header. The
+ * path and stamp point into the records parsed, and are NULL where not
+ * given. Sizes and offsets not given are -1, but for the original size
+ * of a compressed fragment, which is zero.
+ */
+typedef struct ustar_pax_t
+{
+    const char *path;
+    const char *stamp;
+    int64_t size;
+    int64_t original;
+    int64_t crc;
+    int64_t sparse;
+    int codec;
+} ustar_pax_t;
+
+/*
+ * Set the attributes to those of a fragment without a pax extended
+ * header.
+ */
+void ustar_pax_reset(ustar_pax_t *pax);
+
+/*
+ * Parse the records of a pax extended header, picking out the
+ * attributes we care about. The records are terminated in place.
+ *
+ * Returns -1 if the records are corrupt.
+ */
+int ustar_pax(ustar_pax_t *pax, char *buf, size_t len);
+
+/*
+ * Join the prefix and name fields of a ustar header into the given
+ * pathname, which must have room for USTAR_NAME_MAX bytes, returning
+ * its length.
+ */
+size_t ustar_pathname(char *dest, const unsigned char *block);
+
+/*
+ * Split a pathname between the name and prefix fields of a ustar
+ * header, as libarchive does, setting prefixlen to the length of the
+ * prefix, or to zero if the pathname fits the name field whole. The
+ * name follows the slash after the prefix.
+ *
+ * Returns non-zero if the pathname fits neither way, and must be given
+ * in a pax extended header.
+ */
+int ustar_split(const char *pathname, size_t len, size_t *prefixlen);
+
+/*
+ * Shorten the given pathname to one that fits a ustar header, as
+ * libarchive does for an entry whose pathname is given in a pax
+ * extended header, keeping as many of the leading directories and as
+ * much of the filename as fit. When insert is given, it is added as a
+ * directory before the filename, as libarchive names the pax extended
+ * header itself.
+ *
+ * The destination must have room for USTAR_NAME_MAX bytes.
+ */
+void ustar_entry_name(char *dest, const char *src, size_t len,
+        const char *insert);
+
+/*
+ * Append a pax extended header record to the given buffer, returning
+ * the length of the record. The length prefix counts itself. A NULL
+ * buffer measures the record without writing it.
+ */
+size_t ustar_pax_record(char *buf, const char *key, const char *value);
+
+/*
+ * Parse a numeric tar header field, in octal or in base-256.
+ */
+int64_t ustar_number(const unsigned char *field, size_t len);
+
+/*
+ * Verify the checksum of a tar header block, accepting both the
+ * unsigned and the historical signed sum.
+ */
+int ustar_checksum(const unsigned char *block);
+
+/*
+ * Returns the length of the path, ignoring any trailing
+ * numeric suffix following the last dot, and sets index to
+ * the value of the suffix.
+ *
+ * If the path does not contain a numeric suffix, the
+ * length of the whole path is returned, and index is set
+ * to -1.
+ */
+int ustar_pathlen(const char *pathname, intmax_t *index);
+
+#endif